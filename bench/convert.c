@@ -0,0 +1,109 @@
+// Times buffer_to_fb() for every format on a full frame and tile by tile,
+// on the y-inverted normal path that most compositors hand us and on a
+// rotated one.
+//
+//   bench_convert [WIDTH HEIGHT]
+
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "utils.h"
+
+
+#define BENCH_RUNS 5
+#define BENCH_ITERATIONS 20
+#define BENCH_TILE 32u
+
+
+static const enum wl_shm_format formats[] = {
+	WL_SHM_FORMAT_XRGB8888,
+	WL_SHM_FORMAT_XBGR8888,
+	WL_SHM_FORMAT_XRGB2101010,
+	WL_SHM_FORMAT_XBGR2101010,
+	WL_SHM_FORMAT_RGB565,
+	WL_SHM_FORMAT_BGR565,
+};
+
+
+static void convert_frame(rgba_t *fb, struct wvnc_capture *capture, struct wvnc_buffer *buffer)
+{
+	buffer_to_fb(fb, capture, buffer, 0, 0, buffer->width, buffer->height);
+}
+
+
+static void convert_tiles(rgba_t *fb, struct wvnc_capture *capture, struct wvnc_buffer *buffer)
+{
+	for (uint32_t y = 0; y < buffer->height; y += BENCH_TILE) {
+		for (uint32_t x = 0; x < buffer->width; x += BENCH_TILE) {
+			buffer_to_fb(fb, capture, buffer, x, y, min(BENCH_TILE, buffer->width - x),
+						 min(BENCH_TILE, buffer->height - y));
+		}
+	}
+}
+
+
+// Best of a few runs, in ms per conversion
+static double time_conversion(void (*convert)(rgba_t *, struct wvnc_capture *, struct wvnc_buffer *),
+							  rgba_t *fb, struct wvnc_capture *capture, struct wvnc_buffer *buffer)
+{
+	uint64_t best = UINT64_MAX;
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		uint64_t start = time_monotonic_ns();
+		for (int i = 0; i < BENCH_ITERATIONS; i++) {
+			convert(fb, capture, buffer);
+		}
+		best = min(best, time_monotonic_ns() - start);
+	}
+	return best / 1e6 / BENCH_ITERATIONS;
+}
+
+
+int main(int argc, char *argv[])
+{
+	uint32_t width = 1920, height = 1080;
+	if (argc == 3) {
+		width = atoi(argv[1]);
+		height = atoi(argv[2]);
+	}
+	if (width == 0 || height == 0) {
+		fail("Usage: %s [WIDTH HEIGHT]", argv[0]);
+	}
+	rgba_t *fb = xmalloc((size_t)width * height * sizeof(rgba_t));
+
+	printf("%ux%u, ms per frame\n", width, height);
+	printf("%-12s %8s %8s %8s\n", "format", "frame", "tiles", "90");
+	for (size_t i = 0; i < ARRAY_SIZE(formats); i++) {
+		uint32_t bpp = buffer_bytes_per_pixel(formats[i]);
+		struct wvnc_buffer buffer = {
+			.width = width,
+			.height = height,
+			.stride = width * bpp,
+			.format = formats[i],
+			.y_invert = true,
+		};
+		buffer.data = xmalloc((size_t)buffer.stride * height);
+		// Anything but a constant, so that no format gets lucky
+		for (size_t j = 0; j < (size_t)buffer.stride * height; j++) {
+			((uint8_t *)buffer.data)[j] = j * 2654435761u >> 24;
+		}
+
+		struct wvnc_capture capture = {
+			.width = width,
+			.height = height,
+			.fb_width = width,
+			.fb_height = height,
+			.transform = WL_OUTPUT_TRANSFORM_NORMAL,
+		};
+		double frame = time_conversion(convert_frame, fb, &capture, &buffer);
+		double tiles = time_conversion(convert_tiles, fb, &capture, &buffer);
+		capture.transform = WL_OUTPUT_TRANSFORM_90;
+		capture.fb_width = height;
+		capture.fb_height = width;
+		double rotated = time_conversion(convert_frame, fb, &capture, &buffer);
+		printf("%-12s %8.2f %8.2f %8.2f\n", buffer_format_name(formats[i]), frame, tiles, rotated);
+		free(buffer.data);
+	}
+	free(fb);
+	return 0;
+}
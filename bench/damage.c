@@ -0,0 +1,207 @@
+// Replays a text editing session on a page of glyphs: a caret blinking
+// every 15 frames and a glyph typed every 4. Times the per-pixel tile diff
+// against the row spans of buffer_diff_span(), checks that both find the
+// same tiles, and shows what each --granularity leaves to send, raw and
+// as Hextile.
+//
+//   bench_damage [FRAMES]
+
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "encode.h"
+#include "utils.h"
+
+
+#define BENCH_WIDTH 1920u
+#define BENCH_HEIGHT 1080u
+#define BENCH_TILE 32u
+#define BENCH_COLUMNS ((BENCH_WIDTH + BENCH_TILE - 1) / BENCH_TILE)
+#define BENCH_ROWS ((BENCH_HEIGHT + BENCH_TILE - 1) / BENCH_TILE)
+#define BENCH_TILES (BENCH_COLUMNS * BENCH_ROWS)
+
+#define GLYPH_WIDTH 9
+#define GLYPH_HEIGHT 16
+#define LINE_ADVANCE 20
+#define CHAR_ADVANCE 12
+#define CARET_WIDTH 2
+#define CARET_HEIGHT 18
+
+#define BACKGROUND 0xffffff
+#define INK 0x202020
+
+
+static const uint32_t granularities[] = { 32, 16, 8, 4, 1 };
+
+// Bounding box of the damage in each tile, empty while x2 is 0
+struct box {
+	uint32_t x1, y1, x2, y2;
+};
+
+
+static void draw_glyph(uint32_t *pixels, uint32_t x, uint32_t y, unsigned int seed)
+{
+	srand(seed);
+	for (uint32_t j = 0; j < GLYPH_HEIGHT; j++) {
+		for (uint32_t i = 0; i < GLYPH_WIDTH; i++) {
+			pixels[(y + j) * BENCH_WIDTH + x + i] = rand() % 3 == 0 ? INK : BACKGROUND;
+		}
+	}
+}
+
+
+static void draw_caret(uint32_t *pixels, uint32_t x, uint32_t y, bool visible)
+{
+	for (uint32_t j = 0; j < CARET_HEIGHT; j++) {
+		for (uint32_t i = 0; i < CARET_WIDTH; i++) {
+			pixels[(y + j) * BENCH_WIDTH + x + i] = visible ? INK : BACKGROUND;
+		}
+	}
+}
+
+
+// What update_framebuffer() did before spans, one pixel at a time
+static void diff_pixels(const uint32_t *a, const uint32_t *b, uint64_t *bits)
+{
+	memset(bits, 0, (BENCH_TILES + 63) / 64 * sizeof(uint64_t));
+	for (uint32_t y = 0; y < BENCH_HEIGHT; y++) {
+		for (uint32_t x = 0; x < BENCH_WIDTH; x++) {
+			if (a[y * BENCH_WIDTH + x] != b[y * BENCH_WIDTH + x]) {
+				uint32_t tile = y / BENCH_TILE * BENCH_COLUMNS + x / BENCH_TILE;
+				bits[tile / 64] |= 1ull << (tile % 64);
+			}
+		}
+	}
+}
+
+
+static void diff_spans(const uint32_t *a, const uint32_t *b, struct box *boxes)
+{
+	memset(boxes, 0, BENCH_TILES * sizeof(*boxes));
+	for (uint32_t y = 0; y < BENCH_HEIGHT; y++) {
+		for (uint32_t tx = 0; tx < BENCH_COLUMNS; tx++) {
+			uint32_t x = tx * BENCH_TILE;
+			uint32_t w = min(BENCH_TILE, BENCH_WIDTH - x);
+			uint32_t first, last;
+			if (!buffer_diff_span((const uint8_t *)(a + y * BENCH_WIDTH + x),
+								  (const uint8_t *)(b + y * BENCH_WIDTH + x),
+								  w * 4, 4, &first, &last)) {
+				continue;
+			}
+			struct box *box = &boxes[y / BENCH_TILE * BENCH_COLUMNS + tx];
+			if (box->x2 == 0) {
+				*box = (struct box) { x + first, y, x + last + 1, y + 1 };
+			} else {
+				box->x1 = min(box->x1, x + first);
+				box->x2 = max(box->x2, x + last + 1);
+				box->y2 = y + 1;
+			}
+		}
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 600;
+	if (frames <= 0) {
+		fail("Usage: %s [FRAMES]", argv[0]);
+	}
+	size_t size = BENCH_WIDTH * BENCH_HEIGHT * sizeof(uint32_t);
+	uint32_t *previous = xmalloc(size);
+	uint32_t *current = xmalloc(size);
+	uint64_t bits[(BENCH_TILES + 63) / 64];
+	struct box *boxes = xmalloc(BENCH_TILES * sizeof(*boxes));
+	uint8_t *pixels = xmalloc(BENCH_TILE * BENCH_TILE * 4);
+	uint8_t *encoded = xmalloc(encode_hextile_max_size(4, BENCH_TILE, BENCH_TILE));
+
+	for (uint32_t i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++) {
+		previous[i] = BACKGROUND;
+	}
+	for (uint32_t line = 0; line < 50; line++) {
+		for (uint32_t column = 0; column < 150; column++) {
+			if (rand() % 5 != 0) {
+				draw_glyph(previous, 10 + column * CHAR_ADVANCE, 10 + line * LINE_ADVANCE,
+						   line * 1000 + column);
+			}
+		}
+	}
+
+	uint64_t pixel_time = 0, span_time = 0, dirty_tiles = 0;
+	uint64_t area[ARRAY_SIZE(granularities)] = { 0 };
+	uint64_t hextile_bytes[ARRAY_SIZE(granularities)] = { 0 };
+	uint32_t caret_x = 100, caret_y = 500;
+	bool caret = true;
+	for (int f = 0; f < frames; f++) {
+		memcpy(current, previous, size);
+		if (f % 15 == 0) {
+			caret = !caret;
+			draw_caret(current, caret_x, caret_y, caret);
+		}
+		if (f % 4 == 0) {
+			draw_glyph(current, caret_x, caret_y, f);
+			caret_x += CHAR_ADVANCE;
+			if (caret_x > 1800) {
+				caret_x = 10;
+				caret_y += LINE_ADVANCE;
+			}
+		}
+
+		uint64_t start = time_monotonic_ns();
+		diff_pixels(previous, current, bits);
+		uint64_t middle = time_monotonic_ns();
+		diff_spans(previous, current, boxes);
+		span_time += time_monotonic_ns() - middle;
+		pixel_time += middle - start;
+
+		for (uint32_t tile = 0; tile < BENCH_TILES; tile++) {
+			bool dirty = bits[tile / 64] & (1ull << (tile % 64));
+			struct box *box = &boxes[tile];
+			if (dirty != (box->x2 != 0)) {
+				fail("Frame %d: tile %u differs between the diffs", f, tile);
+			}
+			if (!dirty) {
+				continue;
+			}
+			dirty_tiles++;
+			// Rounded the way update_framebuffer() does, within the tile
+			uint32_t tile_x = tile % BENCH_COLUMNS * BENCH_TILE;
+			uint32_t tile_y = tile / BENCH_COLUMNS * BENCH_TILE;
+			for (size_t g = 0; g < ARRAY_SIZE(granularities); g++) {
+				uint32_t step = granularities[g];
+				uint32_t x1 = box->x1 / step * step, y1 = box->y1 / step * step;
+				uint32_t x2 = min((box->x2 + step - 1) / step * step,
+								  min(tile_x + BENCH_TILE, BENCH_WIDTH));
+				uint32_t y2 = min((box->y2 + step - 1) / step * step,
+								  min(tile_y + BENCH_TILE, BENCH_HEIGHT));
+				uint32_t w = x2 - x1, h = y2 - y1;
+				for (uint32_t j = 0; j < h; j++) {
+					memcpy(pixels + j * w * 4, current + (y1 + j) * BENCH_WIDTH + x1, w * 4);
+				}
+				area[g] += w * h;
+				// With the rectangle header
+				hextile_bytes[g] += 12 + encode_hextile(encoded, pixels, 4, w, h);
+			}
+		}
+		uint32_t *swap = previous;
+		previous = current;
+		current = swap;
+	}
+
+	printf("%ux%u, %d frames, %lu dirty tiles\n", BENCH_WIDTH, BENCH_HEIGHT, frames, dirty_tiles);
+	printf("%-12s %10s %10s %12s\n", "granularity", "pixels", "raw KiB", "hextile KiB");
+	for (size_t g = 0; g < ARRAY_SIZE(granularities); g++) {
+		printf("%-12u %10lu %10lu %12lu\n", granularities[g], area[g],
+			   area[g] * 4 / 1024, hextile_bytes[g] / 1024);
+	}
+	printf("diff per frame: per pixel %.2f ms, row spans %.2f ms\n",
+		   pixel_time / 1e6 / frames, span_time / 1e6 / frames);
+
+	free(encoded);
+	free(pixels);
+	free(boxes);
+	free(current);
+	free(previous);
+	return 0;
+}
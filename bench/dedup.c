@@ -0,0 +1,276 @@
+// Replays window drags, a workspace switch and scrolling on a simulated
+// desktop, once on a tiled wallpaper and once on a photo, and shows how
+// much of the Hextile update CopyRect saves. A client framebuffer is kept
+// along, with the copies applied in the order they are sent, and checked
+// against the server's after every update.
+//
+//   bench_dedup [FRAMES]
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "encode.h"
+#include "utils.h"
+
+
+#define BENCH_WIDTH 1280u
+#define BENCH_HEIGHT 800u
+#define BENCH_TILE 32u
+#define BENCH_COLUMNS ((BENCH_WIDTH + BENCH_TILE - 1) / BENCH_TILE)
+#define BENCH_ROWS ((BENCH_HEIGHT + BENCH_TILE - 1) / BENCH_TILE)
+#define BENCH_TILES (BENCH_COLUMNS * BENCH_ROWS)
+
+#define WINDOW_WIDTH 480u
+#define WINDOW_HEIGHT 320u
+// Frames between workspace switches
+#define SWITCH_INTERVAL 10
+// With the rectangle header
+#define COPY_BYTES (12 + 4)
+
+
+enum background {
+	BACKGROUND_WALLPAPER,  // Repeats every two tiles
+	BACKGROUND_PHOTO,      // Different everywhere
+};
+
+struct scenario {
+	const char *name;
+	int drag;    // px per frame, window drag
+	bool flip;   // workspace switch
+	int scroll;  // px per frame, document scrolling
+};
+
+static const struct scenario scenarios[] = {
+	{ .name = "drag by 32 px", .drag = 32 },
+	{ .name = "drag by 7 px", .drag = 7 },
+	{ .name = "workspace switch", .flip = true },
+	{ .name = "scroll by 32 px", .scroll = 32 },
+};
+
+
+static rgba_t fb[BENCH_WIDTH * BENCH_HEIGHT];
+static rgba_t client_fb[BENCH_WIDTH * BENCH_HEIGHT];
+static rgba_t next[BENCH_WIDTH * BENCH_HEIGHT];
+static uint64_t tile_generation[BENCH_TILES];
+
+
+static uint32_t noise(uint32_t x, uint32_t y, uint32_t seed)
+{
+	uint32_t h = x * 0x9e3779b1u ^ y * 0x85ebca77u ^ seed * 0xc2b2ae3du;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
+
+
+static rgba_t noise_pixel(uint32_t x, uint32_t y, uint32_t seed)
+{
+	uint32_t n = noise(x, y, seed);
+	return (rgba_t) { .r = n, .g = n >> 8, .b = n >> 16 };
+}
+
+
+static rgba_t background_pixel(enum background background, uint32_t x, uint32_t y)
+{
+	if (background == BACKGROUND_WALLPAPER) {
+		return noise_pixel(x % (2 * BENCH_TILE), y % (2 * BENCH_TILE), 7);
+	}
+	return (rgba_t) {
+		.r = x * 255 / BENCH_WIDTH,
+		.g = y * 255 / BENCH_HEIGHT,
+		.b = 96 + (noise(x, y, 3) & 31),
+	};
+}
+
+
+// Window contents, from the window's own origin
+static rgba_t window_pixel(uint32_t x, uint32_t y, uint32_t seed)
+{
+	if (x < 2 || y < 2 || x >= WINDOW_WIDTH - 2 || y >= WINDOW_HEIGHT - 2) {
+		return (rgba_t) { .r = 40, .g = 40, .b = 40 };
+	}
+	return noise_pixel(x, y, seed);
+}
+
+
+static void render(const struct scenario *scenario, enum background background, int frame)
+{
+	for (uint32_t y = 0; y < BENCH_HEIGHT; y++) {
+		for (uint32_t x = 0; x < BENCH_WIDTH; x++) {
+			next[y * BENCH_WIDTH + x] = background_pixel(background, x, y);
+		}
+	}
+	uint32_t window_x = 64, window_y = 160, seed = 1;
+	uint32_t width = WINDOW_WIDTH, height = WINDOW_HEIGHT, offset = 0;
+	if (scenario->drag != 0) {
+		// Back and forth across the screen
+		uint32_t range = BENCH_WIDTH - WINDOW_WIDTH - 64;
+		uint32_t travel = (uint32_t)(frame * scenario->drag) % (2 * range);
+		window_x = 32 + (travel < range ? travel : 2 * range - travel);
+	} else if (scenario->flip) {
+		bool other = frame / SWITCH_INTERVAL % 2;
+		window_x = other ? 640 : 96;
+		window_y = other ? 320 : 96;
+		seed = other ? 2 : 1;
+	} else if (scenario->scroll != 0) {
+		// A document filling the height of the screen
+		window_x = 160;
+		window_y = 0;
+		width = 960;
+		height = BENCH_HEIGHT;
+		offset = frame * scenario->scroll;
+	}
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			rgba_t pixel = scenario->scroll != 0 ?
+				noise_pixel(x, y + offset, seed) : window_pixel(x, y, seed);
+			next[(window_y + y) * BENCH_WIDTH + window_x + x] = pixel;
+		}
+	}
+}
+
+
+static void tile_rect(unsigned int tile, uint32_t *x, uint32_t *y, uint32_t *w, uint32_t *h)
+{
+	*x = tile % BENCH_COLUMNS * BENCH_TILE;
+	*y = tile / BENCH_COLUMNS * BENCH_TILE;
+	*w = min(BENCH_TILE, BENCH_WIDTH - *x);
+	*h = min(BENCH_TILE, BENCH_HEIGHT - *y);
+}
+
+
+static bool tile_differs(const rgba_t *a, const rgba_t *b, unsigned int tile)
+{
+	uint32_t x, y, w, h;
+	tile_rect(tile, &x, &y, &w, &h);
+	for (uint32_t row = y; row < y + h; row++) {
+		if (memcmp(a + row * BENCH_WIDTH + x, b + row * BENCH_WIDTH + x, w * sizeof(rgba_t))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static void copy_tile(rgba_t *dest_fb, unsigned int dest, const rgba_t *src_fb, unsigned int source)
+{
+	uint32_t x, y, w, h, src_x, src_y;
+	tile_rect(dest, &x, &y, &w, &h);
+	tile_rect(source, &src_x, &src_y, &w, &h);
+	for (uint32_t row = 0; row < h; row++) {
+		memmove(dest_fb + (y + row) * BENCH_WIDTH + x,
+				src_fb + (src_y + row) * BENCH_WIDTH + src_x, w * sizeof(rgba_t));
+	}
+}
+
+
+static bool tile_solid(unsigned int tile)
+{
+	uint32_t x, y, w, h;
+	tile_rect(tile, &x, &y, &w, &h);
+	uint32_t first = *(const uint32_t *)&fb[y * BENCH_WIDTH + x];
+	for (uint32_t row = y; row < y + h; row++) {
+		for (uint32_t i = x; i < x + w; i++) {
+			if (*(const uint32_t *)&fb[row * BENCH_WIDTH + i] != first) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+
+static size_t hextile_size(unsigned int tile, uint8_t *pixels, uint8_t *encoded)
+{
+	uint32_t x, y, w, h;
+	tile_rect(tile, &x, &y, &w, &h);
+	for (uint32_t row = 0; row < h; row++) {
+		memcpy(pixels + row * w * 4, fb + (y + row) * BENCH_WIDTH + x, w * 4);
+	}
+	return 12 + encode_hextile(encoded, pixels, 4, w, h);
+}
+
+
+// Returns the saving in percent of the Hextile bytes, leaving out the
+// first frame, which goes out in full either way
+static double run(const struct scenario *scenario, enum background background, int frames)
+{
+	struct dedup dedup;
+	dedup_init(&dedup, BENCH_WIDTH, BENCH_HEIGHT, BENCH_TILE);
+	memset(fb, 0, sizeof(fb));
+	memset(client_fb, 0, sizeof(client_fb));
+	memset(tile_generation, 0, sizeof(tile_generation));
+	uint8_t *pixels = xmalloc(BENCH_TILE * BENCH_TILE * 4);
+	uint8_t *encoded = xmalloc(encode_hextile_max_size(4, BENCH_TILE, BENCH_TILE));
+	uint64_t hextile_bytes = 0, dedup_bytes = 0;
+
+	for (int frame = 0; frame < frames; frame++) {
+		uint64_t generation = frame + 1;
+		render(scenario, background, frame);
+		for (unsigned int tile = 0; tile < BENCH_TILES; tile++) {
+			if (!tile_differs(fb, next, tile)) {
+				continue;
+			}
+			// The way update_framebuffer() goes about it
+			uint32_t tile_x = tile % BENCH_COLUMNS, tile_y = tile / BENCH_COLUMNS;
+			dedup_save(&dedup, fb, tile_x, tile_x + 1, tile_y, tile_y + 1, generation);
+			copy_tile(fb, tile, next, tile);
+			tile_generation[tile] = generation;
+		}
+		dedup_frame(&dedup, fb, tile_generation, generation);
+
+		// The client got all of the frame before
+		dedup_begin(&dedup);
+		for (unsigned int tile = 0; tile < BENCH_TILES; tile++) {
+			if (tile_generation[tile] == generation && !tile_solid(tile)) {
+				dedup_find(&dedup, fb, tile_generation, tile, generation - 1);
+			}
+		}
+		dedup_order(&dedup);
+		for (unsigned int i = 0; i < dedup.copy_count; i++) {
+			copy_tile(client_fb, dedup.copies[i].dest, client_fb, dedup.copies[i].source);
+			dedup_bytes += COPY_BYTES;
+		}
+		for (unsigned int tile = 0; tile < BENCH_TILES; tile++) {
+			if (tile_generation[tile] != generation) {
+				continue;
+			}
+			size_t size = hextile_size(tile, pixels, encoded);
+			if (frame > 0) {
+				hextile_bytes += size;
+			}
+			if (!dedup_copied(&dedup, tile)) {
+				dedup_bytes += frame > 0 ? size : 0;
+				copy_tile(client_fb, tile, fb, tile);
+			}
+		}
+		if (memcmp(client_fb, fb, sizeof(fb))) {
+			fail("%s: frame %d differs on the client", scenario->name, frame);
+		}
+	}
+
+	free(encoded);
+	free(pixels);
+	dedup_destroy(&dedup);
+	return hextile_bytes > 0 ? 100.0 * (hextile_bytes - dedup_bytes) / hextile_bytes : 0.0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 60;
+	if (frames <= 0) {
+		fail("Usage: %s [FRAMES]", argv[0]);
+	}
+	printf("%ux%u, %d frames, Hextile bytes saved by CopyRect\n",
+		   BENCH_WIDTH, BENCH_HEIGHT, frames);
+	printf("%-18s %10s %10s\n", "scenario", "wallpaper", "photo");
+	for (size_t i = 0; i < ARRAY_SIZE(scenarios); i++) {
+		double wallpaper = run(&scenarios[i], BACKGROUND_WALLPAPER, frames);
+		double photo = run(&scenarios[i], BACKGROUND_PHOTO, frames);
+		printf("%-18s %9.0f%% %9.0f%%\n", scenarios[i].name, wallpaper, photo);
+	}
+	return 0;
+}
@@ -0,0 +1,252 @@
+// Times pointer events from the client socket to their injection while
+// wvnc is busy serving a replay, such as full-screen video recorded with
+// --record:
+//
+//   wvnc --replay video.rec --unix /tmp/wvnc.sock --replay-input /tmp/wvnc.input &
+//   bench_input_latency /tmp/wvnc.sock /tmp/wvnc.input [SCENARIO[@RATE]]
+//
+// SCENARIO is one of the pointer scenarios of --bench-input, drag (the
+// default) or scroll, RATE in events/s (default 100). The bench asks for
+// a new update as soon as it has read anything, so the main thread diffs,
+// encodes and sends every frame, and an event counts as injected once the
+// first of its uinput events comes out of the FIFO. Keys take the same
+// way up to the key hook, but the virtual keyboard needs a compositor.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "inputbench.h"
+#include "utils.h"
+
+
+#define BENCH_DEFAULT_RATE 100
+// An event that takes longer than this is taken as lost
+#define BENCH_TIMEOUT_MS 5000
+
+
+static uint16_t width;
+static uint16_t height;
+static uint64_t update_bytes;
+
+
+static void read_exact(int fd, void *data, size_t size)
+{
+	for (size_t done = 0; done < size; ) {
+		ssize_t ret = read(fd, (uint8_t *)data + done, size - done);
+		if (ret <= 0) {
+			fail("The server closed the connection during the handshake");
+		}
+		done += ret;
+	}
+}
+
+
+static void write_exact(int fd, const void *data, size_t size)
+{
+	if (send(fd, data, size, MSG_NOSIGNAL) != (ssize_t)size) {
+		fail("Failed to send to the server");
+	}
+}
+
+
+static void request_update(int sock, bool incremental)
+{
+	uint8_t msg[10] = { 3, incremental };
+	uint16_t rect[] = { 0, 0, htons(width), htons(height) };
+	memcpy(msg + 2, rect, sizeof(rect));
+	write_exact(sock, msg, sizeof(msg));
+}
+
+
+static int connect_server(const char *path)
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fail("Failed to connect to %s", path);
+	}
+
+	// RFB 3.8 without authentication
+	char version[12];
+	read_exact(sock, version, sizeof(version));
+	write_exact(sock, "RFB 003.008\n", 12);
+	uint8_t type_count;
+	read_exact(sock, &type_count, 1);
+	if (type_count == 0) {
+		fail("The server refused the connection");
+	}
+	uint8_t types[255];
+	read_exact(sock, types, type_count);
+	if (memchr(types, 1, type_count) == NULL) {
+		fail("The server wants authentication");
+	}
+	write_exact(sock, &(uint8_t) { 1 }, 1);
+	uint32_t result;
+	read_exact(sock, &result, sizeof(result));
+	if (result != 0) {
+		fail("The security handshake failed");
+	}
+	// Shared
+	write_exact(sock, &(uint8_t) { 1 }, 1);
+	uint8_t init[24];
+	read_exact(sock, init, sizeof(init));
+	memcpy(&width, init, 2);
+	memcpy(&height, init + 2, 2);
+	width = ntohs(width);
+	height = ntohs(height);
+	uint32_t name_length;
+	memcpy(&name_length, init + 20, 4);
+	char name[256];
+	for (uint32_t left = ntohl(name_length); left > 0; ) {
+		uint32_t chunk = min(left, (uint32_t)sizeof(name));
+		read_exact(sock, name, chunk);
+		left -= chunk;
+	}
+
+	// Hextile, so that updates go through the shared tile path
+	uint8_t encodings[] = { 2, 0, 0, 1, 0, 0, 0, 5 };
+	write_exact(sock, encodings, sizeof(encodings));
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	request_update(sock, false);
+	return sock;
+}
+
+
+static void drain_updates(int sock)
+{
+	uint8_t buf[65536];
+	ssize_t ret;
+	bool got = false;
+	while ((ret = read(sock, buf, sizeof(buf))) > 0) {
+		update_bytes += ret;
+		got = true;
+	}
+	if (ret == 0) {
+		fail("The server closed the connection");
+	}
+	if (got) {
+		// Any time is a good time for the next frame
+		request_update(sock, true);
+	}
+}
+
+
+// Keeps reading the updates until the deadline, in time_monotonic_ns()
+static void serve_until(int sock, uint64_t deadline)
+{
+	uint64_t now;
+	while ((now = time_monotonic_ns()) < deadline) {
+		struct pollfd fd = { .fd = sock, .events = POLLIN };
+		struct timespec timeout = {
+			.tv_sec = (deadline - now) / 1000000000,
+			.tv_nsec = (deadline - now) % 1000000000,
+		};
+		if (ppoll(&fd, 1, &timeout, NULL) > 0) {
+			drain_updates(sock);
+		}
+	}
+}
+
+
+// Returns ns from sending the event to the first of its uinput events
+static uint64_t inject(int sock, int fifo, const struct input_bench_event *event)
+{
+	// The pointer hook always moves and sets the buttons, wheel clicks
+	// come on top of that
+	size_t expected = 7;
+	expected += event->mask & BIT(3) ? 2 : 0;
+	expected += event->mask & BIT(4) ? 2 : 0;
+	expected *= sizeof(struct input_event);
+
+	uint8_t msg[6] = { 5, event->mask };
+	uint16_t position[] = { htons(event->x), htons(event->y) };
+	memcpy(msg + 2, position, sizeof(position));
+	uint64_t start = time_monotonic_ns();
+	write_exact(sock, msg, sizeof(msg));
+
+	uint64_t latency = 0;
+	size_t received = 0;
+	while (received < expected) {
+		struct pollfd fds[] = {
+			{ .fd = sock, .events = POLLIN },
+			{ .fd = fifo, .events = POLLIN },
+		};
+		if (poll(fds, ARRAY_SIZE(fds), BENCH_TIMEOUT_MS) <= 0) {
+			fail("No injection within %d ms", BENCH_TIMEOUT_MS);
+		}
+		if (fds[1].revents & POLLIN) {
+			if (received == 0) {
+				latency = time_monotonic_ns() - start;
+			}
+			uint8_t buf[256];
+			ssize_t ret = read(fifo, buf, min(sizeof(buf), expected - received));
+			if (ret > 0) {
+				received += ret;
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			drain_updates(sock);
+		}
+	}
+	return latency;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		fail("Usage: %s SOCKET FIFO [SCENARIO[@RATE]]", argv[0]);
+	}
+	char scenario[64] = "drag";
+	unsigned int rate = BENCH_DEFAULT_RATE;
+	if (argc > 3) {
+		snprintf(scenario, sizeof(scenario), "%s", argv[3]);
+		char *at = strchr(scenario, '@');
+		if (at != NULL) {
+			*at++ = '\0';
+			rate = atoi(at);
+		}
+	}
+	if (rate == 0 || (strcmp(scenario, "drag") && strcmp(scenario, "scroll"))) {
+		fail("Usage: %s SOCKET FIFO [drag|scroll[@RATE]]", argv[0]);
+	}
+
+	// Opened first, whatever is in there from before does not count
+	int fifo = open(argv[2], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fifo < 0) {
+		fail("Failed to open %s", argv[2]);
+	}
+	int sock = connect_server(argv[1]);
+	uint8_t buf[4096];
+	while (read(fifo, buf, sizeof(buf)) > 0) {
+	}
+	// Let the first full update go out before timing anything
+	serve_until(sock, time_monotonic_ns() + 1000000000);
+
+	struct input_bench bench;
+	input_bench_init(&bench, scenario, rate, width, height);
+	uint64_t bytes_before = update_bytes;
+	uint64_t start = time_monotonic_ns();
+	for (size_t i = 0; i < bench.count; i++) {
+		serve_until(sock, start + i * 1000000000ull / rate);
+		bench.latency[i] = inject(sock, fifo, &bench.events[i]);
+	}
+	uint64_t elapsed = time_monotonic_ns() - start;
+	input_bench_report(&bench, elapsed);
+	printf("%ux%u, %.1f MB/s of updates read meanwhile\n", width, height,
+		   (update_bytes - bytes_before) * 1e3 / elapsed);
+	input_bench_destroy(&bench);
+	close(sock);
+	close(fifo);
+	return 0;
+}
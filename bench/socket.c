@@ -0,0 +1,107 @@
+// Pushes data through a connected unix socket pair and through loopback
+// TCP with TCP_NODELAY, to compare what --unix buys for a local proxy. A
+// forked reader drains the other end.
+//
+//   bench_socket [MIB]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+
+static const size_t write_sizes[] = {
+	4 * 1024,
+	30 * 1024,  // About what an update write is
+	64 * 1024,
+	1024 * 1024,
+};
+
+
+static void tcp_pair(int fds[2])
+{
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t length = sizeof(addr);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(listen_fd, 1) < 0 ||
+		getsockname(listen_fd, (struct sockaddr *)&addr, &length) < 0) {
+		fail("Failed to listen on loopback");
+	}
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[0] < 0 || connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fail("Failed to connect over loopback");
+	}
+	fds[1] = accept(listen_fd, NULL, NULL);
+	if (fds[1] < 0) {
+		fail("Failed to accept over loopback");
+	}
+	close(listen_fd);
+	int one = 1;
+	setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+
+// Returns GB/s
+static double transfer(int fds[2], size_t total, size_t write_size)
+{
+	pid_t reader = fork();
+	if (reader < 0) {
+		fail("fork failed");
+	}
+	if (reader == 0) {
+		close(fds[0]);
+		char buf[64 * 1024];
+		while (read(fds[1], buf, sizeof(buf)) > 0) {
+		}
+		_exit(0);
+	}
+	close(fds[1]);
+	uint8_t *data = xmalloc(write_size);
+	uint64_t start = time_monotonic_ns();
+	for (size_t sent = 0; sent < total; ) {
+		ssize_t ret = write(fds[0], data, min(write_size, total - sent));
+		if (ret <= 0) {
+			fail("write failed");
+		}
+		sent += ret;
+	}
+	// Done once the reader has seen everything
+	shutdown(fds[0], SHUT_WR);
+	waitpid(reader, NULL, 0);
+	uint64_t elapsed = time_monotonic_ns() - start;
+	close(fds[0]);
+	free(data);
+	return (double)total / elapsed;
+}
+
+
+int main(int argc, char *argv[])
+{
+	size_t total = (argc > 1 ? atoi(argv[1]) : 2048) * (size_t)1024 * 1024;
+	if (total == 0) {
+		fail("Usage: %s [MIB]", argv[0]);
+	}
+	printf("%zu MiB per run, GB/s\n", total / 1024 / 1024);
+	printf("%-12s %8s %8s\n", "write size", "unix", "tcp");
+	for (size_t i = 0; i < ARRAY_SIZE(write_sizes); i++) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			fail("socketpair failed");
+		}
+		double unix_rate = transfer(fds, total, write_sizes[i]);
+		tcp_pair(fds);
+		double tcp_rate = transfer(fds, total, write_sizes[i]);
+		printf("%8zu KiB %8.2f %8.2f\n", write_sizes[i] / 1024, unix_rate, tcp_rate);
+	}
+	return 0;
+}
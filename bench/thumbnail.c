@@ -0,0 +1,152 @@
+// Times the thumbnail on noise, the worst case for the PNG compression: a
+// full refresh, an update after a few small changes, and writing the file.
+// Before that, it checks that updates done along the way end up the same
+// as one from scratch, and that every pixel is the average it covers.
+//
+//   bench_thumbnail [WIDTH]
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thumbnail.h"
+#include "utils.h"
+
+
+#define BENCH_FB_WIDTH 1920u
+#define BENCH_FB_HEIGHT 1080u
+#define BENCH_TILE 32u
+#define BENCH_TILE_COUNT_X ((BENCH_FB_WIDTH + BENCH_TILE - 1) / BENCH_TILE)
+#define BENCH_TILE_COUNT_Y ((BENCH_FB_HEIGHT + BENCH_TILE - 1) / BENCH_TILE)
+#define BENCH_TILES (BENCH_TILE_COUNT_X * BENCH_TILE_COUNT_Y)
+#define BENCH_RUNS 20
+
+
+static rgba_t fb[BENCH_FB_WIDTH * BENCH_FB_HEIGHT];
+static uint64_t tile_generation[BENCH_TILES];
+
+
+static void change_rect(uint64_t generation)
+{
+	uint32_t x1 = rand() % BENCH_FB_WIDTH, y1 = rand() % BENCH_FB_HEIGHT;
+	uint32_t x2 = min(x1 + rand() % 200 + 1, BENCH_FB_WIDTH);
+	uint32_t y2 = min(y1 + rand() % 100 + 1, BENCH_FB_HEIGHT);
+	for (uint32_t y = y1; y < y2; y++) {
+		for (uint32_t x = x1; x < x2; x++) {
+			fb[y * BENCH_FB_WIDTH + x] = (rgba_t) { .r = generation * 7, .g = x, .b = y };
+			tile_generation[y / BENCH_TILE * BENCH_TILE_COUNT_X + x / BENCH_TILE] = generation;
+		}
+	}
+}
+
+
+static void touch_all(uint64_t generation)
+{
+	for (uint32_t i = 0; i < BENCH_TILES; i++) {
+		tile_generation[i] = generation;
+	}
+}
+
+
+// Compares against a brute force box filter, returns the pixels that differ
+static uint32_t check_averages(struct thumbnail *thumbnail)
+{
+	uint32_t wrong = 0;
+	for (uint32_t row = 0; row < thumbnail->height; row++) {
+		uint32_t y1 = (uint64_t)row * BENCH_FB_HEIGHT / thumbnail->height;
+		uint32_t y2 = (uint64_t)(row + 1) * BENCH_FB_HEIGHT / thumbnail->height;
+		for (uint32_t column = 0; column < thumbnail->width; column++) {
+			uint32_t x1 = (uint64_t)column * BENCH_FB_WIDTH / thumbnail->width;
+			uint32_t x2 = (uint64_t)(column + 1) * BENCH_FB_WIDTH / thumbnail->width;
+			uint64_t r = 0, g = 0, b = 0;
+			for (uint32_t y = y1; y < y2; y++) {
+				for (uint32_t x = x1; x < x2; x++) {
+					rgba_t pixel = fb[y * BENCH_FB_WIDTH + x];
+					r += pixel.r;
+					g += pixel.g;
+					b += pixel.b;
+				}
+			}
+			uint64_t area = (uint64_t)(x2 - x1) * (y2 - y1);
+			const uint8_t *pixel = thumbnail->pixels + row * thumbnail->stride + 1 + column * 3;
+			if (pixel[0] != (r + area / 2) / area || pixel[1] != (g + area / 2) / area ||
+				pixel[2] != (b + area / 2) / area) {
+				wrong++;
+			}
+		}
+	}
+	return wrong;
+}
+
+
+int main(int argc, char *argv[])
+{
+	uint32_t width = argc > 1 ? atoi(argv[1]) : 320;
+	if (width == 0 || width > BENCH_FB_WIDTH) {
+		fail("Usage: %s [WIDTH]", argv[0]);
+	}
+	srand(3);
+	for (size_t i = 0; i < ARRAY_SIZE(fb); i++) {
+		fb[i] = (rgba_t) { .r = rand(), .g = rand(), .b = rand(), .a = rand() };
+	}
+	touch_all(1);
+
+	struct thumbnail thumbnail, reference;
+	thumbnail_init(&thumbnail, BENCH_FB_WIDTH, BENCH_FB_HEIGHT, BENCH_TILE, width);
+	thumbnail_update(&thumbnail, fb, tile_generation, 1);
+	uint64_t generation;
+	for (generation = 2; generation < 40; generation++) {
+		for (int i = 0; i < 5; i++) {
+			change_rect(generation);
+		}
+		// Not every frame, so that changes pile up in between
+		if (generation % 3 == 0) {
+			thumbnail_update(&thumbnail, fb, tile_generation, generation);
+		}
+	}
+	thumbnail_update(&thumbnail, fb, tile_generation, generation);
+	thumbnail_init(&reference, BENCH_FB_WIDTH, BENCH_FB_HEIGHT, BENCH_TILE, width);
+	thumbnail_update(&reference, fb, tile_generation, generation);
+	if (memcmp(thumbnail.pixels, reference.pixels, thumbnail.stride * thumbnail.height)) {
+		fail("Incremental updates differ from a full one");
+	}
+	uint32_t wrong = check_averages(&thumbnail);
+	if (wrong > 0) {
+		fail("%u pixels are not the average they cover", wrong);
+	}
+	thumbnail_destroy(&reference);
+
+	char path[] = "/tmp/wvnc-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fail("Failed to create a temporary file");
+	}
+	close(fd);
+	uint64_t full = UINT64_MAX, partial = UINT64_MAX, write = UINT64_MAX;
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		touch_all(++generation);
+		uint64_t start = time_monotonic_ns();
+		thumbnail_update(&thumbnail, fb, tile_generation, generation);
+		full = min(full, time_monotonic_ns() - start);
+
+		generation++;
+		for (int i = 0; i < 5; i++) {
+			change_rect(generation);
+		}
+		start = time_monotonic_ns();
+		thumbnail_update(&thumbnail, fb, tile_generation, generation);
+		partial = min(partial, time_monotonic_ns() - start);
+
+		start = time_monotonic_ns();
+		thumbnail_write(&thumbnail, path);
+		write = min(write, time_monotonic_ns() - start);
+	}
+	unlink(path);
+
+	printf("%ux%u of %ux%u, best of %d, ms\n", thumbnail.width, thumbnail.height,
+		   BENCH_FB_WIDTH, BENCH_FB_HEIGHT, BENCH_RUNS);
+	printf("full update %.2f, 5 rects %.2f, write %.2f\n",
+		   full / 1e6, partial / 1e6, write / 1e6);
+	thumbnail_destroy(&thumbnail);
+	return 0;
+}
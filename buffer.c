@@ -1,4 +1,4 @@
-
+#include <string.h>
 #include <wayland-client.h>
 
 #include "utils.h"
@@ -6,19 +6,61 @@
 #include "buffer.h"
 
 
-#define FB_COORDS(name, tx, ty) \
+// Where buffer pixel (ox, oy) ends up in the framebuffer for each transform,
+// and how far apart two horizontally adjacent buffer pixels end up. The
+// y-inverted variants are not needed, flipping the rows is the same as
+// one of the other transforms (see effective_transform).
+
+#define FB_X_normal      ox
+#define FB_Y_normal      oy
+#define FB_STEP_normal   1
+
+#define FB_X_90          oy
+#define FB_Y_90          (height - ox - 1)
+#define FB_STEP_90       -(int32_t)width
+
+#define FB_X_180         (width - ox - 1)
+#define FB_Y_180         (height - oy - 1)
+#define FB_STEP_180      -1
+
+#define FB_X_270         (width - oy - 1)
+#define FB_Y_270         ox
+#define FB_STEP_270      (int32_t)width
+
+#define FB_X_flipped     (width - ox - 1)
+#define FB_Y_flipped     oy
+#define FB_STEP_flipped  -1
+
+#define FB_X_flipped_90      oy
+#define FB_Y_flipped_90      ox
+#define FB_STEP_flipped_90   (int32_t)width
+
+#define FB_X_flipped_180     ox
+#define FB_Y_flipped_180     (height - oy - 1)
+#define FB_STEP_flipped_180  1
+
+#define FB_X_flipped_270     (width - oy - 1)
+#define FB_Y_flipped_270     (height - ox - 1)
+#define FB_STEP_flipped_270  -(int32_t)width
+
+
+#define FB_COORDS(name) \
 	static void fb_coords_##name(uint32_t width, uint32_t height, \
 								 uint32_t ox, uint32_t oy, \
 								 uint32_t *fb_x, uint32_t *fb_y) \
 	{ \
-		*fb_x = (tx);\
-		*fb_y = (ty); \
+		*fb_x = FB_X_##name; \
+		*fb_y = FB_Y_##name; \
 	}
 
-FB_COORDS(normal, ox, height - oy - 1);
-FB_COORDS(90, width - oy - 1, height - ox - 1);
-FB_COORDS(180, ox, oy);
-FB_COORDS(270, oy, ox);
+FB_COORDS(normal);
+FB_COORDS(90);
+FB_COORDS(180);
+FB_COORDS(270);
+FB_COORDS(flipped);
+FB_COORDS(flipped_90);
+FB_COORDS(flipped_180);
+FB_COORDS(flipped_270);
 
 
 void (*coords_fns[])(uint32_t width, uint32_t height,
@@ -27,87 +69,379 @@ void (*coords_fns[])(uint32_t width, uint32_t height,
 	[WL_OUTPUT_TRANSFORM_90] = fb_coords_90,
 	[WL_OUTPUT_TRANSFORM_180] = fb_coords_180,
 	[WL_OUTPUT_TRANSFORM_270] = fb_coords_270,
+	[WL_OUTPUT_TRANSFORM_FLIPPED] = fb_coords_flipped,
+	[WL_OUTPUT_TRANSFORM_FLIPPED_90] = fb_coords_flipped_90,
+	[WL_OUTPUT_TRANSFORM_FLIPPED_180] = fb_coords_flipped_180,
+	[WL_OUTPUT_TRANSFORM_FLIPPED_270] = fb_coords_flipped_270,
 };
 
 
+static enum wl_output_transform effective_transform(struct wvnc_capture *capture,
+													struct wvnc_buffer *buffer)
+{
+	if (capture->transform >= ARRAY_SIZE(coords_fns)) {
+		fail("Unknown output transform %d", capture->transform);
+	}
+	if (!buffer->y_invert) {
+		return capture->transform;
+	}
+	// Reading the rows bottom up first and then applying the transform
+	// is the same as applying the vertically mirrored transform
+	static const enum wl_output_transform inverted[] = {
+		[WL_OUTPUT_TRANSFORM_NORMAL] = WL_OUTPUT_TRANSFORM_FLIPPED_180,
+		[WL_OUTPUT_TRANSFORM_90] = WL_OUTPUT_TRANSFORM_FLIPPED_270,
+		[WL_OUTPUT_TRANSFORM_180] = WL_OUTPUT_TRANSFORM_FLIPPED,
+		[WL_OUTPUT_TRANSFORM_270] = WL_OUTPUT_TRANSFORM_FLIPPED_90,
+		[WL_OUTPUT_TRANSFORM_FLIPPED] = WL_OUTPUT_TRANSFORM_180,
+		[WL_OUTPUT_TRANSFORM_FLIPPED_90] = WL_OUTPUT_TRANSFORM_270,
+		[WL_OUTPUT_TRANSFORM_FLIPPED_180] = WL_OUTPUT_TRANSFORM_NORMAL,
+		[WL_OUTPUT_TRANSFORM_FLIPPED_270] = WL_OUTPUT_TRANSFORM_90,
+	};
+	return inverted[capture->transform];
+}
+
 
-void buffer_calculate_fb_coords(struct wvnc_output *output,
+void buffer_calculate_fb_coords(struct wvnc_capture *capture, struct wvnc_buffer *buffer,
 								uint32_t src_x, uint32_t src_y,
 								uint32_t *fb_x, uint32_t *fb_y)
 {
-	coords_fns[output->transform](
-		output->width, output->height,
+	coords_fns[effective_transform(capture, buffer)](
+		capture->fb_width, capture->fb_height,
 		src_x, src_y,
 		fb_x, fb_y
 	);
 }
 
 
-// TODO: Deduplicate this with the above
+void buffer_calculate_fb_rect(struct wvnc_capture *capture, struct wvnc_buffer *buffer,
+							  uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h,
+							  uint32_t *fb_x, uint32_t *fb_y, uint32_t *fb_w, uint32_t *fb_h)
+{
+	uint32_t x1, y1, x2, y2;
+	buffer_calculate_fb_coords(capture, buffer, src_x, src_y, &x1, &y1);
+	buffer_calculate_fb_coords(capture, buffer, src_x + src_w - 1, src_y + src_h - 1, &x2, &y2);
+	*fb_x = min(x1, x2);
+	*fb_y = min(y1, y2);
+	*fb_w = max(x1, x2) - *fb_x + 1;
+	*fb_h = max(y1, y2) - *fb_y + 1;
+}
 
-#define FB_OFF(name, tx, ty) \
-	static rgba_t *fb_off_##name(rgba_t *fb, uint32_t width, uint32_t height, uint32_t ox, uint32_t oy) \
-	{ \
-		return &fb[(ty) * width + (tx)];\
+
+static inline uint64_t load64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+bool buffer_diff_span(const uint8_t *a, const uint8_t *b, uint32_t bytes, uint32_t bpp,
+					  uint32_t *first, uint32_t *last)
+{
+	// Compares 8 bytes at a time from both ends, the byte order only
+	// matters for finding the differing byte inside a word
+	uint32_t start = 0;
+	uint64_t diff = 0;
+	for (; start + 8 <= bytes; start += 8) {
+		diff = load64(a + start) ^ load64(b + start);
+		if (diff != 0) {
+			start += __builtin_ctzll(diff) / 8;
+			break;
+		}
+	}
+	if (diff == 0) {
+		while (start < bytes && a[start] == b[start]) {
+			start++;
+		}
+		if (start == bytes) {
+			return false;
+		}
 	}
 
-FB_OFF(normal, ox, height - oy - 1);
-FB_OFF(90, width - oy - 1, height - ox - 1);
-FB_OFF(180, ox, oy);
-FB_OFF(270, oy, ox);
+	// There is a difference, so this stops at or after start
+	uint32_t end = bytes;
+	while (end % 8 != 0 && a[end - 1] == b[end - 1]) {
+		end--;
+	}
+	if (end % 8 == 0) {
+		while (true) {
+			diff = load64(a + end - 8) ^ load64(b + end - 8);
+			if (diff != 0) {
+				end -= __builtin_clzll(diff) / 8;
+				break;
+			}
+			end -= 8;
+		}
+	}
+	*first = start / bpp;
+	*last = (end - 1) / bpp;
+	return true;
+}
+
+
+static uint32_t tile_shift(uint32_t v0, uint32_t v1, uint32_t tile_size)
+{
+	// v0 and v1 are the framebuffer coordinates of buffer pixels 0 and 1
+	// along one axis
+	uint32_t start;
+	if (v1 > v0) {
+		start = (tile_size - v0 % tile_size) % tile_size;
+	} else {
+		start = (v0 + 1) % tile_size;
+	}
+	return (tile_size - start) % tile_size;
+}
+
+
+void buffer_calculate_tile_shift(struct wvnc_capture *capture, struct wvnc_buffer *buffer,
+								 uint32_t tile_size, uint32_t *shift_x, uint32_t *shift_y)
+{
+	// Offsets of the buffer tile grid, chosen so that buffer tiles map
+	// exactly onto framebuffer tiles whatever the transform does to the
+	// axes. Tile n then starts at n * tile_size - shift.
+	uint32_t x0, y0, x1, y1, x2, y2;
+	buffer_calculate_fb_coords(capture, buffer, 0, 0, &x0, &y0);
+	buffer_calculate_fb_coords(capture, buffer, 1, 0, &x1, &y1);
+	buffer_calculate_fb_coords(capture, buffer, 0, 1, &x2, &y2);
+	*shift_x = x1 != x0 ? tile_shift(x0, x1, tile_size) : tile_shift(y0, y1, tile_size);
+	*shift_y = x2 != x0 ? tile_shift(x0, x2, tile_size) : tile_shift(y0, y2, tile_size);
+}
+
+
+// Pixels as they are stored in our framebuffer, that is rgba_t on a little
+// endian machine
+typedef uint32_t __attribute__((may_alias)) fb_pixel_t;
+
+// Blocks of pixels converted at once on the contiguous paths. These are
+// plain GCC vector extensions, the compiler lowers them to whatever SIMD
+// the target has. __builtin_shufflevector needs GCC 12 or clang, older
+// compilers only get the scalar loops, as does -DBUFFER_VECTORS=0 for
+// comparing the two.
+#ifndef BUFFER_VECTORS
+#if defined(__clang__) || __GNUC__ >= 12
+#define BUFFER_VECTORS 1
+#else
+#define BUFFER_VECTORS 0
+#endif
+#endif
+
+#define VEC_PIXELS 8
+typedef uint32_t v8u32 __attribute__((vector_size(VEC_PIXELS * 4)));
+typedef uint16_t v8u16 __attribute__((vector_size(VEC_PIXELS * 2)));
 
-#define COPY_TO_FB(name) \
-static void copy_to_fb_##name(rgba_t *fb, struct wvnc_output *output, struct wvnc_buffer *buffer, \
-							  uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h) \
+
+// Per format source pixel type and conversion into the framebuffer order.
+// The conversions are written so that they work on both a single (widened)
+// pixel and a v8u32.
+
+#define SRC_TYPE_xrgb8888 uint32_t
+#define SRC_VEC_xrgb8888 v8u32
+#define PIXEL_xrgb8888(p) \
+	(0xff000000 | ((p) & 0x0000ff00) | (((p) >> 16) & 0xff) | (((p) & 0xff) << 16))
+
+// Already in our byte order
+#define SRC_TYPE_xbgr8888 uint32_t
+#define SRC_VEC_xbgr8888 v8u32
+#define PIXEL_xbgr8888(p) \
+	(0xff000000 | (p))
+
+// 10 bits per channel, we keep the top 8
+#define SRC_TYPE_xrgb2101010 uint32_t
+#define SRC_VEC_xrgb2101010 v8u32
+#define PIXEL_xrgb2101010(p) \
+	(0xff000000 | (((p) >> 22) & 0xff) | (((p) >> 4) & 0xff00) | (((p) << 14) & 0xff0000))
+
+#define SRC_TYPE_xbgr2101010 uint32_t
+#define SRC_VEC_xbgr2101010 v8u32
+#define PIXEL_xbgr2101010(p) \
+	(0xff000000 | (((p) >> 2) & 0xff) | (((p) >> 4) & 0xff00) | (((p) >> 6) & 0xff0000))
+
+// 5 and 6 bit channels are widened by replicating their top bits
+#define SRC_TYPE_rgb565 uint16_t
+#define SRC_VEC_rgb565 v8u16
+#define PIXEL_rgb565(p) \
+	(0xff000000 | \
+	 (((p) >> 8) & 0xf8) | (((p) >> 13) & 0x07) | \
+	 (((p) << 5) & 0xfc00) | (((p) >> 1) & 0x0300) | \
+	 (((p) << 19) & 0xf80000) | (((p) << 14) & 0x070000))
+
+#define SRC_TYPE_bgr565 uint16_t
+#define SRC_VEC_bgr565 v8u16
+#define PIXEL_bgr565(p) \
+	(0xff000000 | \
+	 (((p) << 3) & 0xf8) | (((p) >> 2) & 0x07) | \
+	 (((p) << 5) & 0xfc00) | (((p) >> 1) & 0x0300) | \
+	 (((p) << 8) & 0xf80000) | (((p) << 3) & 0x070000))
+
+
+// Transforms which keep rows contiguous in the framebuffer get the vector
+// path, forwards (1) or backwards (-1)
+#define FB_VEC_normal       1
+#define FB_VEC_90           0
+#define FB_VEC_180          -1
+#define FB_VEC_270          0
+#define FB_VEC_flipped      -1
+#define FB_VEC_flipped_90   0
+#define FB_VEC_flipped_180  1
+#define FB_VEC_flipped_270  0
+
+
+#if BUFFER_VECTORS
+#define CONVERT_VECTORS(name, format) \
+	if (FB_VEC_##name != 0) { \
+		for (; off_x + VEC_PIXELS <= src_w; off_x += VEC_PIXELS) { \
+			SRC_VEC_##format in; \
+			memcpy(&in, src + off_x * bpp, sizeof(in)); \
+			v8u32 p = __builtin_convertvector(in, v8u32); \
+			p = PIXEL_##format(p); \
+			if (FB_VEC_##name > 0) { \
+				memcpy(tgt, &p, sizeof(p)); \
+			} else { \
+				p = __builtin_shufflevector(p, p, 7, 6, 5, 4, 3, 2, 1, 0); \
+				memcpy(tgt - (VEC_PIXELS - 1), &p, sizeof(p)); \
+			} \
+			tgt += VEC_PIXELS * FB_VEC_##name; \
+		} \
+	}
+#else
+#define CONVERT_VECTORS(name, format)
+#endif
+
+#define CONVERT(name, format) \
+static void convert_##name##_##format(rgba_t *fb, uint32_t width, uint32_t height, \
+									  struct wvnc_buffer *buffer, \
+									  uint32_t src_x, uint32_t src_y, \
+									  uint32_t src_w, uint32_t src_h) \
 { \
-	for (uint32_t off_y = 0; off_y < src_h; off_y++) { \
-		for (uint32_t off_x = 0; off_x < src_w; off_x++) { \
-			uint32_t x = src_x + off_x; \
-			uint32_t y = src_y + off_y; \
-			uint32_t src = *(uint32_t *)(buffer->data + y*buffer->stride + x * 4); \
-			rgba_t c = { \
-				.r = (src >> 16) & 0xff, \
-				.g = (src >>  8) & 0xff, \
-				.b = (src >>  0) & 0xff, \
-				.a = 0xff, \
-			}; \
-			rgba_t *tgt = fb_off_##name( \
-				fb, \
-				output->width, output->height, \
-				x, y \
-			); \
-			*tgt = c; \
+	const uint32_t bpp = sizeof(SRC_TYPE_##format); \
+	for (uint32_t oy = src_y; oy < src_y + src_h; oy++) { \
+		const uint8_t *src = (const uint8_t *)buffer->data + oy * buffer->stride + src_x * bpp; \
+		uint32_t ox = src_x; \
+		fb_pixel_t *tgt = (fb_pixel_t *)&fb[FB_Y_##name * width + FB_X_##name]; \
+		uint32_t off_x = 0; \
+		CONVERT_VECTORS(name, format) \
+		for (; off_x < src_w; off_x++) { \
+			SRC_TYPE_##format in; \
+			memcpy(&in, src + off_x * bpp, sizeof(in)); \
+			uint32_t p = in; \
+			*tgt = PIXEL_##format(p); \
+			tgt += FB_STEP_##name; \
 		} \
 	} \
 }
 
-COPY_TO_FB(normal);
-COPY_TO_FB(90);
-COPY_TO_FB(180);
-COPY_TO_FB(270);
+#define CONVERT_TRANSFORMS(format) \
+	CONVERT(normal, format) \
+	CONVERT(90, format) \
+	CONVERT(180, format) \
+	CONVERT(270, format) \
+	CONVERT(flipped, format) \
+	CONVERT(flipped_90, format) \
+	CONVERT(flipped_180, format) \
+	CONVERT(flipped_270, format) \
+	static const buffer_convert_fn convert_##format##_fns[] = { \
+		[WL_OUTPUT_TRANSFORM_NORMAL] = convert_normal_##format, \
+		[WL_OUTPUT_TRANSFORM_90] = convert_90_##format, \
+		[WL_OUTPUT_TRANSFORM_180] = convert_180_##format, \
+		[WL_OUTPUT_TRANSFORM_270] = convert_270_##format, \
+		[WL_OUTPUT_TRANSFORM_FLIPPED] = convert_flipped_##format, \
+		[WL_OUTPUT_TRANSFORM_FLIPPED_90] = convert_flipped_90_##format, \
+		[WL_OUTPUT_TRANSFORM_FLIPPED_180] = convert_flipped_180_##format, \
+		[WL_OUTPUT_TRANSFORM_FLIPPED_270] = convert_flipped_270_##format, \
+	};
+
+CONVERT_TRANSFORMS(xrgb8888);
+CONVERT_TRANSFORMS(xbgr8888);
+CONVERT_TRANSFORMS(xrgb2101010);
+CONVERT_TRANSFORMS(xbgr2101010);
+CONVERT_TRANSFORMS(rgb565);
+CONVERT_TRANSFORMS(bgr565);
+
 
+struct buffer_format {
+	enum wl_shm_format format;
+	const char *name;
+	uint32_t bytes_per_pixel;
+	// Relative conversion cost, measured on the normal path at 1080p
+	unsigned int cost;
+	const buffer_convert_fn *convert_fns;
+};
 
-void (*copy_fns[])(rgba_t *fb, struct wvnc_output *output, struct wvnc_buffer *buffer,
-				   uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h) = {
-	[WL_OUTPUT_TRANSFORM_NORMAL] = copy_to_fb_normal,
-	[WL_OUTPUT_TRANSFORM_90] = copy_to_fb_90,
-	[WL_OUTPUT_TRANSFORM_180] = copy_to_fb_180,
-	[WL_OUTPUT_TRANSFORM_270] = copy_to_fb_270,
+static const struct buffer_format buffer_formats[] = {
+	{WL_SHM_FORMAT_XBGR8888, "XBGR8888", 4, 1, convert_xbgr8888_fns},
+	{WL_SHM_FORMAT_ABGR8888, "ABGR8888", 4, 1, convert_xbgr8888_fns},
+	{WL_SHM_FORMAT_XRGB8888, "XRGB8888", 4, 2, convert_xrgb8888_fns},
+	{WL_SHM_FORMAT_ARGB8888, "ARGB8888", 4, 2, convert_xrgb8888_fns},
+	{WL_SHM_FORMAT_RGB565, "RGB565", 2, 3, convert_rgb565_fns},
+	{WL_SHM_FORMAT_BGR565, "BGR565", 2, 3, convert_bgr565_fns},
+	{WL_SHM_FORMAT_XRGB2101010, "XRGB2101010", 4, 2, convert_xrgb2101010_fns},
+	{WL_SHM_FORMAT_ARGB2101010, "ARGB2101010", 4, 2, convert_xrgb2101010_fns},
+	{WL_SHM_FORMAT_XBGR2101010, "XBGR2101010", 4, 2, convert_xbgr2101010_fns},
+	{WL_SHM_FORMAT_ABGR2101010, "ABGR2101010", 4, 2, convert_xbgr2101010_fns},
 };
 
 
-void buffer_to_fb(rgba_t *fb, struct wvnc_output *output, struct wvnc_buffer *buffer,
-				  uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+static const struct buffer_format *find_format(enum wl_shm_format format)
 {
-	if (buffer->format != WL_SHM_FORMAT_ARGB8888 && buffer->format != WL_SHM_FORMAT_XRGB8888) {
-		fail("Unknown buffer format %d", buffer->format);
+	for (size_t i = 0; i < ARRAY_SIZE(buffer_formats); i++) {
+		if (buffer_formats[i].format == format) {
+			return &buffer_formats[i];
+		}
 	}
-	// We assume y_invert is true here
-	// Everything will be flipped otherwise
-	// TODO: Fix this
-	if (output->transform >= ARRAY_SIZE(copy_fns) || copy_fns[output->transform] == NULL) {
-		fail("Unknown output transform");
+	return NULL;
+}
+
+
+const char *buffer_format_name(enum wl_shm_format format)
+{
+	const struct buffer_format *f = find_format(format);
+	return f != NULL ? f->name : "unknown";
+}
+
+
+unsigned int buffer_format_cost(enum wl_shm_format format)
+{
+	const struct buffer_format *f = find_format(format);
+	return f != NULL ? f->cost : 0;
+}
+
+
+uint32_t buffer_bytes_per_pixel(enum wl_shm_format format)
+{
+	const struct buffer_format *f = find_format(format);
+	if (f == NULL) {
+		fail("Unknown buffer format %d", format);
+	}
+	return f->bytes_per_pixel;
+}
+
+
+static buffer_convert_fn select_convert_fn(enum wl_shm_format format,
+										   enum wl_output_transform transform)
+{
+	const struct buffer_format *f = find_format(format);
+	if (f == NULL) {
+		fail("Unknown buffer format %d", format);
+	}
+	return f->convert_fns[transform];
+}
+
+
+void buffer_to_fb(rgba_t *fb, struct wvnc_capture *capture, struct wvnc_buffer *buffer,
+				  uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	// The kernel only changes with the buffer configuration, so we look it
+	// up once instead of dispatching on every call
+	if (buffer->convert == NULL || buffer->convert_format != buffer->format ||
+		buffer->convert_y_invert != buffer->y_invert ||
+		buffer->convert_transform != capture->transform) {
+		buffer->convert = select_convert_fn(
+			buffer->format, effective_transform(capture, buffer)
+		);
+		buffer->convert_format = buffer->format;
+		buffer->convert_y_invert = buffer->y_invert;
+		buffer->convert_transform = capture->transform;
 	}
 
-	copy_fns[output->transform](fb, output, buffer, src_x, src_y, src_w, src_h);
+	buffer->convert(fb, capture->fb_width, capture->fb_height, buffer, src_x, src_y, src_w, src_h);
 }
@@ -1,13 +1,31 @@
 
 #pragma once
 
-#pragma once
-
 #include "wvnc.h"
 
-void buffer_calculate_fb_coords(struct wvnc_output *output,
+void buffer_calculate_fb_coords(struct wvnc_capture *capture, struct wvnc_buffer *buffer,
 								uint32_t src_x, uint32_t src_y,
 								uint32_t *fb_x, uint32_t *fb_y);
 
-void buffer_to_fb(rgba_t *fb, struct wvnc_output *output, struct wvnc_buffer *buffer,
+void buffer_calculate_fb_rect(struct wvnc_capture *capture, struct wvnc_buffer *buffer,
+							  uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h,
+							  uint32_t *fb_x, uint32_t *fb_y, uint32_t *fb_w, uint32_t *fb_h);
+
+void buffer_calculate_tile_shift(struct wvnc_capture *capture, struct wvnc_buffer *buffer,
+								 uint32_t tile_size,
+								 uint32_t *shift_x, uint32_t *shift_y);
+
+// Finds the first and last pixel that differs between two row segments of
+// the given length in bytes, returns false if they are the same
+bool buffer_diff_span(const uint8_t *a, const uint8_t *b, uint32_t bytes, uint32_t bpp,
+					  uint32_t *first, uint32_t *last);
+
+void buffer_to_fb(rgba_t *fb, struct wvnc_capture *capture, struct wvnc_buffer *buffer,
 				  uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h);
+
+const char *buffer_format_name(enum wl_shm_format format);
+
+// Relative cost of converting the format, 0 if we can't convert it at all
+unsigned int buffer_format_cost(enum wl_shm_format format);
+
+uint32_t buffer_bytes_per_pixel(enum wl_shm_format format);
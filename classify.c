@@ -0,0 +1,88 @@
+#include <string.h>
+
+#include "utils.h"
+
+#include "classify.h"
+
+
+// Anything with more colors than this is a candidate for lossy encoding
+#define PALETTE_MAX_COLORS 32
+// Sum of absolute channel differences between neighbours that we still
+// consider a gradient rather than an edge
+#define GRADIENT_MAX_STEP 48
+
+
+static inline uint32_t pixel_value(rgba_t c)
+{
+	// Alpha is always 0xff in our framebuffer
+	return (uint32_t)c.r << 16 | (uint32_t)c.g << 8 | c.b;
+}
+
+
+static unsigned int count_colors(const rgba_t *fb, uint32_t fb_width,
+								 uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	// Small open addressing set, we only care about counts up to the limit
+	uint32_t set[PALETTE_MAX_COLORS * 2];
+	bool used[PALETTE_MAX_COLORS * 2];
+	memset(used, 0, sizeof(used));
+	unsigned int colors = 0;
+	for (uint32_t off_y = 0; off_y < h; off_y++) {
+		const rgba_t *row = &fb[(y + off_y) * fb_width + x];
+		for (uint32_t off_x = 0; off_x < w; off_x++) {
+			uint32_t value = pixel_value(row[off_x]);
+			unsigned int slot = (value * 2654435761u) % ARRAY_SIZE(set);
+			while (used[slot] && set[slot] != value) {
+				slot = (slot + 1) % ARRAY_SIZE(set);
+			}
+			if (used[slot]) {
+				continue;
+			}
+			if (++colors > PALETTE_MAX_COLORS) {
+				return colors;
+			}
+			used[slot] = true;
+			set[slot] = value;
+		}
+	}
+	return colors;
+}
+
+
+static inline unsigned int pixel_distance(rgba_t a, rgba_t b)
+{
+	return abs(a.r - b.r) + abs(a.g - b.g) + abs(a.b - b.b);
+}
+
+
+enum rect_class classify_rect(const rgba_t *fb, uint32_t fb_width,
+							  uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	unsigned int colors = count_colors(fb, fb_width, x, y, w, h);
+	if (colors == 1) {
+		return RECT_CLASS_SOLID;
+	}
+	if (colors <= PALETTE_MAX_COLORS) {
+		return RECT_CLASS_PALETTE;
+	}
+
+	// Lots of colors. Antialiased text has those too, but it mostly
+	// consists of flat areas and sharp edges, while photos and video are
+	// dominated by small steps between neighbours.
+	unsigned int smooth = 0;
+	unsigned int sharp = 0;
+	for (uint32_t off_y = 0; off_y < h; off_y++) {
+		const rgba_t *row = &fb[(y + off_y) * fb_width + x];
+		for (uint32_t off_x = 1; off_x < w; off_x++) {
+			unsigned int d = pixel_distance(row[off_x - 1], row[off_x]);
+			if (d == 0) {
+				continue;
+			} else if (d < GRADIENT_MAX_STEP) {
+				smooth++;
+			} else {
+				sharp++;
+			}
+		}
+	}
+	return smooth > sharp * 2 ? RECT_CLASS_PHOTO : RECT_CLASS_PALETTE;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "wvnc.h"
+
+
+enum rect_class {
+	RECT_CLASS_SOLID,
+	RECT_CLASS_PALETTE,  // Few colors or sharp edges, e.g. text and UI
+	RECT_CLASS_PHOTO,    // Many colors with smooth gradients
+	RECT_CLASS_COUNT,
+};
+
+
+enum rect_class classify_rect(const rgba_t *fb, uint32_t fb_width,
+							  uint32_t x, uint32_t y, uint32_t w, uint32_t h);
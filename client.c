@@ -0,0 +1,196 @@
+#include <limits.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+
+#include "client.h"
+
+
+// Smoothing factor of the estimates
+#define CLIENT_EWMA_ALPHA 0.125
+// How much data we allow to sit in the socket at least, in time it takes to
+// drain
+#define CLIENT_MAX_QUEUE_DELAY 0.05
+// Below this we never consider the client congested, so that we do not
+// stall on a bad estimate
+#define CLIENT_MIN_QUEUE_BYTES (64 * 1024)
+// Uncongested updates before we try a better quality again
+#define CLIENT_CALM_UPDATES 10
+#define CLIENT_MAX_QUALITY_DROP 8
+
+
+void client_init(struct wvnc_client *client, struct wvnc *wvnc)
+{
+	static atomic_uint next_id = 1;
+	client->wvnc = wvnc;
+	client->id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+	client->applied_quality = INT_MIN;
+	client->applied_compress = INT_MIN;
+}
+
+
+void client_destroy(struct wvnc_client *client)
+{
+	if (client->continuous_region != NULL) {
+		sraRgnDestroy(client->continuous_region);
+	}
+	free(client);
+}
+
+
+static uint32_t socket_queued(rfbClientPtr cl)
+{
+	int queued = 0;
+	if (ioctl(cl->sock, SIOCOUTQ, &queued) < 0) {
+		return 0;
+	}
+	return queued;
+}
+
+
+static void fence_acknowledged(struct wvnc_client *client)
+{
+	uint64_t acked_at = client->fence_acked_at;
+	uint64_t rtt = acked_at - client->fence_sent_at;
+	client->min_rtt = client->min_rtt == 0 ? rtt : min(client->min_rtt, rtt);
+	client->rtt = client->rtt == 0 ? rtt :
+		(1 - CLIENT_EWMA_ALPHA) * client->rtt + CLIENT_EWMA_ALPHA * rtt;
+	if (client->last_acked_at != 0 && acked_at > client->last_acked_at) {
+		uint32_t acked = client->fence_sent_bytes - client->acked_bytes;
+		double rate = acked * 1e6 / (acked_at - client->last_acked_at);
+		client->delivered = client->delivered == 0 ? rate :
+			(1 - CLIENT_EWMA_ALPHA) * client->delivered + CLIENT_EWMA_ALPHA * rate;
+	}
+	client->acked_bytes = client->fence_sent_bytes;
+	client->last_acked_at = acked_at;
+	client->fence_acked_at = 0;
+}
+
+
+void client_update_estimates(rfbClientPtr cl, uint64_t now)
+{
+	struct wvnc_client *client = cl->clientData;
+
+	bool fenced = atomic_load(&client->supports_fence);
+	if (fenced && !atomic_load_explicit(&client->fence_pending, memory_order_acquire) &&
+		client->fence_acked_at != 0) {
+		fence_acknowledged(client);
+	}
+	// With fences we do not need the requests for the round trip. With
+	// continuous updates they do not come at all, the region requested is
+	// our own doing and says nothing about the client.
+	pthread_mutex_lock(&cl->updateMutex);
+	bool continuous = client->continuous_region != NULL;
+	bool requested = !sraRgnEmpty(cl->requestedRegion);
+	pthread_mutex_unlock(&cl->updateMutex);
+	if (continuous) {
+		client->awaiting_request = false;
+	} else if (!fenced && client->awaiting_request && requested) {
+		// The client acknowledged the last update with a new request
+		uint64_t rtt = now - client->update_sent_at;
+		client->rtt = client->rtt == 0 ? rtt :
+			(1 - CLIENT_EWMA_ALPHA) * client->rtt + CLIENT_EWMA_ALPHA * rtt;
+		client->awaiting_request = false;
+	}
+
+	// Whatever left our send queue since the last sample made it to the
+	// network. The counter is an int in libvncserver, wrapping is fine.
+	uint32_t sent = rfbStatGetSentBytes(cl);
+	uint32_t queued = socket_queued(cl);
+	if (client->last_sample != 0 && now > client->last_sample) {
+		uint32_t drained = (sent - client->last_sent) - (queued - client->last_queued);
+		// Only sample while there is a backlog, an idle link says nothing
+		// about its capacity
+		if (client->last_queued > 0) {
+			double rate = drained * 1e6 / (now - client->last_sample);
+			client->throughput = client->throughput == 0 ? rate :
+				(1 - CLIENT_EWMA_ALPHA) * client->throughput + CLIENT_EWMA_ALPHA * rate;
+		}
+	}
+	client->last_sample = now;
+	client->last_sent = sent;
+	client->last_queued = queued;
+}
+
+
+static bool window_full(rfbClientPtr cl)
+{
+	// Fences tell how much is still on its way to the client, which we
+	// allow to grow up to twice what got through in a round trip, like
+	// TCP slow start. The smoothed round trip includes the queueing we
+	// cause ourselves, so it would let the window grow without bound.
+	struct wvnc_client *client = cl->clientData;
+	uint32_t in_flight = (uint32_t)rfbStatGetSentBytes(cl) - client->acked_bytes;
+	double rate = max(client->delivered, client->throughput);
+	uint32_t limit = max(2 * rate * client->min_rtt / 1e6, (double)CLIENT_MIN_QUEUE_BYTES);
+	return in_flight > limit;
+}
+
+
+bool client_congested(rfbClientPtr cl)
+{
+	struct wvnc_client *client = cl->clientData;
+	// Keeping about a round trip worth of data queued is enough to keep
+	// the link busy, anything beyond that is just latency
+	double delay = max(CLIENT_MAX_QUEUE_DELAY, client->rtt / 1e6);
+	uint32_t limit = max(client->throughput * delay, (double)CLIENT_MIN_QUEUE_BYTES);
+	bool fenced = client->last_acked_at != 0;
+	if (fenced ? !window_full(cl) : client->last_queued <= limit) {
+		return false;
+	}
+	// Skip this frame, the client gets the newest framebuffer contents
+	// once it caught up. Also trade quality for size from now on, by one
+	// level per update held back rather than per time we get asked, which
+	// is many times a frame.
+	client->calm_updates = 0;
+	if (!client->held_back) {
+		client->held_back = true;
+		client->skipped_updates++;
+		client->quality_drop = min(client->quality_drop + 1, CLIENT_MAX_QUALITY_DROP);
+	}
+	return true;
+}
+
+
+void client_update_sent(rfbClientPtr cl, uint64_t now)
+{
+	struct wvnc_client *client = cl->clientData;
+	client->update_sent_at = now;
+	client->awaiting_request = true;
+	client->held_back = false;
+	if (client->last_queued == 0 && ++client->calm_updates >= CLIENT_CALM_UPDATES) {
+		client->calm_updates = 0;
+		client->quality_drop = max(client->quality_drop - 1, 0);
+	}
+}
+
+
+int client_quality(struct wvnc_client *client)
+{
+	if (client->requested_quality < 0) {
+		return client->requested_quality;  // No JPEG at all
+	}
+	return max(client->requested_quality - client->quality_drop, 0);
+}
+
+
+int client_compress(struct wvnc_client *client)
+{
+	// Spend CPU on compression only while the link is the bottleneck
+	return client->quality_drop > 0 ? 9 : client->requested_compress;
+}
+
+
+void client_shutdown(rfbClientPtr cl)
+{
+	// The socket stays open, so its number cannot be reused while the
+	// input thread may still be reading from it. rfbCloseClient() clears
+	// it under the same lock.
+	pthread_mutex_lock(&cl->updateMutex);
+	if (cl->sock != -1) {
+		shutdown(cl->sock, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&cl->updateMutex);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <rfb/rfb.h>
+
+#include "scheduler.h"
+
+
+struct wvnc;
+
+
+struct wvnc_client {
+	struct wvnc *wvnc;
+	// For referring to the client on the control socket
+	unsigned int id;
+
+	// Encoder settings the client asked for, and the ones we last put in
+	// place of them, so that we notice when the client changes its settings
+	int requested_quality;
+	int applied_quality;
+	int requested_compress;
+	int applied_compress;
+
+	// Link estimation. Only touched on the main thread, which is also where
+	// the control commands read it.
+	bool awaiting_request;
+	uint64_t update_sent_at;
+	uint64_t rtt;         // us, smoothed time from an update to the next request
+	double throughput;    // bytes/s, smoothed rate at which the socket drains
+	uint64_t last_sample;
+	uint32_t last_sent;
+	uint32_t last_queued;
+
+	// ContinuousUpdates and Fence extensions. The region is guarded by
+	// cl->updateMutex and NULL unless continuous updates are enabled.
+	bool supports_continuous;
+	atomic_bool supports_fence;
+	sraRegion *continuous_region;
+	// Set while a fence of ours is on its way, the input thread fills in
+	// when the reply arrived before clearing it
+	atomic_bool fence_pending;
+	uint64_t fence_sent_at;
+	uint32_t fence_sent_bytes;
+	uint64_t fence_acked_at;
+	// Sent byte count that has been acknowledged by the last reply
+	uint32_t acked_bytes;
+	uint64_t last_acked_at;
+	uint64_t min_rtt;     // us, fence round trip without our own queueing
+	double delivered;     // bytes/s, smoothed rate at which data arrives
+
+	// Frame the client has all of, for CopyRect from anywhere on its
+	// screen, 0 if we can't tell
+	uint64_t synced_generation;
+
+	// Open H.264 encoding, for video-heavy content. Lossy is set while the
+	// client shows H.264 output that was not repainted with tiles yet. The
+	// frame is the last one of the shared stream it got, 0 before the first.
+	atomic_bool supports_h264;
+	uint64_t h264_frame;
+	bool h264_lossy;
+
+	// Update scheduling, the input thread stamps the last input
+	_Atomic uint64_t last_input;
+	enum sched_class sched_class;
+	uint64_t next_update_at;
+	double time_credit;  // us of serving the client is owed
+	double byte_credit;
+	// For the service order of the current cycle
+	double sched_share;
+	uint32_t sched_rank;
+	// Caps of this client alone, set on the control socket, 0 for none
+	uint64_t frame_interval;  // us
+	uint64_t byte_rate;       // bytes/s
+	double rate_tokens;
+
+	// How many quality levels below the requested one we currently are
+	int quality_drop;
+	unsigned int calm_updates;
+	// Whether an update was held back since the last one sent
+	bool held_back;
+	uint64_t skipped_updates;
+};
+
+
+void client_init(struct wvnc_client *client, struct wvnc *wvnc);
+void client_destroy(struct wvnc_client *client);
+void client_update_estimates(rfbClientPtr cl, uint64_t now);
+bool client_congested(rfbClientPtr cl);
+void client_update_sent(rfbClientPtr cl, uint64_t now);
+int client_quality(struct wvnc_client *client);
+int client_compress(struct wvnc_client *client);
+
+// Ends the connection from a thread other than the input thread. Only the
+// input thread closes client sockets, which it does once it reads the end
+// of the stream, and only the main thread frees the clients after that.
+void client_shutdown(rfbClientPtr cl);
@@ -0,0 +1,244 @@
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "client.h"
+#include "utils.h"
+
+#include "continuous.h"
+
+
+#define ENCODING_CONTINUOUS_UPDATES -313
+#define ENCODING_FENCE -312
+
+// Both directions use the same message types
+#define MSG_CONTINUOUS_UPDATES 150
+#define MSG_FENCE 248
+
+#define FENCE_BLOCK_BEFORE (1u << 0)
+#define FENCE_BLOCK_AFTER  (1u << 1)
+#define FENCE_SYNC_NEXT    (1u << 2)
+#define FENCE_REQUEST      (1u << 31)
+#define FENCE_MAX_PAYLOAD  64
+
+// Payload of the fences we send for pacing, the one announcing Fence
+// support has none
+#define FENCE_PACING 1
+
+
+static bool read_message(rfbClientPtr cl, void *data, int size)
+{
+	int ret = rfbReadExact(cl, data, size);
+	if (ret <= 0) {
+		if (ret < 0) {
+			log_error("Failed to read from client %s", cl->host);
+		}
+		rfbCloseClient(cl);
+		return false;
+	}
+	return true;
+}
+
+
+static void send_message(rfbClientPtr cl, const void *data, int size)
+{
+	// Also sent from the main thread, which must not close the socket
+	if (rfbWriteExact(cl, data, size) < 0) {
+		client_shutdown(cl);
+	}
+}
+
+
+static void send_fence(rfbClientPtr cl, uint32_t flags, const uint8_t *payload, uint8_t length)
+{
+	uint8_t msg[9 + FENCE_MAX_PAYLOAD] = { MSG_FENCE };
+	uint32_t be_flags = htonl(flags);
+	memcpy(msg + 4, &be_flags, sizeof(be_flags));
+	msg[8] = length;
+	memcpy(msg + 9, payload, length);
+	send_message(cl, msg, 9 + length);
+}
+
+
+static void send_end_of_continuous_updates(rfbClientPtr cl)
+{
+	uint8_t msg = MSG_CONTINUOUS_UPDATES;
+	pthread_mutex_lock(&cl->sendMutex);
+	send_message(cl, &msg, sizeof(msg));
+	pthread_mutex_unlock(&cl->sendMutex);
+}
+
+
+static rfbBool handle_new_client(rfbClientPtr cl, void **data)
+{
+	// All the state lives in struct wvnc_client
+	return TRUE;
+}
+
+
+static rfbBool handle_pseudo_encoding(rfbClientPtr cl, void **data, int encoding)
+{
+	// Support is confirmed the first time the client announces its own
+	struct wvnc_client *client = cl->clientData;
+	if (encoding == ENCODING_CONTINUOUS_UPDATES) {
+		if (!client->supports_continuous) {
+			client->supports_continuous = true;
+			send_end_of_continuous_updates(cl);
+		}
+		return TRUE;
+	}
+	if (encoding == ENCODING_FENCE) {
+		if (!atomic_load(&client->supports_fence)) {
+			atomic_store(&client->supports_fence, true);
+			pthread_mutex_lock(&cl->sendMutex);
+			send_fence(cl, FENCE_REQUEST, NULL, 0);
+			pthread_mutex_unlock(&cl->sendMutex);
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+
+static void handle_enable_continuous_updates(rfbClientPtr cl)
+{
+	struct wvnc_client *client = cl->clientData;
+	struct {
+		uint8_t enable;
+		uint16_t x;
+		uint16_t y;
+		uint16_t w;
+		uint16_t h;
+	} __attribute__((packed)) msg;
+	if (!read_message(cl, &msg, sizeof(msg))) {
+		return;
+	}
+	uint32_t x = ntohs(msg.x), y = ntohs(msg.y);
+	uint32_t w = ntohs(msg.w), h = ntohs(msg.h);
+
+	pthread_mutex_lock(&cl->updateMutex);
+	if (client->continuous_region != NULL) {
+		sraRgnDestroy(client->continuous_region);
+		client->continuous_region = NULL;
+	}
+	if (msg.enable) {
+		client->continuous_region = sraRgnCreateRect(x, y, x + w, y + h);
+	}
+	pthread_mutex_unlock(&cl->updateMutex);
+
+	if (!msg.enable) {
+		// The client waits for this before it goes back to requesting
+		send_end_of_continuous_updates(cl);
+	}
+	log_info("Continuous updates %s for %s", msg.enable ? "enabled" : "disabled", cl->host);
+}
+
+
+static void handle_fence(rfbClientPtr cl)
+{
+	struct wvnc_client *client = cl->clientData;
+	struct {
+		uint8_t padding[3];
+		uint32_t flags;
+		uint8_t length;
+	} __attribute__((packed)) msg;
+	uint8_t payload[FENCE_MAX_PAYLOAD];
+	if (!read_message(cl, &msg, sizeof(msg))) {
+		return;
+	}
+	if (msg.length > FENCE_MAX_PAYLOAD) {
+		log_error("Invalid fence from client %s", cl->host);
+		rfbCloseClient(cl);
+		return;
+	}
+	if (msg.length > 0 && !read_message(cl, payload, msg.length)) {
+		return;
+	}
+
+	uint32_t flags = ntohl(msg.flags);
+	if (flags & FENCE_REQUEST) {
+		// Client messages are handled one at a time and in order, so we
+		// block before and after anyway. The reply has to leave out what
+		// we do not support.
+		flags &= FENCE_BLOCK_BEFORE | FENCE_BLOCK_AFTER;
+		pthread_mutex_lock(&cl->sendMutex);
+		send_fence(cl, flags, payload, msg.length);
+		pthread_mutex_unlock(&cl->sendMutex);
+		return;
+	}
+	// A reply to one of ours. Everything sent before it has now arrived.
+	if (msg.length == 1 && payload[0] == FENCE_PACING &&
+		atomic_load(&client->fence_pending)) {
+		client->fence_acked_at = time_monotonic();
+		atomic_store_explicit(&client->fence_pending, false, memory_order_release);
+	}
+}
+
+
+static rfbBool handle_message(rfbClientPtr cl, void *data, const rfbClientToServerMsg *msg)
+{
+	// Only the type has been read at this point
+	switch (msg->type) {
+	case MSG_CONTINUOUS_UPDATES:
+		handle_enable_continuous_updates(cl);
+		return TRUE;
+	case MSG_FENCE:
+		handle_fence(cl);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+
+static int pseudo_encodings[] = {
+	ENCODING_CONTINUOUS_UPDATES,
+	ENCODING_FENCE,
+	0,
+};
+
+
+static rfbProtocolExtension extension = {
+	.newClient = handle_new_client,
+	.pseudoEncodings = pseudo_encodings,
+	.enablePseudoEncoding = handle_pseudo_encoding,
+	.handleMessage = handle_message,
+};
+
+
+void continuous_register()
+{
+	rfbRegisterProtocolExtension(&extension);
+}
+
+
+void continuous_request(rfbClientPtr cl)
+{
+	struct wvnc_client *client = cl->clientData;
+	pthread_mutex_lock(&cl->updateMutex);
+	if (client->continuous_region != NULL) {
+		sraRgnOr(cl->requestedRegion, client->continuous_region);
+	}
+	pthread_mutex_unlock(&cl->updateMutex);
+}
+
+
+void continuous_update_sent(rfbClientPtr cl, uint64_t now)
+{
+	// One fence in flight at a time is enough to follow the link, and the
+	// reply has to be picked up by client_update_estimates() first
+	struct wvnc_client *client = cl->clientData;
+	if (!atomic_load(&client->supports_fence) ||
+		atomic_load_explicit(&client->fence_pending, memory_order_acquire) ||
+		client->fence_acked_at != 0) {
+		return;
+	}
+	uint32_t sent = rfbStatGetSentBytes(cl);
+	if (sent == client->fence_sent_bytes) {
+		return;  // Nothing new since the last one
+	}
+	client->fence_sent_at = now;
+	client->fence_sent_bytes = sent;
+	atomic_store(&client->fence_pending, true);
+	uint8_t payload = FENCE_PACING;
+	send_fence(cl, FENCE_REQUEST | FENCE_BLOCK_BEFORE, &payload, 1);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <rfb/rfb.h>
+
+
+// RFB ContinuousUpdates and Fence extensions. Clients that enable
+// continuous updates get the changes pushed without having to request each
+// update, which takes the round trip out of the frame rate. Fences tell us
+// how much of what we sent has arrived, so that we can pace the pushing.
+
+void continuous_register();
+
+// Adds the continuous updates region, if any, to what the client requested
+void continuous_request(rfbClientPtr cl);
+
+// Fences what was sent to the client so far, under cl->sendMutex
+void continuous_update_sent(rfbClientPtr cl, uint64_t now);
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#include "control.h"
+
+
+void control_listen(struct control *control, const char *path,
+					control_handler_fn handler, void *data)
+{
+	memset(control, 0, sizeof(*control));
+	control->listen_fd = unix_listen(path, 0600);
+	control->handler = handler;
+	control->data = data;
+}
+
+
+static void drop_connection(struct control *control, unsigned int i)
+{
+	close(control->connections[i].sock);
+	control->connections[i] = control->connections[--control->connection_count];
+}
+
+
+void control_destroy(struct control *control)
+{
+	while (control->connection_count > 0) {
+		drop_connection(control, control->connection_count - 1);
+	}
+	close(control->listen_fd);
+	free(control->reply.data);
+}
+
+
+int control_set_fds(struct control *control, fd_set *fds, int max_fd)
+{
+	FD_SET(control->listen_fd, fds);
+	max_fd = max(max_fd, control->listen_fd);
+	for (unsigned int i = 0; i < control->connection_count; i++) {
+		FD_SET(control->connections[i].sock, fds);
+		max_fd = max(max_fd, control->connections[i].sock);
+	}
+	return max_fd;
+}
+
+
+void control_printf(struct control_reply *reply, const char *format, ...)
+{
+	va_list vas;
+	va_start(vas, format);
+	int length = vsnprintf(NULL, 0, format, vas);
+	va_end(vas);
+	if (length < 0) {
+		return;
+	}
+	if (reply->length + length + 1 > reply->capacity) {
+		size_t capacity = max(reply->capacity * 2, reply->length + length + 1);
+		char *data = xmalloc(capacity);
+		memcpy(data, reply->data, reply->length);
+		free(reply->data);
+		reply->data = data;
+		reply->capacity = capacity;
+	}
+	va_start(vas, format);
+	vsnprintf(reply->data + reply->length, length + 1, format, vas);
+	va_end(vas);
+	reply->length += length;
+}
+
+
+static void accept_connections(struct control *control)
+{
+	while (true) {
+		int sock = accept4(control->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				log_error("Failed to accept a control connection: %s", strerror(errno));
+			}
+			return;
+		}
+		if (control->connection_count == CONTROL_MAX_CONNECTIONS) {
+			log_error("Too many control connections");
+			close(sock);
+			continue;
+		}
+		control->connections[control->connection_count++] = (struct control_connection) {
+			.sock = sock,
+			.fresh = true,
+		};
+	}
+}
+
+
+static void run_command(struct control *control, char *line)
+{
+	char *argv[CONTROL_MAX_WORDS];
+	int argc = 0;
+	char *save;
+	for (char *word = strtok_r(line, " \t\r", &save); word != NULL;
+		 word = strtok_r(NULL, " \t\r", &save)) {
+		if (argc == CONTROL_MAX_WORDS) {
+			control_printf(&control->reply, "error: too many words\n");
+			return;
+		}
+		argv[argc++] = word;
+	}
+	if (argc == 0) {
+		return;
+	}
+	const char *error = control->handler(control->data, argc, argv, &control->reply);
+	if (error != NULL) {
+		control_printf(&control->reply, "error: %s\n", error);
+	} else {
+		control_printf(&control->reply, "ok\n");
+	}
+}
+
+
+// Returns false if the connection is done with
+static bool read_commands(struct control *control, struct control_connection *connection)
+{
+	control->reply.length = 0;
+	bool open = true;
+	while (open) {
+		ssize_t ret = recv(connection->sock, connection->line + connection->length,
+						   sizeof(connection->line) - connection->length, 0);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (ret <= 0) {
+			// Still answering whatever came before the end
+			open = false;
+			break;
+		}
+		connection->length += ret;
+		char *end;
+		while ((end = memchr(connection->line, '\n', connection->length)) != NULL) {
+			*end = '\0';
+			run_command(control, connection->line);
+			size_t used = end + 1 - connection->line;
+			memmove(connection->line, end + 1, connection->length - used);
+			connection->length -= used;
+		}
+		if (connection->length == sizeof(connection->line)) {
+			control_printf(&control->reply, "error: line too long\n");
+			open = false;
+		}
+	}
+	// Replies are small, a client that does not read them gets dropped
+	// rather than stalling the frames
+	if (control->reply.length > 0 &&
+		send(connection->sock, control->reply.data, control->reply.length,
+			 MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)control->reply.length) {
+		return false;
+	}
+	return open;
+}
+
+
+void control_process(struct control *control, const fd_set *fds)
+{
+	if (FD_ISSET(control->listen_fd, fds)) {
+		accept_connections(control);
+	}
+	for (unsigned int i = 0; i < control->connection_count; ) {
+		struct control_connection *connection = &control->connections[i];
+		// Those accepted just now are not in fds, but may have sent
+		// something already
+		if (FD_ISSET(connection->sock, fds) || connection->fresh) {
+			connection->fresh = false;
+			if (!read_commands(control, connection)) {
+				drop_connection(control, i);
+				continue;
+			}
+		}
+		i++;
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/select.h>
+
+
+// Local control socket, for changing settings while clients stay
+// connected. Commands are lines of whitespace separated words. Each gets
+// answered with whatever lines it prints, then "ok" or "error: <reason>".
+// The commands themselves are up to the handler, and run on the thread
+// calling control_process(), between frames.
+
+#define CONTROL_MAX_CONNECTIONS 8
+#define CONTROL_LINE_MAX 256
+#define CONTROL_MAX_WORDS 8
+
+struct control_reply {
+	char *data;
+	size_t length;
+	size_t capacity;
+};
+
+// Runs a command, returns NULL on success and the reason otherwise
+typedef const char *(*control_handler_fn)(void *data, int argc, char **argv,
+										  struct control_reply *reply);
+
+struct control_connection {
+	int sock;
+	char line[CONTROL_LINE_MAX];
+	size_t length;
+	// Accepted since the last select(), so not in its fds yet
+	bool fresh;
+};
+
+struct control {
+	int listen_fd;
+	struct control_connection connections[CONTROL_MAX_CONNECTIONS];
+	unsigned int connection_count;
+	control_handler_fn handler;
+	void *data;
+	struct control_reply reply;
+};
+
+
+void control_listen(struct control *control, const char *path,
+					control_handler_fn handler, void *data);
+void control_destroy(struct control *control);
+
+// Adds the sockets to wait on, returns the new highest fd
+int control_set_fds(struct control *control, fd_set *fds, int max_fd);
+// Accepts connections and runs the commands that arrived on the sockets
+// that are set in fds
+void control_process(struct control *control, const fd_set *fds);
+
+__attribute__((format(printf, 2, 3)))
+void control_printf(struct control_reply *reply, const char *format, ...);
@@ -0,0 +1,257 @@
+#include <assert.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "dedup.h"
+
+
+// Index slots per tile, collisions just forget the older tile
+#define DEDUP_INDEX_FACTOR 4
+// How far we follow copies reading from each other when looking for a
+// cycle, beyond that we give up on the copy
+#define DEDUP_MAX_CHAIN 256
+
+#define DEDUP_HASH_PRIME 0x100000001b3ull
+
+
+void dedup_init(struct dedup *dedup, uint32_t width, uint32_t height, uint32_t tile_size)
+{
+	memset(dedup, 0, sizeof(*dedup));
+	dedup->width = width;
+	dedup->height = height;
+	dedup->tile_size = tile_size;
+	dedup->tile_count_x = (width + tile_size - 1) / tile_size;
+	dedup->tile_count_y = (height + tile_size - 1) / tile_size;
+	size_t tile_count = (size_t)dedup->tile_count_x * dedup->tile_count_y;
+	dedup->hash = xmalloc(tile_count * sizeof(uint64_t));
+	dedup->prev_hash = xmalloc(tile_count * sizeof(uint64_t));
+	dedup->prev = xmalloc(tile_count * tile_size * tile_size * sizeof(rgba_t));
+	dedup->saved_generation = xmalloc(tile_count * sizeof(uint64_t));
+	dedup->pending = xmalloc(tile_count * sizeof(unsigned int));
+	size_t index_size = 1;
+	while (index_size < tile_count * DEDUP_INDEX_FACTOR) {
+		index_size *= 2;
+	}
+	dedup->index = xmalloc(index_size * sizeof(unsigned int));
+	dedup->index_mask = index_size - 1;
+	dedup->copies = xmalloc(tile_count * sizeof(struct dedup_copy));
+	dedup->dest_stamp = xmalloc(tile_count * sizeof(uint32_t));
+	dedup->dest_copy = xmalloc(tile_count * sizeof(unsigned int));
+	dedup->ordered = xmalloc(tile_count * sizeof(struct dedup_copy));
+	dedup->readers = xmalloc(tile_count * sizeof(unsigned int));
+}
+
+
+void dedup_destroy(struct dedup *dedup)
+{
+	free(dedup->hash);
+	free(dedup->prev_hash);
+	free(dedup->prev);
+	free(dedup->saved_generation);
+	free(dedup->pending);
+	free(dedup->index);
+	free(dedup->copies);
+	free(dedup->dest_stamp);
+	free(dedup->dest_copy);
+	free(dedup->ordered);
+	free(dedup->readers);
+	memset(dedup, 0, sizeof(*dedup));
+}
+
+
+static void tile_rect(struct dedup *dedup, unsigned int tile,
+					  uint32_t *x, uint32_t *y, uint32_t *w, uint32_t *h)
+{
+	*x = tile % dedup->tile_count_x * dedup->tile_size;
+	*y = tile / dedup->tile_count_x * dedup->tile_size;
+	*w = min(dedup->tile_size, dedup->width - *x);
+	*h = min(dedup->tile_size, dedup->height - *y);
+}
+
+
+static uint64_t hash_tile(struct dedup *dedup, const rgba_t *fb, unsigned int tile)
+{
+	// FNV-1a on whole pixels, in four independent lanes so that the
+	// multiplications overlap
+	uint32_t x, y, w, h;
+	tile_rect(dedup, tile, &x, &y, &w, &h);
+	uint64_t lanes[4] = { w, h, 0x9e3779b97f4a7c15ull, 0xcbf29ce484222325ull };
+	for (uint32_t row = y; row < y + h; row++) {
+		const uint32_t *pixels = (const uint32_t *)(fb + (size_t)row * dedup->width + x);
+		uint32_t i = 0;
+		for (; i + 4 <= w; i += 4) {
+			for (int lane = 0; lane < 4; lane++) {
+				lanes[lane] = (lanes[lane] ^ pixels[i + lane]) * DEDUP_HASH_PRIME;
+			}
+		}
+		for (; i < w; i++) {
+			lanes[0] = (lanes[0] ^ pixels[i]) * DEDUP_HASH_PRIME;
+		}
+	}
+	uint64_t hash = lanes[0];
+	for (int lane = 1; lane < 4; lane++) {
+		hash = (hash ^ (hash >> 29) ^ lanes[lane]) * DEDUP_HASH_PRIME;
+	}
+	return hash ^ (hash >> 32);
+}
+
+
+void dedup_save(struct dedup *dedup, const rgba_t *fb,
+				uint32_t tile_x_start, uint32_t tile_x_end,
+				uint32_t tile_y_start, uint32_t tile_y_end, uint64_t generation)
+{
+	for (uint32_t tile_y = tile_y_start; tile_y < tile_y_end; tile_y++) {
+		for (uint32_t tile_x = tile_x_start; tile_x < tile_x_end; tile_x++) {
+			unsigned int tile = tile_y * dedup->tile_count_x + tile_x;
+			if (dedup->saved_generation[tile] == generation) {
+				continue;
+			}
+			uint32_t x, y, w, h;
+			tile_rect(dedup, tile, &x, &y, &w, &h);
+			rgba_t *out = dedup->prev + (size_t)tile * dedup->tile_size * dedup->tile_size;
+			for (uint32_t row = 0; row < h; row++) {
+				memcpy(out + row * w, fb + (size_t)(y + row) * dedup->width + x, w * sizeof(rgba_t));
+			}
+			dedup->saved_generation[tile] = generation;
+		}
+	}
+}
+
+
+void dedup_frame(struct dedup *dedup, const rgba_t *fb, const uint64_t *tile_generation,
+				 uint64_t generation)
+{
+	// The tiles that changed in the last frame are what the synced clients
+	// have now, the hashes are still of those contents
+	for (unsigned int i = 0; i < dedup->pending_count; i++) {
+		unsigned int tile = dedup->pending[i];
+		dedup->index[dedup->hash[tile] & dedup->index_mask] = tile + 1;
+	}
+	dedup->pending_count = 0;
+
+	unsigned int tile_count = dedup->tile_count_x * dedup->tile_count_y;
+	for (unsigned int tile = 0; tile < tile_count; tile++) {
+		if (tile_generation[tile] != generation) {
+			continue;
+		}
+		dedup->prev_hash[tile] = dedup->hash[tile];
+		dedup->hash[tile] = hash_tile(dedup, fb, tile);
+		dedup->pending[dedup->pending_count++] = tile;
+	}
+	dedup->generation = generation;
+}
+
+
+void dedup_begin(struct dedup *dedup)
+{
+	dedup->stamp++;
+	dedup->copy_count = 0;
+}
+
+
+bool dedup_find(struct dedup *dedup, const rgba_t *fb, const uint64_t *tile_generation,
+				unsigned int dest, uint64_t synced)
+{
+	uint64_t generation = dedup->generation;
+	if (synced == 0 || synced >= generation) {
+		// Nothing useful on the client
+		return false;
+	}
+	uint64_t hash = dedup->hash[dest];
+	unsigned int slot = dedup->index[hash & dedup->index_mask];
+	if (slot == 0) {
+		return false;
+	}
+	unsigned int source = slot - 1;
+	if (source == dest) {
+		return false;
+	}
+
+	uint32_t src_x, src_y, src_w, src_h, x, y, w, h;
+	tile_rect(dedup, source, &src_x, &src_y, &src_w, &src_h);
+	tile_rect(dedup, dest, &x, &y, &w, &h);
+	if (src_w != w || src_h != h) {
+		return false;
+	}
+	// Where the client has what it shows in the source tile
+	const rgba_t *pixels;
+	size_t stride;
+	if (tile_generation[source] <= synced && dedup->hash[source] == hash) {
+		pixels = fb + (size_t)src_y * dedup->width + src_x;
+		stride = dedup->width;
+	} else if (synced == generation - 1 && tile_generation[source] == generation &&
+			   dedup->saved_generation[source] == generation &&
+			   dedup->prev_hash[source] == hash) {
+		pixels = dedup->prev + (size_t)source * dedup->tile_size * dedup->tile_size;
+		stride = w;
+	} else {
+		return false;
+	}
+	for (uint32_t row = 0; row < h; row++) {
+		if (memcmp(pixels + row * stride, fb + (size_t)(y + row) * dedup->width + x,
+				   w * sizeof(rgba_t))) {
+			return false;
+		}
+	}
+
+	// The source may be overwritten by another copy, which then has to
+	// come later, so the copies reading from each other must not go round
+	unsigned int tile = source;
+	for (int i = 0; dedup->dest_stamp[tile] == dedup->stamp; i++) {
+		tile = dedup->copies[dedup->dest_copy[tile]].source;
+		if (tile == dest || i == DEDUP_MAX_CHAIN) {
+			return false;
+		}
+	}
+
+	dedup->dest_stamp[dest] = dedup->stamp;
+	dedup->dest_copy[dest] = dedup->copy_count;
+	dedup->copies[dedup->copy_count++] = (struct dedup_copy) {
+		.dest = dest,
+		.source = source,
+	};
+	return true;
+}
+
+
+void dedup_order(struct dedup *dedup)
+{
+	// Topological order, each copy goes after all the copies that read
+	// the tile it writes
+	unsigned int count = dedup->copy_count;
+	memset(dedup->readers, 0, count * sizeof(unsigned int));
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int source = dedup->copies[i].source;
+		if (dedup->dest_stamp[source] == dedup->stamp) {
+			dedup->readers[dedup->dest_copy[source]]++;
+		}
+	}
+	unsigned int ordered = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		if (dedup->readers[i] == 0) {
+			dedup->ordered[ordered++] = dedup->copies[i];
+		}
+	}
+	// The ordered copies double as the queue
+	for (unsigned int i = 0; i < ordered; i++) {
+		unsigned int source = dedup->ordered[i].source;
+		if (dedup->dest_stamp[source] != dedup->stamp) {
+			continue;
+		}
+		unsigned int writer = dedup->dest_copy[source];
+		if (--dedup->readers[writer] == 0) {
+			dedup->ordered[ordered++] = dedup->copies[writer];
+		}
+	}
+	assert(ordered == count);
+	memcpy(dedup->copies, dedup->ordered, count * sizeof(struct dedup_copy));
+	// The destinations now point into the old order, which nobody needs
+	// anymore
+}
+
+
+bool dedup_copied(struct dedup *dedup, unsigned int tile)
+{
+	return dedup->dest_stamp[tile] == dedup->stamp;
+}
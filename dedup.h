@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wvnc.h"
+
+
+// Finds dirty tiles whose contents a client already has elsewhere on its
+// screen, so that they can be sent as CopyRect instead of being encoded.
+// The tiles are hashed as they change, and an index remembers for each
+// hash a tile that held these contents in the frame before the current
+// one. A window that moved by whole tiles or content repeated on the tile
+// grid then costs 16 bytes per tile.
+//
+// Clients only have the previous frame if they got all of it, which the
+// caller keeps track of. The tiles that changed in the current frame also
+// keep their previous contents, so they can still serve as the source
+// for such clients, e.g. the area a window moved away from.
+
+struct dedup_copy {
+	unsigned int dest;
+	unsigned int source;
+};
+
+struct dedup {
+	uint32_t width;
+	uint32_t height;
+	uint32_t tile_size;
+	uint32_t tile_count_x;
+	uint32_t tile_count_y;
+	// Frame the hashes are up to date with
+	uint64_t generation;
+	// Of the current contents of each tile, and of the ones before its
+	// last change
+	uint64_t *hash;
+	uint64_t *prev_hash;
+	// Previous contents of the tiles that changed in saved_generation,
+	// tile_size * tile_size pixels for each tile
+	rgba_t *prev;
+	uint64_t *saved_generation;
+	// Tiles that changed in the last frame, indexed with the next one
+	unsigned int *pending;
+	unsigned int pending_count;
+	// Direct mapped, tile + 1 by hash
+	unsigned int *index;
+	uint64_t index_mask;
+	// The copies found for the current update, and for each destination
+	// tile in it, which of them writes it
+	struct dedup_copy *copies;
+	unsigned int copy_count;
+	uint32_t *dest_stamp;
+	unsigned int *dest_copy;
+	uint32_t stamp;
+	// Scratch space for dedup_order()
+	struct dedup_copy *ordered;
+	unsigned int *readers;
+};
+
+
+void dedup_init(struct dedup *dedup, uint32_t width, uint32_t height, uint32_t tile_size);
+void dedup_destroy(struct dedup *dedup);
+
+// Keeps the contents of the tiles in the given range, before they get
+// overwritten with those of the frame generation
+void dedup_save(struct dedup *dedup, const rgba_t *fb,
+				uint32_t tile_x_start, uint32_t tile_x_end,
+				uint32_t tile_y_start, uint32_t tile_y_end, uint64_t generation);
+// Rehashes the tiles that changed in the frame generation
+void dedup_frame(struct dedup *dedup, const rgba_t *fb, const uint64_t *tile_generation,
+				 uint64_t generation);
+
+void dedup_begin(struct dedup *dedup);
+// Looks for a tile with the contents the destination tile has now in the
+// frame synced, which the client has in full. If there is one, it gets
+// added to the copies, which have to be sent before anything else in the
+// update is drawn.
+bool dedup_find(struct dedup *dedup, const rgba_t *fb, const uint64_t *tile_generation,
+				unsigned int dest, uint64_t synced);
+// Puts the copies into an order in which every tile gets copied from
+// before it is overwritten, e.g. back to front for a moved window
+void dedup_order(struct dedup *dedup);
+// Whether the tile is a destination in the current update
+bool dedup_copied(struct dedup *dedup, unsigned int tile);
@@ -0,0 +1,127 @@
+#include <string.h>
+
+#include <rfb/rfbproto.h>
+
+#include "utils.h"
+
+#include "encode.h"
+
+
+#define HEXTILE_SIZE 16u
+
+
+static inline uint32_t load_pixel(const uint8_t *p, uint32_t bpp)
+{
+	switch (bpp) {
+	case 1:
+		return *p;
+	case 2:
+		return *(const uint16_t *)p;
+	default:
+		return *(const uint32_t *)p;
+	}
+}
+
+
+size_t encode_hextile_max_size(uint32_t bpp, uint32_t w, uint32_t h)
+{
+	uint32_t tiles = ((w + HEXTILE_SIZE - 1) / HEXTILE_SIZE) *
+		((h + HEXTILE_SIZE - 1) / HEXTILE_SIZE);
+	// Worst case is every subtile being raw
+	return w * h * bpp + tiles;
+}
+
+
+static size_t encode_subtile(uint8_t *out, const uint8_t *pixels, uint32_t stride,
+							 uint32_t bpp, uint32_t w, uint32_t h)
+{
+	// We always specify the colors explicitly instead of carrying them over
+	// from the previous subtile, so that every rectangle stands on its own
+	const uint8_t *bg_p = pixels;
+	const uint8_t *fg_p = pixels;
+	uint32_t bg = load_pixel(bg_p, bpp);
+	uint32_t fg = bg;
+	uint32_t bg_count = 0;
+	for (uint32_t y = 0; y < h; y++) {
+		const uint8_t *row = pixels + y * stride;
+		for (uint32_t x = 0; x < w; x++) {
+			uint32_t c = load_pixel(row + x * bpp, bpp);
+			if (c == bg) {
+				bg_count++;
+			} else if (fg == bg) {
+				fg = c;
+				fg_p = row + x * bpp;
+			} else if (c != fg) {
+				goto raw;
+			}
+		}
+	}
+
+	if (fg == bg) {
+		out[0] = rfbHextileBackgroundSpecified;
+		memcpy(&out[1], pixels, bpp);
+		return 1 + bpp;
+	}
+
+	// Two colors, send the less common one as runs on top of the other
+	if (bg_count * 2 < w * h) {
+		const uint8_t *tmp_p = bg_p;
+		bg_p = fg_p;
+		fg_p = tmp_p;
+		fg = bg;
+	}
+	size_t raw_size = 1 + w * h * bpp;
+	size_t header_size = 1 + 2 * bpp + 1;
+	size_t size = header_size;
+	unsigned int subrects = 0;
+	for (uint32_t y = 0; y < h; y++) {
+		const uint8_t *row = pixels + y * stride;
+		uint32_t x = 0;
+		while (x < w) {
+			if (load_pixel(row + x * bpp, bpp) != fg) {
+				x++;
+				continue;
+			}
+			uint32_t start = x;
+			while (x < w && load_pixel(row + x * bpp, bpp) == fg) {
+				x++;
+			}
+			if (size + 2 >= raw_size) {
+				goto raw;
+			}
+			out[size++] = rfbHextilePackXY(start, y);
+			out[size++] = rfbHextilePackWH(x - start, 1);
+			subrects++;
+		}
+	}
+	out[0] = rfbHextileBackgroundSpecified | rfbHextileForegroundSpecified |
+		rfbHextileAnySubrects;
+	memcpy(&out[1], bg_p, bpp);
+	memcpy(&out[1 + bpp], fg_p, bpp);
+	out[1 + 2 * bpp] = subrects;
+	return size;
+
+raw:
+	out[0] = rfbHextileRaw;
+	for (uint32_t y = 0; y < h; y++) {
+		memcpy(&out[1 + y * w * bpp], pixels + y * stride, w * bpp);
+	}
+	return 1 + w * h * bpp;
+}
+
+
+size_t encode_hextile(uint8_t *out, const uint8_t *pixels,
+					  uint32_t bpp, uint32_t w, uint32_t h)
+{
+	size_t size = 0;
+	uint32_t stride = w * bpp;
+	for (uint32_t y = 0; y < h; y += HEXTILE_SIZE) {
+		for (uint32_t x = 0; x < w; x += HEXTILE_SIZE) {
+			size += encode_subtile(
+				out + size, pixels + y * stride + x * bpp, stride, bpp,
+				min(HEXTILE_SIZE, w - x), min(HEXTILE_SIZE, h - y)
+			);
+		}
+	}
+	return size;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Encoders working on pixels already translated into the client pixel
+// format, packed without padding between lines. Unlike the zlib based
+// encodings, their output does not depend on any per-client state, so it
+// can be shared between clients.
+
+size_t encode_hextile_max_size(uint32_t bpp, uint32_t w, uint32_t h);
+size_t encode_hextile(uint8_t *out, const uint8_t *pixels,
+					  uint32_t bpp, uint32_t w, uint32_t h);
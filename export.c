@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#include "export.h"
+
+
+// Keeps the framebuffer rows and tile arrays off the header's cache lines
+#define EXPORT_ALIGN 64
+
+
+static size_t align(size_t size)
+{
+	return (size + EXPORT_ALIGN - 1) / EXPORT_ALIGN * EXPORT_ALIGN;
+}
+
+
+void export_listen(struct export *export, const char *path)
+{
+	memset(export, 0, sizeof(*export));
+	export->memfd = -1;
+	export->listen_fd = unix_listen(path, 0600);
+}
+
+
+static void drop_consumer(struct export *export, unsigned int i)
+{
+	close(export->consumers[i].sock);
+	close(export->consumers[i].event_fd);
+	export->consumers[i] = export->consumers[--export->consumer_count];
+}
+
+
+static void drop_consumers(struct export *export)
+{
+	while (export->consumer_count > 0) {
+		drop_consumer(export, export->consumer_count - 1);
+	}
+}
+
+
+void export_destroy(struct export *export)
+{
+	drop_consumers(export);
+	export_unmap_stale(export);
+	if (export->header != NULL) {
+		munmap(export->header, export->header->size);
+		close(export->memfd);
+		export->header = NULL;
+	}
+	close(export->listen_fd);
+}
+
+
+rgba_t *export_map(struct export *export, uint32_t width, uint32_t height,
+				   uint32_t tile_size)
+{
+	uint32_t tile_count_x = (width + tile_size - 1) / tile_size;
+	uint32_t tile_count_y = (height + tile_size - 1) / tile_size;
+	size_t tile_count = (size_t)tile_count_x * tile_count_y;
+	size_t fb_offset = align(sizeof(struct export_header));
+	size_t bitmap_offset = align(fb_offset + (size_t)width * height * sizeof(rgba_t));
+	size_t generations_offset = align(bitmap_offset + (tile_count + 63) / 64 * sizeof(uint64_t));
+	size_t size = generations_offset + tile_count * sizeof(uint64_t);
+	if (generations_offset > UINT32_MAX) {
+		fail("Framebuffer too large to export");
+	}
+
+	int memfd = memfd_create("wvnc-export", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0 || ftruncate(memfd, size) < 0) {
+		fail("Failed to create the export memfd");
+	}
+	// Consumers map the whole size, it must not shrink under them
+	fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+	struct export_header *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (header == MAP_FAILED) {
+		fail("Failed to map the export memfd");
+	}
+
+	bool writing = false;
+	if (export->header != NULL) {
+		// Resized in the middle of a frame, which carries over to the new
+		// segment. The old one gets released for good.
+		uint64_t seq = atomic_load_explicit(&export->header->seq, memory_order_relaxed);
+		writing = seq & 1;
+		export->header->flags |= EXPORT_FLAG_STALE;
+		atomic_store_explicit(&export->header->seq, (seq | 1) + 1, memory_order_release);
+		drop_consumers(export);
+		export_unmap_stale(export);
+		export->stale = export->header;
+		close(export->memfd);
+	}
+
+	memcpy(header->magic, EXPORT_MAGIC, sizeof(header->magic));
+	atomic_init(&header->seq, writing ? 1 : 0);
+	header->size = size;
+	header->width = width;
+	header->height = height;
+	header->stride = width * sizeof(rgba_t);
+	header->tile_size = tile_size;
+	header->tile_count_x = tile_count_x;
+	header->tile_count_y = tile_count_y;
+	header->fb_offset = fb_offset;
+	header->bitmap_offset = bitmap_offset;
+	header->generations_offset = generations_offset;
+	export->memfd = memfd;
+	export->header = header;
+	export->bitmap = (uint64_t *)((uint8_t *)header + bitmap_offset);
+	export->generations = (uint64_t *)((uint8_t *)header + generations_offset);
+	return (rgba_t *)((uint8_t *)header + fb_offset);
+}
+
+
+void export_unmap_stale(struct export *export)
+{
+	if (export->stale != NULL) {
+		munmap(export->stale, export->stale->size);
+		export->stale = NULL;
+	}
+}
+
+
+static bool send_hello(struct export *export, int sock, int event_fd)
+{
+	// Consumers get a read-only descriptor, so that they can't map the
+	// segment writable
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", export->memfd);
+	int memfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (memfd < 0) {
+		return false;
+	}
+
+	struct export_hello hello = { .size = export->header->size };
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	int fds[2] = { memfd, event_fd };
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	bool ok = sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(hello);
+	close(memfd);
+	return ok;
+}
+
+
+void export_accept(struct export *export)
+{
+	while (true) {
+		int sock = accept4(export->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				log_error("Failed to accept an export consumer: %s", strerror(errno));
+			}
+			return;
+		}
+		if (export->header == NULL) {
+			log_error("No framebuffer to export yet, turning away a consumer");
+			close(sock);
+			continue;
+		}
+		if (export->consumer_count == EXPORT_MAX_CONSUMERS) {
+			log_error("Too many export consumers");
+			close(sock);
+			continue;
+		}
+		// Blocking, as the flag is shared with the consumer
+		int event_fd = eventfd(0, EFD_CLOEXEC);
+		if (event_fd < 0 || !send_hello(export, sock, event_fd)) {
+			log_error("Failed to set up an export consumer");
+			if (event_fd >= 0) {
+				close(event_fd);
+			}
+			close(sock);
+			continue;
+		}
+		export->consumers[export->consumer_count++] = (struct export_consumer) {
+			.sock = sock,
+			.event_fd = event_fd,
+		};
+		log_info("Export consumer connected, %u in total", export->consumer_count);
+	}
+}
+
+
+void export_begin(struct export *export)
+{
+	uint64_t seq = atomic_load_explicit(&export->header->seq, memory_order_relaxed);
+	atomic_store_explicit(&export->header->seq, seq + 1, memory_order_relaxed);
+	// Orders the odd seq before any of the writes to the frame
+	atomic_thread_fence(memory_order_release);
+}
+
+
+static bool consumer_alive(struct export_consumer *consumer)
+{
+	// Consumers never send anything, so readable means gone
+	char c;
+	ssize_t ret = recv(consumer->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+void export_end(struct export *export, const uint64_t *tile_generation, size_t tile_count,
+				uint64_t generation)
+{
+	struct export_header *header = export->header;
+	bool changed = header->generation != generation;
+	if (changed) {
+		size_t segment_tiles = (size_t)header->tile_count_x * header->tile_count_y;
+		tile_count = min(tile_count, segment_tiles);
+		memset(export->bitmap, 0, (segment_tiles + 63) / 64 * sizeof(uint64_t));
+		for (size_t tile = 0; tile < tile_count; tile++) {
+			if (tile_generation[tile] == generation) {
+				export->bitmap[tile / 64] |= (uint64_t)1 << (tile % 64);
+			}
+		}
+		memcpy(export->generations, tile_generation, tile_count * sizeof(uint64_t));
+		memset(export->generations + tile_count, 0,
+			   (segment_tiles - tile_count) * sizeof(uint64_t));
+		header->generation = generation;
+		header->timestamp = time_monotonic();
+	}
+	uint64_t seq = atomic_load_explicit(&header->seq, memory_order_relaxed);
+	atomic_store_explicit(&header->seq, seq + 1, memory_order_release);
+	if (!changed) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < export->consumer_count; ) {
+		if (!consumer_alive(&export->consumers[i])) {
+			drop_consumer(export, i);
+			log_info("Export consumer disconnected, %u left", export->consumer_count);
+			continue;
+		}
+		eventfd_write(export->consumers[i].event_fd, 1);
+		i++;
+	}
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wvnc.h"
+
+
+// Shared memory export of the framebuffer, for local consumers that would
+// otherwise have to connect over RFB and decode everything. wvnc listens
+// on a unix socket and sends each consumer that connects a struct
+// export_hello, with a read-only memfd of the segment and an eventfd
+// attached as SCM_RIGHTS, in that order.
+//
+// The segment starts with a struct export_header, the offsets in it point
+// to the framebuffer (rgba_t rows of stride bytes, alpha undefined), the
+// bitmap of the tiles that changed in the last frame (uint64_t words, tile
+// n is bit n % 64 of word n / 64) and the generation in which each tile
+// last changed (uint64_t). The framebuffer is converted right into the
+// segment, so the header is a seqlock: seq is odd while a frame is being
+// written, consumers have to retry whatever they read if seq was odd or
+// changed in the meantime. The eventfd is signalled after each frame.
+// Consumers that may miss frames should go by the tile generations rather
+// than the bitmap.
+//
+// If the framebuffer gets resized, the segment is marked with
+// EXPORT_FLAG_STALE and the connection closed, consumers then have to
+// connect again to get the new one.
+
+#define EXPORT_MAGIC "WVNCSHM1"
+#define EXPORT_FLAG_STALE (1 << 0)
+
+#define EXPORT_MAX_CONSUMERS 16
+
+struct export_header {
+	char magic[8];
+	_Atomic uint64_t seq;
+	uint64_t generation;
+	uint64_t timestamp;  // us, CLOCK_MONOTONIC_RAW
+	uint64_t size;
+	uint32_t flags;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t tile_size;
+	uint32_t tile_count_x;
+	uint32_t tile_count_y;
+	uint32_t fb_offset;
+	uint32_t bitmap_offset;
+	uint32_t generations_offset;
+};
+
+struct export_hello {
+	uint64_t size;  // Of the segment, for mmap()
+};
+
+
+struct export_consumer {
+	int sock;
+	int event_fd;
+};
+
+struct export {
+	int listen_fd;
+	int memfd;
+	struct export_header *header;
+	uint64_t *bitmap;
+	uint64_t *generations;
+	// The previous segment after a resize, unmapped once nothing uses the
+	// framebuffer in it anymore
+	struct export_header *stale;
+	struct export_consumer consumers[EXPORT_MAX_CONSUMERS];
+	unsigned int consumer_count;
+};
+
+
+void export_listen(struct export *export, const char *path);
+void export_destroy(struct export *export);
+
+// Creates the segment for a framebuffer of the given size, replacing the
+// current one, and returns the framebuffer in it
+rgba_t *export_map(struct export *export, uint32_t width, uint32_t height,
+				   uint32_t tile_size);
+void export_unmap_stale(struct export *export);
+
+// Accepts the consumers waiting on the socket
+void export_accept(struct export *export);
+
+// Brackets writing a frame into the segment. tile_generation holds
+// tile_count tiles, the ones of the segment past that count as unchanged.
+void export_begin(struct export *export);
+void export_end(struct export *export, const uint64_t *tile_generation, size_t tile_count,
+				uint64_t generation);
@@ -0,0 +1,223 @@
+#include <stdatomic.h>
+#include <string.h>
+#include <wels/codec_api.h>
+
+#include <rfb/rfb.h>
+
+#include "client.h"
+#include "utils.h"
+
+#include "h264.h"
+
+
+struct h264_encoder {
+	ISVCEncoder *svc;
+	uint32_t width;
+	uint32_t height;
+	uint8_t *yuv;
+	uint8_t *out;
+	size_t out_capacity;
+};
+
+
+static rfbBool handle_new_client(rfbClientPtr cl, void **data)
+{
+	return TRUE;
+}
+
+
+static rfbBool handle_pseudo_encoding(rfbClientPtr cl, void **data, int encoding)
+{
+	// libvncserver hands us every encoding it does not know itself, not
+	// only the pseudo ones
+	if (encoding != H264_ENCODING) {
+		return FALSE;
+	}
+	struct wvnc_client *client = cl->clientData;
+	atomic_store(&client->supports_h264, true);
+	return TRUE;
+}
+
+
+static int encodings[] = {
+	H264_ENCODING,
+	0,
+};
+
+
+static rfbProtocolExtension extension = {
+	.newClient = handle_new_client,
+	.pseudoEncodings = encodings,
+	.enablePseudoEncoding = handle_pseudo_encoding,
+};
+
+
+void h264_register()
+{
+	rfbRegisterProtocolExtension(&extension);
+}
+
+
+struct h264_encoder *h264_encoder_create(uint32_t width, uint32_t height,
+										 uint32_t bitrate, uint32_t keyint,
+										 float fps)
+{
+	ISVCEncoder *svc;
+	if (WelsCreateSVCEncoder(&svc) != 0) {
+		return NULL;
+	}
+	SEncParamExt param;
+	(*svc)->GetDefaultParams(svc, &param);
+	param.iUsageType = SCREEN_CONTENT_REAL_TIME;
+	param.iPicWidth = width;
+	param.iPicHeight = height;
+	param.iRCMode = RC_BITRATE_MODE;
+	param.iTargetBitrate = bitrate;
+	param.fMaxFrameRate = fps;
+	param.uiIntraPeriod = keyint;
+	// Skipped frames would leave the client behind until the next change
+	param.bEnableFrameSkip = false;
+	// We already encode the clients in parallel to capturing
+	param.iMultipleThreadIdc = 1;
+	param.eSpsPpsIdStrategy = CONSTANT_ID;
+	param.iSpatialLayerNum = 1;
+	param.iTemporalLayerNum = 1;
+	param.sSpatialLayers[0].iVideoWidth = width;
+	param.sSpatialLayers[0].iVideoHeight = height;
+	param.sSpatialLayers[0].fFrameRate = fps;
+	param.sSpatialLayers[0].iSpatialBitrate = bitrate;
+	param.sSpatialLayers[0].sSliceArgument.uiSliceMode = SM_SINGLE_SLICE;
+	if ((*svc)->InitializeExt(svc, &param) != 0) {
+		WelsDestroySVCEncoder(svc);
+		return NULL;
+	}
+	int format = videoFormatI420;
+	(*svc)->SetOption(svc, ENCODER_OPTION_DATAFORMAT, &format);
+
+	struct h264_encoder *encoder = xmalloc(sizeof(struct h264_encoder));
+	encoder->svc = svc;
+	encoder->width = width;
+	encoder->height = height;
+	encoder->yuv = xmalloc(width * height * 3 / 2);
+	return encoder;
+}
+
+
+void h264_encoder_destroy(struct h264_encoder *encoder)
+{
+	(*encoder->svc)->Uninitialize(encoder->svc);
+	WelsDestroySVCEncoder(encoder->svc);
+	free(encoder->yuv);
+	free(encoder->out);
+	free(encoder);
+}
+
+
+uint32_t h264_encoder_width(struct h264_encoder *encoder)
+{
+	return encoder->width;
+}
+
+
+uint32_t h264_encoder_height(struct h264_encoder *encoder)
+{
+	return encoder->height;
+}
+
+
+void h264_encoder_set_rate(struct h264_encoder *encoder, float fps)
+{
+	(*encoder->svc)->SetOption(encoder->svc, ENCODER_OPTION_FRAME_RATE, &fps);
+}
+
+
+void h264_encoder_force_key(struct h264_encoder *encoder)
+{
+	(*encoder->svc)->ForceIntraFrame(encoder->svc, true);
+}
+
+
+static void rgba_to_i420(uint8_t *yuv, const rgba_t *fb, uint32_t width, uint32_t height)
+{
+	// BT.601 limited range, which is what decoders assume without any
+	// VUI telling them otherwise. Kept as plain loops so that they vectorize.
+	uint8_t *y_plane = yuv;
+	uint8_t *u_plane = yuv + width * height;
+	uint8_t *v_plane = u_plane + width * height / 4;
+	for (uint32_t i = 0; i < width * height; i++) {
+		y_plane[i] = ((66 * fb[i].r + 129 * fb[i].g + 25 * fb[i].b + 128) >> 8) + 16;
+	}
+	// Chroma of the 2x2 averages
+	for (uint32_t y = 0; y < height / 2; y++) {
+		const rgba_t *row0 = fb + 2 * y * width;
+		const rgba_t *row1 = row0 + width;
+		uint8_t *u = u_plane + y * width / 2;
+		uint8_t *v = v_plane + y * width / 2;
+		for (uint32_t x = 0; x < width / 2; x++) {
+			int r = row0[2 * x].r + row0[2 * x + 1].r + row1[2 * x].r + row1[2 * x + 1].r;
+			int g = row0[2 * x].g + row0[2 * x + 1].g + row1[2 * x].g + row1[2 * x + 1].g;
+			int b = row0[2 * x].b + row0[2 * x + 1].b + row1[2 * x].b + row1[2 * x + 1].b;
+			u[x] = ((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128;
+			v[x] = ((112 * r - 94 * g - 18 * b + 512) >> 10) + 128;
+		}
+	}
+}
+
+
+bool h264_encode(struct h264_encoder *encoder, const rgba_t *fb, uint64_t timestamp,
+				 const uint8_t **data, size_t *size, bool *key)
+{
+	uint32_t width = encoder->width;
+	uint32_t height = encoder->height;
+	rgba_to_i420(encoder->yuv, fb, width, height);
+
+	SSourcePicture picture;
+	memset(&picture, 0, sizeof(picture));
+	picture.iColorFormat = videoFormatI420;
+	picture.iPicWidth = width;
+	picture.iPicHeight = height;
+	picture.iStride[0] = width;
+	picture.iStride[1] = width / 2;
+	picture.iStride[2] = width / 2;
+	picture.pData[0] = encoder->yuv;
+	picture.pData[1] = encoder->yuv + width * height;
+	picture.pData[2] = picture.pData[1] + width * height / 4;
+	picture.uiTimeStamp = timestamp / 1000;
+
+	SFrameBSInfo info;
+	memset(&info, 0, sizeof(info));
+	if ((*encoder->svc)->EncodeFrame(encoder->svc, &picture, &info) != cmResultSuccess) {
+		return false;
+	}
+	*data = encoder->out;
+	*size = 0;
+	*key = info.eFrameType == videoFrameTypeIDR;
+	if (info.eFrameType == videoFrameTypeSkip) {
+		return true;
+	}
+
+	size_t total = 0;
+	for (int i = 0; i < info.iLayerNum; i++) {
+		SLayerBSInfo *layer = &info.sLayerInfo[i];
+		for (int nal = 0; nal < layer->iNalCount; nal++) {
+			total += layer->pNalLengthInByte[nal];
+		}
+	}
+	if (total > encoder->out_capacity) {
+		free(encoder->out);
+		encoder->out = xmalloc(total);
+		encoder->out_capacity = total;
+		*data = encoder->out;
+	}
+	// The NAL units of a layer are contiguous, Annex B start codes included
+	for (int i = 0; i < info.iLayerNum; i++) {
+		SLayerBSInfo *layer = &info.sLayerInfo[i];
+		size_t layer_size = 0;
+		for (int nal = 0; nal < layer->iNalCount; nal++) {
+			layer_size += layer->pNalLengthInByte[nal];
+		}
+		memcpy(encoder->out + *size, layer->pBsBuf, layer_size);
+		*size += layer_size;
+	}
+	return true;
+}
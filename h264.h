@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wvnc.h"
+
+
+// Open H.264 RFB encoding. Every rectangle is a length, flags and that many
+// bytes of Annex B H.264, and the decoder context is tied to the rectangle,
+// so we always send the whole framebuffer. That is the same for all the
+// clients, so one encoder serves all of them.
+
+#define H264_ENCODING 50
+#define H264_FLAG_RESET_CONTEXT (1 << 0)
+
+struct h264_encoder;
+
+// Picks up the clients that advertise the encoding
+void h264_register();
+
+// Bitrate is in bits per second, the keyframe interval in frames. The
+// dimensions have to be even.
+struct h264_encoder *h264_encoder_create(uint32_t width, uint32_t height,
+										 uint32_t bitrate, uint32_t keyint,
+										 float fps);
+void h264_encoder_destroy(struct h264_encoder *encoder);
+
+uint32_t h264_encoder_width(struct h264_encoder *encoder);
+uint32_t h264_encoder_height(struct h264_encoder *encoder);
+
+// The frame rate only steers the rate control, frames may come at any time
+void h264_encoder_set_rate(struct h264_encoder *encoder, float fps);
+// Makes the next frame a key frame, for clients joining the stream
+void h264_encoder_force_key(struct h264_encoder *encoder);
+
+// Encodes the framebuffer, which has to match the encoder size. The size
+// is 0 if the encoder dropped the frame. The output stays valid until the
+// next frame.
+bool h264_encode(struct h264_encoder *encoder, const rgba_t *fb, uint64_t timestamp,
+				 const uint8_t **data, size_t *size, bool *key);
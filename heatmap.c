@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "heatmap.h"
+
+
+void heatmap_init(struct heatmap *heatmap, uint32_t width, uint32_t height,
+				  uint32_t tile_size, bool tint)
+{
+	memset(heatmap, 0, sizeof(*heatmap));
+	heatmap->width = width;
+	heatmap->height = height;
+	heatmap->tile_size = tile_size;
+	heatmap->tile_count_x = (width + tile_size - 1) / tile_size;
+	heatmap->tile_count_y = (height + tile_size - 1) / tile_size;
+	unsigned int tile_count = heatmap->tile_count_x * heatmap->tile_count_y;
+	heatmap->dirty_frames = xmalloc(tile_count * sizeof(uint32_t));
+	heatmap->bytes = xmalloc(tile_count * sizeof(uint64_t));
+	heatmap->tint = tint;
+	if (tint) {
+		heatmap->tinted = xmalloc(tile_count * sizeof(bool));
+		heatmap->restored = xmalloc(tile_count * sizeof(bool));
+		heatmap->saved = xmalloc(width * height * sizeof(rgba_t));
+	}
+}
+
+
+void heatmap_destroy(struct heatmap *heatmap)
+{
+	free(heatmap->dirty_frames);
+	free(heatmap->bytes);
+	free(heatmap->tinted);
+	free(heatmap->restored);
+	free(heatmap->saved);
+	memset(heatmap, 0, sizeof(*heatmap));
+}
+
+
+void heatmap_frame(struct heatmap *heatmap, const uint64_t *tile_generation,
+				   uint64_t generation)
+{
+	unsigned int tile_count = heatmap->tile_count_x * heatmap->tile_count_y;
+	for (unsigned int tile = 0; tile < tile_count; tile++) {
+		heatmap->dirty_frames[tile] += tile_generation[tile] == generation;
+	}
+	heatmap->frames++;
+}
+
+
+void heatmap_add_bytes(struct heatmap *heatmap, unsigned int tile, uint32_t bytes)
+{
+	heatmap->bytes[tile] += bytes;
+}
+
+
+static void tile_rect(struct heatmap *heatmap, unsigned int tile,
+					  uint32_t *x, uint32_t *y, uint32_t *w, uint32_t *h)
+{
+	*x = tile % heatmap->tile_count_x * heatmap->tile_size;
+	*y = tile / heatmap->tile_count_x * heatmap->tile_size;
+	*w = min(heatmap->tile_size, heatmap->width - *x);
+	*h = min(heatmap->tile_size, heatmap->height - *y);
+}
+
+
+void heatmap_tint(struct heatmap *heatmap, rgba_t *fb, const uint64_t *tile_generation,
+				  uint64_t generation)
+{
+	unsigned int tile_count = heatmap->tile_count_x * heatmap->tile_count_y;
+	for (unsigned int tile = 0; tile < tile_count; tile++) {
+		// Put back by heatmap_untint() if it does not get tinted again
+		heatmap->restored[tile] = heatmap->tinted[tile] && tile_generation[tile] != generation;
+		if (tile_generation[tile] != generation) {
+			heatmap->tinted[tile] = false;
+			continue;
+		}
+		uint32_t x, y, w, h;
+		tile_rect(heatmap, tile, &x, &y, &w, &h);
+		for (uint32_t row = y; row < y + h; row++) {
+			rgba_t *px = fb + row * heatmap->width + x;
+			memcpy(heatmap->saved + row * heatmap->width + x, px, w * sizeof(rgba_t));
+			for (uint32_t i = 0; i < w; i++) {
+				px[i].r = px[i].r / 2 + 128;
+				px[i].g /= 2;
+				px[i].b /= 2;
+			}
+		}
+		heatmap->tinted[tile] = true;
+	}
+}
+
+
+void heatmap_untint(struct heatmap *heatmap, rgba_t *fb)
+{
+	unsigned int tile_count = heatmap->tile_count_x * heatmap->tile_count_y;
+	for (unsigned int tile = 0; tile < tile_count; tile++) {
+		if (!heatmap->tinted[tile]) {
+			continue;
+		}
+		uint32_t x, y, w, h;
+		tile_rect(heatmap, tile, &x, &y, &w, &h);
+		for (uint32_t row = y; row < y + h; row++) {
+			size_t offset = row * heatmap->width + x;
+			memcpy(fb + offset, heatmap->saved + offset, w * sizeof(rgba_t));
+		}
+	}
+}
+
+
+static void dump_csv(struct heatmap *heatmap, FILE *file)
+{
+	fprintf(file, "tile_x,tile_y,x,y,width,height,dirty_frames,dirty_fraction,bytes\n");
+	unsigned int tile_count = heatmap->tile_count_x * heatmap->tile_count_y;
+	for (unsigned int tile = 0; tile < tile_count; tile++) {
+		uint32_t x, y, w, h;
+		tile_rect(heatmap, tile, &x, &y, &w, &h);
+		fprintf(file, "%u,%u,%u,%u,%u,%u,%u,%.4f,%lu\n",
+				tile % heatmap->tile_count_x, tile / heatmap->tile_count_x,
+				x, y, w, h, heatmap->dirty_frames[tile],
+				heatmap->frames > 0 ? (double)heatmap->dirty_frames[tile] / heatmap->frames : 0.0,
+				(unsigned long)heatmap->bytes[tile]);
+	}
+}
+
+
+static void dump_ppm(struct heatmap *heatmap, const rgba_t *fb, FILE *file)
+{
+	// The screen contents dimmed to gray, with tiles that changed in more
+	// frames going from blue to red
+	fprintf(file, "P6\n%u %u\n255\n", heatmap->width, heatmap->height);
+	uint8_t *row = xmalloc(heatmap->width * 3);
+	for (uint32_t y = 0; y < heatmap->height; y++) {
+		for (uint32_t x = 0; x < heatmap->width; x++) {
+			unsigned int tile = y / heatmap->tile_size * heatmap->tile_count_x + x / heatmap->tile_size;
+			const rgba_t *px = heatmap->tint && heatmap->tinted[tile] ?
+				&heatmap->saved[y * heatmap->width + x] : &fb[y * heatmap->width + x];
+			unsigned int gray = (px->r * 77 + px->g * 150 + px->b * 29) >> 9;
+			uint8_t *out = &row[x * 3];
+			out[0] = out[1] = out[2] = gray;
+			if (heatmap->dirty_frames[tile] > 0) {
+				unsigned int heat = heatmap->dirty_frames[tile] * 255 / heatmap->frames;
+				out[0] = gray + heat / 2;
+				out[2] = gray + (255 - heat) / 2;
+			}
+		}
+		fwrite(row, 3, heatmap->width, file);
+	}
+	free(row);
+}
+
+
+void heatmap_dump(struct heatmap *heatmap, const rgba_t *fb, const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		log_error("Failed to open %s for the heatmap", path);
+		return;
+	}
+	size_t length = strlen(path);
+	if (length >= 4 && !strcmp(path + length - 4, ".csv")) {
+		dump_csv(heatmap, file);
+	} else {
+		dump_ppm(heatmap, fb, file);
+	}
+	fclose(file);
+	log_info("Wrote the heatmap of %lu frames to %s", (unsigned long)heatmap->frames, path);
+}
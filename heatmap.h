@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wvnc.h"
+
+
+// Per-tile damage statistics, for finding out what keeps the updates
+// busy. Optionally also tints the tiles that changed in the last frame in
+// the framebuffer the clients see.
+
+struct heatmap {
+	uint32_t width;
+	uint32_t height;
+	uint32_t tile_size;
+	uint32_t tile_count_x;
+	uint32_t tile_count_y;
+	uint64_t frames;
+	uint32_t *dirty_frames;
+	uint64_t *bytes;
+	bool tint;
+	// Tiles tinted in the framebuffer, and their untinted pixels
+	bool *tinted;
+	rgba_t *saved;
+	// Tiles the last heatmap_tint() took the tint off, which the clients
+	// still show tinted
+	bool *restored;
+};
+
+
+void heatmap_init(struct heatmap *heatmap, uint32_t width, uint32_t height,
+				  uint32_t tile_size, bool tint);
+void heatmap_destroy(struct heatmap *heatmap);
+
+// Counts a frame, in which the tiles of the current generation changed
+void heatmap_frame(struct heatmap *heatmap, const uint64_t *tile_generation,
+				   uint64_t generation);
+void heatmap_add_bytes(struct heatmap *heatmap, unsigned int tile, uint32_t bytes);
+
+// Tints the tiles of the current generation. The ones that were tinted
+// before and are not anymore end up in restored. Both have to be sent
+// again as whole tiles, but neither changed in content, so their
+// generations stay.
+void heatmap_tint(struct heatmap *heatmap, rgba_t *fb, const uint64_t *tile_generation,
+				  uint64_t generation);
+// Puts the untinted pixels back, before the next frame is converted
+void heatmap_untint(struct heatmap *heatmap, rgba_t *fb);
+
+// Writes a CSV if the path ends in .csv, a PPM of the framebuffer with
+// the heatmap on top otherwise
+void heatmap_dump(struct heatmap *heatmap, const rgba_t *fb, const char *path);
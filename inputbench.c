@@ -0,0 +1,229 @@
+#include <string.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "utils.h"
+
+#include "inputbench.h"
+
+
+#define INPUT_BENCH_WORDS 2000
+#define INPUT_BENCH_PASTE_CHARS 20000
+#define INPUT_BENCH_DRAGS 8
+#define INPUT_BENCH_DRAG_MOVES 2000
+#define INPUT_BENCH_SCROLL_CLICKS 5000
+
+
+const char *input_bench_scenarios[] = { "typing", "paste", "drag", "scroll", NULL };
+
+
+static const char *words[] = {
+	"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "and",
+	"wayland", "compositor", "framebuffer", "of", "to", "in", "it", "is",
+	"a", "configuration", "keyboard", "pointer", "session", "with",
+};
+
+// Including what takes Shift on a US layout
+static const char paste_text[] =
+	"int main(int argc, char *argv[]) { return argc > 1 ? atoi(argv[1]) : 0; }\n"
+	"ssh user@example.com 'ls -la ~/.config | grep \"wvnc\" && echo $HOME' # 100%\n"
+	"The Quick Brown Fox Jumps Over The Lazy Dog: {a: [1, 2], b: <3>}, c^2 + d_e = f?\n";
+
+
+static uint32_t next_random(uint32_t *state)
+{
+	// xorshift32, only needs to be repeatable
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+
+static void add_event(struct input_bench *bench, struct input_bench_event event)
+{
+	if (bench->count == bench->capacity) {
+		size_t capacity = max(bench->capacity * 2, (size_t)1024);
+		struct input_bench_event *events = xmalloc(capacity * sizeof(*events));
+		memcpy(events, bench->events, bench->count * sizeof(*events));
+		free(bench->events);
+		bench->events = events;
+		bench->capacity = capacity;
+	}
+	bench->events[bench->count++] = event;
+}
+
+
+static void add_key(struct input_bench *bench, uint32_t keysym, bool down)
+{
+	add_event(bench, (struct input_bench_event) {
+		.type = INPUT_BENCH_KEY,
+		.down = down,
+		.keysym = keysym,
+	});
+}
+
+
+static void add_keystroke(struct input_bench *bench, uint32_t keysym)
+{
+	add_key(bench, keysym, true);
+	add_key(bench, keysym, false);
+}
+
+
+static void add_char(struct input_bench *bench, char c)
+{
+	if (c == '\n') {
+		add_keystroke(bench, XKB_KEY_Return);
+		return;
+	}
+	// Clients press Shift themselves, the keysyms of ASCII are the
+	// characters
+	bool shift = (c >= 'A' && c <= 'Z') || strchr("~!@#$%^&*()_+{}|:\"<>?", c) != NULL;
+	if (shift) {
+		add_key(bench, XKB_KEY_Shift_L, true);
+	}
+	add_keystroke(bench, (unsigned char)c);
+	if (shift) {
+		add_key(bench, XKB_KEY_Shift_L, false);
+	}
+}
+
+
+static void add_pointer(struct input_bench *bench, int mask, int x, int y)
+{
+	add_event(bench, (struct input_bench_event) {
+		.type = INPUT_BENCH_POINTER,
+		.mask = mask,
+		.x = x,
+		.y = y,
+	});
+}
+
+
+static void generate_typing(struct input_bench *bench)
+{
+	// Sentences with the odd typo corrected right away
+	uint32_t random = 1;
+	bool capital = true;
+	for (int i = 0; i < INPUT_BENCH_WORDS; i++) {
+		const char *word = words[next_random(&random) % ARRAY_SIZE(words)];
+		for (const char *c = word; *c != '\0'; c++) {
+			add_char(bench, capital && c == word ? *c - 'a' + 'A' : *c);
+			if (next_random(&random) % 25 == 0) {
+				add_char(bench, 'x');
+				add_keystroke(bench, XKB_KEY_BackSpace);
+			}
+		}
+		capital = next_random(&random) % 10 == 0;
+		if (capital) {
+			add_char(bench, '.');
+		}
+		add_char(bench, capital && next_random(&random) % 4 == 0 ? '\n' : ' ');
+	}
+}
+
+
+static void generate_paste(struct input_bench *bench)
+{
+	for (int i = 0; i < INPUT_BENCH_PASTE_CHARS; i++) {
+		add_char(bench, paste_text[i % (sizeof(paste_text) - 1)]);
+	}
+}
+
+
+static void generate_drag(struct input_bench *bench, uint32_t width, uint32_t height)
+{
+	// Back and forth across the screen with the left button held, at
+	// a few pixels per event like a fast mouse
+	uint32_t random = 1;
+	for (int i = 0; i < INPUT_BENCH_DRAGS; i++) {
+		int x = next_random(&random) % width;
+		int y = next_random(&random) % height;
+		add_pointer(bench, 0, x, y);
+		add_pointer(bench, BIT(0), x, y);
+		for (int j = 0; j < INPUT_BENCH_DRAG_MOVES; j++) {
+			x = clamp(x + (int)(next_random(&random) % 9) - 4, 0, (int)width - 1);
+			y = clamp(y + (int)(next_random(&random) % 9) - 4, 0, (int)height - 1);
+			add_pointer(bench, BIT(0), x, y);
+		}
+		add_pointer(bench, 0, x, y);
+	}
+}
+
+
+static void generate_scroll(struct input_bench *bench, uint32_t width, uint32_t height)
+{
+	// Wheel clicks are a press and a release of buttons 4 and 5
+	for (int i = 0; i < INPUT_BENCH_SCROLL_CLICKS; i++) {
+		int button = (i / 50) % 2 ? BIT(3) : BIT(4);
+		add_pointer(bench, button, width / 2, height / 2);
+		add_pointer(bench, 0, width / 2, height / 2);
+	}
+}
+
+
+bool input_bench_init(struct input_bench *bench, const char *name, unsigned int rate,
+					  uint32_t width, uint32_t height)
+{
+	memset(bench, 0, sizeof(*bench));
+	bench->name = name;
+	bench->rate = rate;
+	if (!strcmp(name, "typing")) {
+		generate_typing(bench);
+	} else if (!strcmp(name, "paste")) {
+		generate_paste(bench);
+	} else if (!strcmp(name, "drag")) {
+		generate_drag(bench, width, height);
+	} else if (!strcmp(name, "scroll")) {
+		generate_scroll(bench, width, height);
+	} else {
+		return false;
+	}
+	bench->latency = xmalloc(bench->count * sizeof(uint64_t));
+	return true;
+}
+
+
+void input_bench_destroy(struct input_bench *bench)
+{
+	free(bench->events);
+	free(bench->latency);
+	memset(bench, 0, sizeof(*bench));
+}
+
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+static double percentile(const uint64_t *sorted, size_t count, double fraction)
+{
+	// Nearest rank, in us
+	size_t rank = (size_t)(fraction * count);
+	return sorted[min(rank, count - 1)] / 1e3;
+}
+
+
+void input_bench_report(struct input_bench *bench, uint64_t elapsed)
+{
+	size_t count = bench->count;
+	uint64_t busy = 0;
+	for (size_t i = 0; i < count; i++) {
+		busy += bench->latency[i];
+	}
+	qsort(bench->latency, count, sizeof(uint64_t), compare_latency);
+	log_info("%s: %lu events in %.1f ms, %.0f events/s, %.0f events/s back to back",
+			 bench->name, (unsigned long)count, elapsed / 1e6,
+			 count * 1e9 / max(elapsed, (uint64_t)1), count * 1e9 / max(busy, (uint64_t)1));
+	log_info("%s: latency p50 %.2f us, p90 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us",
+			 bench->name,
+			 percentile(bench->latency, count, 0.5), percentile(bench->latency, count, 0.9),
+			 percentile(bench->latency, count, 0.99), percentile(bench->latency, count, 0.999),
+			 bench->latency[count - 1] / 1e3);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Synthetic input for benchmarking the injection path, see --bench-input.
+// A scenario is a stream of RFB key and pointer events the way a client
+// would send them, which gets fed to the hooks back to back or at a fixed
+// rate, timing each event.
+
+enum input_bench_type {
+	INPUT_BENCH_KEY,
+	INPUT_BENCH_POINTER,
+};
+
+struct input_bench_event {
+	enum input_bench_type type;
+	bool down;
+	uint32_t keysym;
+	int mask;
+	int x;
+	int y;
+};
+
+struct input_bench {
+	const char *name;
+	unsigned int rate;  // events/s, 0 for back to back
+	struct input_bench_event *events;
+	size_t count;
+	size_t capacity;
+	uint64_t *latency;  // ns, of each event
+};
+
+
+// Scenarios input_bench_init() knows, besides "all"
+extern const char *input_bench_scenarios[];
+
+// Generates the events of a scenario on a screen of the given size, false
+// if there is no such scenario
+bool input_bench_init(struct input_bench *bench, const char *name, unsigned int rate,
+					  uint32_t width, uint32_t height);
+void input_bench_destroy(struct input_bench *bench);
+
+// Logs the latency percentiles and event rates, elapsed is the wall time
+// of the whole run in ns
+void input_bench_report(struct input_bench *bench, uint64_t elapsed);
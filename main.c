@@ -4,11 +4,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <threads.h>
 #include <unistd.h>
@@ -21,21 +26,84 @@
 #include "wayland-wlr-screencopy-client-protocol.h"
 #include "wayland-xdg-output-client-protocol.h"
 
+// The input thread shares clients with the main thread, which relies on
+// the locking libvncserver only does when built with pthreads
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error "libvncserver has to be built with pthread support"
+#endif
+
 #include "wvnc.h"
 #include "buffer.h"
+#include "classify.h"
+#include "client.h"
+#include "continuous.h"
+#include "control.h"
+#include "dedup.h"
+#include "encode.h"
+#include "export.h"
+#include "h264.h"
+#include "heatmap.h"
+#include "inputbench.h"
+#include "probe.h"
+#include "recorder.h"
+#include "ring.h"
+#include "scheduler.h"
+#include "thumbnail.h"
+#include "tilecache.h"
+#include "trace.h"
 #include "uinput.h"
 #include "utils.h"
 
 
+enum wvnc_cursor_mode {
+	WVNC_CURSOR_NONE,
+	WVNC_CURSOR_OVERLAY,
+	WVNC_CURSOR_RFB,
+};
+
+
 struct wvnc_args {
 	const char *output;
 	in_addr_t address;
 	int port;
+	const char *unix_path;
+	unsigned int unix_mode;
+	unsigned int damage_granularity;
+	const char *record;
+	const char *replay;
+	bool replay_fast;
+	const char *replay_input;
 	int period;
+	int depth;
+	const char *trace;
+	bool region;
+	struct wvnc_capture capture_region;
 	bool no_uinput;
+	enum wvnc_cursor_mode cursor;
+	const char *heatmap;
+	bool heatmap_tint;
+	unsigned int h264_bitrate;  // kbit/s, 0 if disabled
+	unsigned int h264_keyint;
+	unsigned int viewer_fps;  // 0 for the capture rate
+	unsigned int max_rate;    // kbit/s over all clients, 0 for no limit
+	const char *export;
+	bool no_copyrect;
+	double diff_budget;  // ms per frame, 0 to always diff in full
+	const char *thumbnail;
+	unsigned int thumbnail_width;
+	unsigned int thumbnail_interval;  // ms
+	const char *bench_input;   // scenario, or "all"
+	unsigned int bench_rate;   // events/s, 0 for back to back
+	int max_quality;  // JPEG quality level the clients get at most
+	const char *control;
 };
 
 
+// Enough for the diff reference, the frame being processed, a newer one
+// waiting to be processed and up to two frames in flight
+#define WVNC_BUFFER_COUNT 5
+
+
 struct wvnc_xkb {
 	struct xkb_context *ctx;
 	struct xkb_keymap *map;
@@ -43,15 +111,74 @@ struct wvnc_xkb {
 };
 
 
+// Size of the tiles used for damage tracking and content classification
+#define TILE_PIXELS 32u
+
+// Frames changing at least this fraction of the tiles count as video
+#define H264_VIDEO_FRACTION 4
+// How long after the last such frame we keep sending H.264, before the
+// clients get repainted losslessly
+#define H264_SETTLE_TIME 500000
+// How often a client that is out of step with the H.264 stream may force
+// a key frame on everybody to get back in, otherwise it waits for one
+#define H264_REJOIN_INTERVAL 1000000
+
+// Connections accepted between two frames, more get turned away
+#define INPUT_MAX_PENDING 16
+
+
 struct wvnc {
 	struct {
 		rfbScreenInfo *screen_info;
 		rgba_t *fb;
+		// Content class of each framebuffer tile, with TILE_CLASS_STALE set
+		// if it needs to be recomputed
+		uint8_t *tile_class;
+		// Frame generation in which each tile last changed
+		uint64_t *tile_generation;
+		// Scratch space for the diff, whose grid is in buffer coordinates
+		// and shifted, so it can have one more row and column of tiles
+		uint64_t *damage_bits;
+		struct damage_box *damage_boxes;
+		unsigned int tile_count_x;
+		unsigned int tile_count_y;
+		uint64_t generation;
+		// Until when the content counts as video-heavy
+		uint64_t video_until;
+		// Output transform the framebuffer contents were converted with
+		enum wl_output_transform transform;
+		struct tile_cache tile_cache;
+		// Scratch space for sending updates ourselves
+		uint8_t *pixels;
+		uint8_t *encoded;
+		uint8_t *out;
+		size_t out_size;
+		// Listening unix socket, -1 if we only listen on TCP
+		int unix_fd;
 	} rfb;
+	struct {
+		// Shared by the clients that get H.264, so that each frame is
+		// encoded only once
+		struct h264_encoder *encoder;
+		// Number of the last frame encoded, counting on across encoders,
+		// and the framebuffer generation it shows
+		uint64_t frame;
+		uint64_t generation;
+		bool key;
+		// When a key frame was last forced for a client to join
+		uint64_t forced_at;
+		// NULL until the encoder made a frame
+		const uint8_t *data;
+		size_t size;
+	} h264;
 	struct {
 		struct wl_display *display;
 		struct wl_registry *registry;
 		struct wl_shm *shm;
+		// Cheapest format to convert out of those wl_shm advertises
+		enum wl_shm_format preferred_format;
+		unsigned int preferred_format_cost;
+		bool format_reported;
 		struct zxdg_output_manager_v1 *output_manager;
 		struct zwlr_screencopy_manager_v1 *screencopy_manager;
 		struct zwp_virtual_keyboard_manager_v1 *keyboard_manager;
@@ -61,11 +188,68 @@ struct wvnc {
 	struct wvnc_xkb xkb;
 	struct wvnc_args args;
 	struct wvnc_uinput uinput;
-	struct wvnc_buffer buffers[2];
-	unsigned int buffer_i;
+	struct wvnc_buffer buffers[WVNC_BUFFER_COUNT];
+	struct recorder recorder;
+	struct replay replay;
+	struct heatmap heatmap;
+	struct dedup dedup;
+	struct sched sched;
+	struct export export;
+	struct diff_probe probe;
+	struct thumbnail thumbnail;
+	uint64_t thumbnail_due;
+	struct control control;
+	struct {
+		thrd_t thread;
+		atomic_bool stop;
+		// Holds the virtual keyboard, so that the input thread never
+		// touches the main queue
+		struct wl_event_queue *queue;
+		// Wakes up the main loop when a client sent something, e.g. a new
+		// update request
+		int wakeup_fd;
+		// Protects the capture geometry, framebuffer size and logical size
+		// that the pointer mapping and the capture thread read
+		mtx_t lock;
+		// Held by the input thread while it works on the clients. The
+		// main thread takes it to add and free clients in between, so
+		// that the client list only ever changes on one thread, and to
+		// resize the framebuffer. Taken before lock.
+		mtx_t clients_lock;
+		// Connections accepted by the input thread, for the main thread
+		// to add
+		int pending_fds[INPUT_MAX_PENDING];
+		unsigned int pending_count;
+		// Wakes up the input thread once they are added, so that it waits
+		// on their sockets too
+		int added_fd;
+	} input;
+	struct {
+		thrd_t thread;
+		atomic_bool stop;
+		// Holds the screencopy frames, so that a stalled compositor only
+		// ever blocks the capture thread
+		struct wl_event_queue *queue;
+		struct zwlr_screencopy_manager_v1 *manager;
+		// Finished frames, in capture order
+		struct frame_ring ring;
+		// Wakes up the main loop when a frame was published
+		int ready_fd;
+		// Wakes up the capture thread when a buffer was handed back
+		int release_fd;
+		uint64_t seq;
+		// Last generation the main thread took, and how many it skipped
+		uint64_t generation;
+		uint64_t dropped;
+		// What the thread goes by of args, which the control socket may
+		// change while it runs
+		_Atomic uint64_t period;  // us
+		atomic_uint depth;
+	} capturer;
 
 	struct wl_list outputs;
 	struct wvnc_output *selected_output;
+	struct wvnc_capture capture;
 	struct wl_list seats;
 	struct wvnc_seat *selected_seat;
 
@@ -74,6 +258,9 @@ struct wvnc {
 };
 
 
+#define TILE_CLASS_STALE 0x80
+
+
 // This is because we can't pass our global pointer into some of the 
 // rfb callbacks. Use minimally.
 thread_local struct wvnc *global_wvnc;
@@ -113,6 +300,33 @@ static void initialize_shm_buffer(struct wvnc_buffer *buffer,
 }
 
 
+static void destroy_shm_buffer(struct wvnc_buffer *buffer)
+{
+	wl_buffer_destroy(buffer->wl);
+	munmap(buffer->data, buffer->size);
+	buffer->wl = NULL;
+	buffer->data = NULL;
+}
+
+
+static void update_capture(struct wvnc *wvnc);
+static void calculate_logical_size(struct wvnc *wvnc);
+
+
+static void handle_output_changed(struct wvnc_output *output)
+{
+	struct wvnc *wvnc = output->wvnc;
+	mtx_lock(&wvnc->input.lock);
+	calculate_logical_size(wvnc);
+	// The framebuffer itself is resized once frames of the new size
+	// start coming in
+	if (output == wvnc->selected_output) {
+		update_capture(wvnc);
+	}
+	mtx_unlock(&wvnc->input.lock);
+}
+
+
 static void handle_output_geometry(void *data, struct wl_output *wl,
 								   int32_t x, int32_t y,
 								   int32_t p_w, int32_t p_h,
@@ -121,7 +335,11 @@ static void handle_output_geometry(void *data, struct wl_output *wl,
 								   int32_t transform)
 {
 	struct wvnc_output *output = data;
+	bool changed = output->transform != (enum wl_output_transform)transform;
 	output->transform = transform;
+	if (changed) {
+		handle_output_changed(output);
+	}
 }
 
 
@@ -157,8 +375,29 @@ static void handle_frame_buffer(void *data,
 								uint32_t height, uint32_t stride)
 {
 	struct wvnc_buffer *buffer = data;
-	// TODO: What if input size changes or something?
+	struct wvnc *wvnc = buffer->wvnc;
+	if (buffer->wl != NULL &&
+		(buffer->format != format || buffer->width != width ||
+		 buffer->height != height || buffer->stride != stride)) {
+		// The output mode changed under us
+		destroy_shm_buffer(buffer);
+	}
 	if (buffer->wl == NULL) {
+		if (buffer_format_cost(format) == 0) {
+			fail("Unsupported buffer format %d", format);
+		}
+		// Screencopy does not let us pick the format, but we can at least
+		// tell the user when the compositor chose an expensive one
+		if (!wvnc->wl.format_reported) {
+			log_info("Capturing %s buffers", buffer_format_name(format));
+			if (wvnc->wl.preferred_format_cost != 0 &&
+				wvnc->wl.preferred_format_cost < buffer_format_cost(format)) {
+				log_info("Preferring %s, which is cheaper to convert, but the compositor chose %s",
+						 buffer_format_name(wvnc->wl.preferred_format),
+						 buffer_format_name(format));
+			}
+			wvnc->wl.format_reported = true;
+		}
 		initialize_shm_buffer(buffer, format, width, height, stride);
 	}
 	zwlr_screencopy_frame_v1_copy(frame, buffer->wl);
@@ -183,7 +422,14 @@ static void handle_frame_ready(void *data,
 							   uint32_t tv_nsec)
 {
 	struct wvnc_buffer *buffer = data;
-	buffer->done = true;
+	buffer->state = WVNC_BUFFER_READY;
+
+	if (trace_enabled) {
+		uint64_t tv_sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+		uint64_t presented = tv_sec * 1000000 + tv_nsec / 1000;
+		trace_instant_at("presented", presented, buffer->seq);
+		trace_instant("frame_ready", trace_now() - presented);
+	}
 }
 
 static void handle_frame_failed(void *data,
@@ -225,6 +471,8 @@ static void handle_xdg_output_logical_size(void *data,
 
 static void handle_xdg_output_done(void *data, struct zxdg_output_v1 *xdg)
 {
+	struct wvnc_output *output = data;
+	handle_output_changed(output);
 }
 
 
@@ -274,6 +522,23 @@ static const struct wl_seat_listener wl_seat_listener = {
 };
 
 
+static void handle_shm_format(void *data, struct wl_shm *shm, uint32_t format)
+{
+	struct wvnc *wvnc = data;
+	unsigned int cost = buffer_format_cost(format);
+	if (cost != 0 &&
+		(wvnc->wl.preferred_format_cost == 0 || cost < wvnc->wl.preferred_format_cost)) {
+		wvnc->wl.preferred_format = format;
+		wvnc->wl.preferred_format_cost = cost;
+	}
+}
+
+
+static const struct wl_shm_listener shm_listener = {
+	.format = handle_shm_format,
+};
+
+
 static void handle_wl_registry_global(void *data, struct wl_registry *registry,
 									  uint32_t name, const char *interface,
 									  uint32_t version)
@@ -283,6 +548,7 @@ static void handle_wl_registry_global(void *data, struct wl_registry *registry,
 	struct wvnc *wvnc = data;
 	if (IS_PROTOCOL(wl_output)) {
 		struct wvnc_output *out = xmalloc(sizeof(struct wvnc_output));
+		out->wvnc = wvnc;
 		out->wl = BIND(wl_output, 1);
 		wl_output_add_listener(out->wl, &output_listener, out);
 		wl_list_insert(&wvnc->outputs, &out->link);
@@ -292,6 +558,7 @@ static void handle_wl_registry_global(void *data, struct wl_registry *registry,
 		wvnc->wl.screencopy_manager = BIND(zwlr_screencopy_manager_v1, 1);
 	} else if (IS_PROTOCOL(wl_shm)) {
 		wvnc->wl.shm = BIND(wl_shm, 1);
+		wl_shm_add_listener(wvnc->wl.shm, &shm_listener, wvnc);
 	} else if (IS_PROTOCOL(wl_seat)) {
 		// This is the seat we bind our virtual keyboard to
 		// sway currently does not support binding somewhere else than seat0,
@@ -322,26 +589,100 @@ static const struct wl_registry_listener registry_listener = {
 };
 
 
+static void rfb_client_gone_hook(rfbClientPtr cl)
+{
+	client_destroy(cl->clientData);
+}
+
+
 static enum rfbNewClientAction rfb_new_client_hook(rfbClientPtr cl)
 {
-	cl->clientData = global_wvnc;
+	struct wvnc_client *client = xmalloc(sizeof(struct wvnc_client));
+	client_init(client, global_wvnc);
+	cl->clientData = client;
+	cl->clientGoneHook = rfb_client_gone_hook;
 	return RFB_CLIENT_ACCEPT;
 }
 
 
+static void rfb_display_hook(rfbClientPtr cl)
+{
+	// libvncserver only lets us pick one encoding per client and update,
+	// but Tight decides between palette and JPEG per subrectangle. So
+	// we allow JPEG only when the pending update is mostly photographic
+	// and keep text lossless otherwise.
+	struct wvnc_client *client = cl->clientData;
+	struct wvnc *wvnc = client->wvnc;
+	if (cl->preferredEncoding != rfbEncodingTight) {
+		return;
+	}
+	if (cl->tightQualityLevel != client->applied_quality) {
+		// New SetEncodings from the client
+		client->requested_quality = cl->tightQualityLevel;
+	}
+	if (cl->tightCompressLevel != client->applied_compress) {
+		client->requested_compress = cl->tightCompressLevel;
+	}
+	client->applied_compress = client_compress(client);
+	cl->tightCompressLevel = client->applied_compress;
+
+	uint64_t area[RECT_CLASS_COUNT] = { 0 };
+	pthread_mutex_lock(&cl->updateMutex);
+	sraRectangleIterator *iter = sraRgnGetIterator(cl->modifiedRegion);
+	sraRect rect;
+	while (sraRgnIteratorNext(iter, &rect)) {
+		uint32_t x1 = rect.x1, y1 = rect.y1, x2 = rect.x2, y2 = rect.y2;
+		for (uint32_t tile_y = y1 / TILE_PIXELS; tile_y * TILE_PIXELS < y2; tile_y++) {
+			for (uint32_t tile_x = x1 / TILE_PIXELS; tile_x * TILE_PIXELS < x2; tile_x++) {
+				uint32_t w = min(x2, (tile_x + 1) * TILE_PIXELS) - max(x1, tile_x * TILE_PIXELS);
+				uint32_t h = min(y2, (tile_y + 1) * TILE_PIXELS) - max(y1, tile_y * TILE_PIXELS);
+				uint8_t class = wvnc->rfb.tile_class[tile_y * wvnc->rfb.tile_count_x + tile_x];
+				area[class & ~TILE_CLASS_STALE] += w * h;
+			}
+		}
+	}
+	sraRgnReleaseIterator(iter);
+	pthread_mutex_unlock(&cl->updateMutex);
+
+	bool photo = area[RECT_CLASS_PHOTO] > area[RECT_CLASS_PALETTE] + area[RECT_CLASS_SOLID];
+	client->applied_quality = photo ? min(client_quality(client), wvnc->args.max_quality) : -1;
+	cl->tightQualityLevel = client->applied_quality;
+}
+
+
+static void rfb_display_finished_hook(rfbClientPtr cl, int result)
+{
+	client_update_sent(cl, time_monotonic());
+}
+
+
 static void rfb_ptr_hook(int mask, int screen_x, int screen_y, rfbClientPtr cl)
 {
-	struct wvnc *wvnc = cl->clientData;
+	struct wvnc_client *client = cl->clientData;
+	struct wvnc *wvnc = client->wvnc;
+	trace_instant("ptr_hook", mask);
+	sched_input(cl, time_monotonic());
+	if (wvnc->args.cursor == WVNC_CURSOR_RFB) {
+		// Updates the screen cursor position, which libvncserver then
+		// propagates to the other clients as PointerPos pseudo-encoding
+		rfbDefaultPtrAddEvent(mask, screen_x, screen_y, cl);
+	}
 	if (!wvnc->uinput.initialized) {
 		return; // Nothing to do here
 	}
 	// Way too lazy to debug fixpoing scaling
-	float global_x = (float)wvnc->selected_output->x +
-		clamp(screen_x, 0, (int)wvnc->selected_output->width);
-	float global_y = (float)wvnc->selected_output->y +
-		clamp(screen_y, 0, (int)wvnc->selected_output->height);
+	// The framebuffer is in buffer pixels, which differ from the logical
+	// coordinates on scaled outputs
+	mtx_lock(&wvnc->input.lock);
+	float global_x = (float)wvnc->selected_output->x + wvnc->capture.x +
+		(float)clamp(screen_x, 0, (int)wvnc->capture.fb_width) *
+		wvnc->capture.width / wvnc->capture.fb_width;
+	float global_y = (float)wvnc->selected_output->y + wvnc->capture.y +
+		(float)clamp(screen_y, 0, (int)wvnc->capture.fb_height) *
+		wvnc->capture.height / wvnc->capture.fb_height;
 	int32_t touch_x = round(global_x / wvnc->logical_width * UINPUT_ABS_MAX);
 	int32_t touch_y = round(global_y / wvnc->logical_height * UINPUT_ABS_MAX);
+	mtx_unlock(&wvnc->input.lock);
 
 	uinput_move_abs(&wvnc->uinput, (int32_t)touch_x, (int32_t)touch_y);
 
@@ -391,11 +732,14 @@ end:
 
 static void rfb_key_hook(rfbBool down, rfbKeySym keysym, rfbClientPtr cl)
 {
-	struct wvnc *wvnc = cl->clientData;
+	struct wvnc_client *client = cl->clientData;
+	struct wvnc *wvnc = client->wvnc;
 	struct wvnc_xkb *xkb = &wvnc->xkb;
+	sched_input(cl, time_monotonic());
 	if (wvnc->wl.keyboard == NULL) {
 		return;
 	}
+	trace_begin("key_hook");
 
 	struct key_iter_search search = {
 		.keysym = keysym,
@@ -405,6 +749,7 @@ static void rfb_key_hook(rfbBool down, rfbKeySym keysym, rfbClientPtr cl)
 	xkb_keymap_key_for_each(xkb->map, key_iter, &search);
 	if (search.keycode == XKB_KEYCODE_INVALID) {
 		log_error("Keysym %04x not found in our keymap", keysym);
+		trace_end("key_hook");
 		return;
 	}
 
@@ -413,7 +758,6 @@ static void rfb_key_hook(rfbBool down, rfbKeySym keysym, rfbClientPtr cl)
 		search.keycode - xkb_keymap_min_keycode(xkb->map) + 1,
 		down ? WL_KEYBOARD_KEY_STATE_PRESSED : WL_KEYBOARD_KEY_STATE_RELEASED
 	);
-	wl_display_dispatch_pending(wvnc->wl.display);
 
 	enum xkb_state_component component =
 		xkb_state_update_key(xkb->state, search.keycode,
@@ -439,226 +783,1167 @@ static void rfb_key_hook(rfbBool down, rfbKeySym keysym, rfbClientPtr cl)
 			wvnc->wl.keyboard, depressed, latched, locked, group
 		);
 	}
+	trace_end("key_hook");
+}
+
+
+static void fb_rect_tiles(struct wvnc *wvnc, uint32_t x1, uint32_t y1,
+						  uint32_t x2, uint32_t y2,
+						  uint32_t *x_start, uint32_t *x_end,
+						  uint32_t *y_start, uint32_t *y_end)
+{
+	// The coordinates may come in flipped due to the output transform, or
+	// wrapped around just outside of the framebuffer
+	uint32_t fb_width = wvnc->capture.fb_width;
+	uint32_t fb_height = wvnc->capture.fb_height;
+	x1 = x1 > fb_width ? 0 : x1;
+	x2 = x2 > fb_width ? 0 : x2;
+	y1 = y1 > fb_height ? 0 : y1;
+	y2 = y2 > fb_height ? 0 : y2;
+	*x_start = min(x1, x2) / TILE_PIXELS;
+	*x_end = min((max(x1, x2) + TILE_PIXELS - 1) / TILE_PIXELS, wvnc->rfb.tile_count_x);
+	*y_start = min(y1, y2) / TILE_PIXELS;
+	*y_end = min((max(y1, y2) + TILE_PIXELS - 1) / TILE_PIXELS, wvnc->rfb.tile_count_y);
+}
+
+
+static void mark_fb_rect_stale(struct wvnc *wvnc, uint32_t x1, uint32_t y1,
+							   uint32_t x2, uint32_t y2)
+{
+	uint32_t x_start, x_end, y_start, y_end;
+	fb_rect_tiles(wvnc, x1, y1, x2, y2, &x_start, &x_end, &y_start, &y_end);
+	for (uint32_t tile_y = y_start; tile_y < y_end; tile_y++) {
+		for (uint32_t tile_x = x_start; tile_x < x_end; tile_x++) {
+			unsigned int tile = tile_y * wvnc->rfb.tile_count_x + tile_x;
+			wvnc->rfb.tile_class[tile] |= TILE_CLASS_STALE;
+			wvnc->rfb.tile_generation[tile] = wvnc->rfb.generation;
+		}
+	}
+}
+
+
+static void classify_stale_tiles(struct wvnc *wvnc)
+{
+	trace_begin("classify");
+	uint32_t fb_width = wvnc->capture.fb_width;
+	uint32_t fb_height = wvnc->capture.fb_height;
+	for (uint32_t tile_y = 0; tile_y < wvnc->rfb.tile_count_y; tile_y++) {
+		for (uint32_t tile_x = 0; tile_x < wvnc->rfb.tile_count_x; tile_x++) {
+			uint8_t *class = &wvnc->rfb.tile_class[tile_y * wvnc->rfb.tile_count_x + tile_x];
+			if (!(*class & TILE_CLASS_STALE)) {
+				continue;
+			}
+			uint32_t x = tile_x * TILE_PIXELS;
+			uint32_t y = tile_y * TILE_PIXELS;
+			*class = classify_rect(
+				wvnc->rfb.fb, fb_width, x, y,
+				min(TILE_PIXELS, fb_width - x), min(TILE_PIXELS, fb_height - y)
+			);
+		}
+	}
+	trace_end("classify");
 }
 
 
 static void update_framebuffer_full(struct wvnc *wvnc, struct wvnc_buffer *new)
 {
-	buffer_to_fb(wvnc->rfb.fb, wvnc->selected_output, new,
+	trace_begin("convert_full");
+	buffer_to_fb(wvnc->rfb.fb, &wvnc->capture, new,
 				 0, 0, new->width, new->height);
+	trace_end("convert_full");
+	recorder_key_frame(&wvnc->recorder, new, wvnc->capture.transform);
+	wvnc->rfb.generation++;
 	rfbMarkRectAsModified(
 		wvnc->rfb.screen_info,
-		0, 0, wvnc->selected_output->width, wvnc->selected_output->height
+		0, 0, wvnc->capture.fb_width, wvnc->capture.fb_height
+	);
+	mark_fb_rect_stale(
+		wvnc, 0, 0, wvnc->capture.fb_width, wvnc->capture.fb_height
 	);
+	classify_stale_tiles(wvnc);
+}
+
+
+struct damage_box {
+	uint32_t x1;
+	uint32_t y1;
+	uint32_t x2;
+	uint32_t y2;
+};
+
+
+static void damage_box_add(struct damage_box *box, uint32_t x1, uint32_t x2, uint32_t y)
+{
+	if (box->x2 == 0) {
+		*box = (struct damage_box) { .x1 = x1, .y1 = y, .x2 = x2, .y2 = y + 1 };
+		return;
+	}
+	box->x1 = min(box->x1, x1);
+	box->x2 = max(box->x2, x2);
+	box->y1 = min(box->y1, y);
+	box->y2 = max(box->y2, y + 1);
 }
 
 
-static void update_framebuffer(struct wvnc *wvnc,
+// Returns whether all of new was diffed. Otherwise only the tiles found
+// dirty were, and old stays the diff reference with these copied into it.
+static bool update_framebuffer(struct wvnc *wvnc,
 							   struct wvnc_buffer *old, struct wvnc_buffer *new)
 {
 	assert(new->width == old->width && new->height == old->height &&
-		   new->stride == old->stride);
-	const unsigned int tile_pixels = 32;
+		   new->stride == old->stride && new->format == old->format);
+	const unsigned int tile_pixels = TILE_PIXELS;
 	const unsigned int bitmap_bits = 64;
-	unsigned int tile_count_x = new->width / tile_pixels;
-	if (new->width % bitmap_bits != 0) {
-		tile_count_x++;
-	}
-	unsigned int tile_count_y = new->height / tile_pixels;
-	if (new->height % bitmap_bits != 0) {
-		tile_count_y++;
-	}
-	uint64_t bits[(tile_count_x * tile_count_y) / bitmap_bits + 1];
-	memset(bits, 0, sizeof(bits));
-
+	uint32_t shift_x;
+	uint32_t shift_y;
+	buffer_calculate_tile_shift(&wvnc->capture, new, tile_pixels, &shift_x, &shift_y);
+	unsigned int tile_count_x = (new->width + shift_x + tile_pixels - 1) / tile_pixels;
+	unsigned int tile_count_y = (new->height + shift_y + tile_pixels - 1) / tile_pixels;
+	size_t bitmap_words = (tile_count_x * tile_count_y) / bitmap_bits + 1;
+	uint64_t *bits = wvnc->rfb.damage_bits;
+	memset(bits, 0, bitmap_words * sizeof(uint64_t));
+	// Bounding box of the changes in each tile, in shifted buffer
+	// coordinates, x2 == 0 if the tile is clean
+	struct damage_box *boxes = wvnc->rfb.damage_boxes;
+	memset(boxes, 0, tile_count_x * tile_count_y * sizeof(*boxes));
+
+	struct diff_probe *probe = &wvnc->probe;
+	probe_plan(probe, new->height);
+	uint64_t diff_start = probe->budget != 0 ? time_monotonic_ns() : 0;
+	trace_begin("diff");
+	const uint32_t bpp = buffer_bytes_per_pixel(new->format);
+	uint32_t probed_rows = 0;
 	for (uint32_t y = 0; y < new->height; y++) {
-		for (uint32_t x = 0; x < new->width; x++) {
-			uint32_t offset = y*new->stride + x * 4;  // Assuming 4 bytes per pixel
-			uint32_t src = *(uint32_t *)(new->data + offset);
-			uint32_t tgt = *(uint32_t *)(old->data + offset);
-			if (src != tgt) {
-				unsigned int tile_x = x / tile_pixels;
-				unsigned int tile_y = y / tile_pixels;
-				unsigned int tile_off = tile_y*tile_count_x + tile_x;
-				bits[tile_off / bitmap_bits] |= BIT(tile_off % bitmap_bits);
+		if (!probe_row(probe, (y + shift_y) % tile_pixels)) {
+			continue;
+		}
+		probed_rows++;
+		const uint8_t *row_new = (const uint8_t *)new->data + y * new->stride;
+		const uint8_t *row_old = (const uint8_t *)old->data + y * old->stride;
+		unsigned int tile_y = (y + shift_y) / tile_pixels;
+		for (unsigned int tile_x = 0; tile_x < tile_count_x; tile_x++) {
+			uint32_t x = max(tile_x*tile_pixels, shift_x) - shift_x;
+			uint32_t w = min((tile_x + 1)*tile_pixels - shift_x, new->width) - x;
+			uint32_t first, last;
+			if (!buffer_diff_span(row_new + x * bpp, row_old + x * bpp, w * bpp, bpp,
+								  &first, &last)) {
+				continue;
+			}
+			unsigned int tile_off = tile_y*tile_count_x + tile_x;
+			bits[tile_off / bitmap_bits] |= (uint64_t)1 << (tile_off % bitmap_bits);
+			damage_box_add(&boxes[tile_off], x + first + shift_x, x + last + 1 + shift_x,
+						   y + shift_y);
+		}
+	}
+	trace_end("diff");
+
+	uint32_t confirmed_rows = 0;
+	bool complete = probe->stride == 1;
+	if (!complete) {
+		// The tiles the probe found dirty get the rows it skipped compared,
+		// as long as the budget lasts, and count as changed as a whole
+		// after that
+		trace_begin("diff_confirm");
+		for (unsigned int tile_off = 0; tile_off < tile_count_x * tile_count_y; tile_off++) {
+			if (!(bits[tile_off / bitmap_bits] & ((uint64_t)1 << (tile_off % bitmap_bits)))) {
+				continue;
+			}
+			unsigned int tile_x = tile_off % tile_count_x;
+			unsigned int tile_y = tile_off / tile_count_x;
+			uint32_t x = max(tile_x*tile_pixels, shift_x) - shift_x;
+			uint32_t w = min((tile_x + 1)*tile_pixels - shift_x, new->width) - x;
+			uint32_t y_start = max(tile_y*tile_pixels, shift_y) - shift_y;
+			uint32_t y_end = min((tile_y + 1)*tile_pixels - shift_y, new->height);
+			struct damage_box *box = &boxes[tile_off];
+			if (time_monotonic_ns() - diff_start > probe->budget) {
+				*box = (struct damage_box) {
+					.x1 = x + shift_x,
+					.y1 = y_start + shift_y,
+					.x2 = x + w + shift_x,
+					.y2 = y_end + shift_y,
+				};
+				continue;
 			}
+			for (uint32_t y = y_start; y < y_end; y++) {
+				if (probe_row(probe, (y + shift_y) % tile_pixels)) {
+					continue;
+				}
+				confirmed_rows++;
+				uint32_t first, last;
+				if (buffer_diff_span((const uint8_t *)new->data + y * new->stride + x * bpp,
+									 (const uint8_t *)old->data + y * old->stride + x * bpp,
+									 w * bpp, bpp, &first, &last)) {
+					damage_box_add(box, x + first + shift_x, x + last + 1 + shift_x,
+								   y + shift_y);
+				}
+			}
+		}
+		trace_end("diff_confirm");
+	}
+	if (probe->budget != 0) {
+		unsigned int dirty_tiles = 0;
+		for (size_t i = 0; i < bitmap_words; i++) {
+			dirty_tiles += __builtin_popcountll(bits[i]);
 		}
+		probe_update(probe, time_monotonic_ns() - diff_start,
+					 probed_rows + (double)confirmed_rows / tile_count_x,
+					 (double)dirty_tiles / (tile_count_x * tile_count_y));
+		trace_instant("diff_stride", probe->stride);
 	}
+	recorder_frame(&wvnc->recorder, new, wvnc->capture.transform,
+				   bits, tile_pixels, shift_x, shift_y);
 
+	trace_begin("convert");
+	wvnc->rfb.generation++;
 	for (unsigned int tile_y = 0; tile_y < tile_count_y; tile_y++) {
 		for (unsigned int tile_x = 0; tile_x < tile_count_x; tile_x++) {
 			unsigned int tile_off = tile_y*tile_count_x + tile_x;
-			if (!(bits[tile_off / bitmap_bits] & BIT(tile_off % bitmap_bits))) {
+			if (!(bits[tile_off / bitmap_bits] & ((uint64_t)1 << (tile_off % bitmap_bits)))) {
 				continue;
 			}
-			// We have a modified tile, copy data over to the VNC
-			// framebufer and mark it as modified
-			uint32_t x = tile_x*tile_pixels;
-			uint32_t y = tile_y*tile_pixels;
-			uint32_t w = min(tile_pixels, new->width - x);
-			uint32_t h = min(tile_pixels, new->height - y);
+			// We have a modified tile, copy the changed part over to the
+			// VNC framebufer and mark it as modified. Rounding to the
+			// granularity in shifted coordinates keeps the rectangle aligned
+			// in the framebuffer whatever the transform.
+			const struct damage_box *box = &boxes[tile_off];
+			const uint32_t granularity = wvnc->args.damage_granularity;
+			uint32_t x1 = box->x1 / granularity * granularity;
+			uint32_t y1 = box->y1 / granularity * granularity;
+			uint32_t x2 = (box->x2 + granularity - 1) / granularity * granularity;
+			uint32_t y2 = (box->y2 + granularity - 1) / granularity * granularity;
+			uint32_t x = max(x1, shift_x) - shift_x;
+			uint32_t y = max(y1, shift_y) - shift_y;
+			uint32_t w = min(x2 - shift_x, new->width) - x;
+			uint32_t h = min(y2 - shift_y, new->height) - y;
+			uint32_t fb_x, fb_y, fb_w, fb_h;
+			buffer_calculate_fb_rect(
+				&wvnc->capture, new, x, y, w, h, &fb_x, &fb_y, &fb_w, &fb_h
+			);
+			if (wvnc->dedup.hash != NULL) {
+				// What clients still show there may be copied elsewhere
+				uint32_t x_start, x_end, y_start, y_end;
+				fb_rect_tiles(wvnc, fb_x, fb_y, fb_x + fb_w, fb_y + fb_h,
+							  &x_start, &x_end, &y_start, &y_end);
+				dedup_save(&wvnc->dedup, wvnc->rfb.fb, x_start, x_end, y_start, y_end,
+						   wvnc->rfb.generation);
+			}
 			buffer_to_fb(
-				wvnc->rfb.fb, wvnc->selected_output, new,
+				wvnc->rfb.fb, &wvnc->capture, new,
 				x, y, w, h
 			);
-
-			uint32_t fb_x_start;
-			uint32_t fb_y_start;
-			buffer_calculate_fb_coords(
-				wvnc->selected_output, x, y, &fb_x_start, &fb_y_start
-			);
-			uint32_t fb_x_end;
-			uint32_t fb_y_end;
-			buffer_calculate_fb_coords(
-				wvnc->selected_output, x + w, y + h, &fb_x_end, &fb_y_end
-			);
+			if (!complete) {
+				// The reference must not lose what the probe has not
+				// found yet, so it only gets the changes that were
+				for (uint32_t row = y; row < y + h; row++) {
+					memcpy((uint8_t *)old->data + row * old->stride + x * bpp,
+						   (const uint8_t *)new->data + row * new->stride + x * bpp,
+						   w * bpp);
+				}
+			}
 
 			rfbMarkRectAsModified(
 				wvnc->rfb.screen_info,
-				fb_x_start, fb_y_start, fb_x_end, fb_y_end
+				fb_x, fb_y, fb_x + fb_w, fb_y + fb_h
 			);
+			mark_fb_rect_stale(wvnc, fb_x, fb_y, fb_x + fb_w, fb_y + fb_h);
 		}
 	}
+	trace_end("convert");
+	classify_stale_tiles(wvnc);
+	return complete;
 }
 
 
-static void calculate_logical_size(struct wvnc *wvnc)
+static void accept_clients(struct wvnc *wvnc, int listen_fd)
 {
-	int32_t min_x = INT32_MAX;
-	int32_t max_x = INT32_MIN;
-	int32_t min_y = INT32_MAX;
-	int32_t max_y = INT32_MIN;
-	struct wvnc_output *output;
-	wl_list_for_each(output, &wvnc->outputs, link) {
-		min_x = min(min_x, output->x);
-		max_x = max(max_x, output->x + (int32_t)output->width);
-		min_y = min(min_y, output->y);
-		max_y = max(max_y, output->y + (int32_t)output->height);
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				log_error("Failed to accept a client: %s", strerror(errno));
+			}
+			return;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		mtx_lock(&wvnc->input.clients_lock);
+		bool queued = wvnc->input.pending_count < INPUT_MAX_PENDING;
+		if (queued) {
+			wvnc->input.pending_fds[wvnc->input.pending_count++] = fd;
+		}
+		mtx_unlock(&wvnc->input.clients_lock);
+		if (!queued) {
+			log_error("Too many pending clients");
+			close(fd);
+		}
 	}
-	wvnc->logical_width = max_x - min_x;
-	wvnc->logical_height = max_y - min_y;
 }
 
 
-static void handle_keyboard_keymap(void *data, struct wl_keyboard *wl,
-								   uint32_t format, int32_t fd, uint32_t size)
+static bool flush_update(rfbClientPtr cl)
 {
-	struct wvnc *wvnc = data;
-	if (wvnc->xkb.map != NULL) {
-		return; // We already have a keymap from somewhere
+	struct wvnc *wvnc = ((struct wvnc_client *)cl->clientData)->wvnc;
+	if (wvnc->rfb.out_size > 0 &&
+		rfbWriteExact(cl, (char *)wvnc->rfb.out, wvnc->rfb.out_size) < 0) {
+		client_shutdown(cl);
+		return false;
 	}
+	wvnc->rfb.out_size = 0;
+	return true;
+}
 
-	void *mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (mem == MAP_FAILED) {
-		return;
+
+static bool append_update(rfbClientPtr cl, const void *data, size_t size)
+{
+	struct wvnc *wvnc = ((struct wvnc_client *)cl->clientData)->wvnc;
+	while (size > 0) {
+		if (wvnc->rfb.out_size == UPDATE_BUF_SIZE && !flush_update(cl)) {
+			return false;
+		}
+		size_t chunk = min(size, UPDATE_BUF_SIZE - wvnc->rfb.out_size);
+		memcpy(wvnc->rfb.out + wvnc->rfb.out_size, data, chunk);
+		wvnc->rfb.out_size += chunk;
+		data = (const uint8_t *)data + chunk;
+		size -= chunk;
 	}
-	wvnc->xkb.map = xkb_keymap_new_from_string(wvnc->xkb.ctx, mem,
-		XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	return true;
 }
 
 
-static void handle_keyboard_enter(void *data, struct wl_keyboard *wl,
-								  uint32_t serial, struct wl_surface *wls,
-								  struct wl_array *keys)
+static size_t encode_rect(rfbClientPtr cl, uint8_t *out,
+						  uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
+	struct wvnc *wvnc = ((struct wvnc_client *)cl->clientData)->wvnc;
+	uint32_t bpp = cl->format.bitsPerPixel / 8;
+	rfbScreenInfo *screen = cl->screen;
+	char *fb = screen->frameBuffer + y * screen->paddedWidthInBytes + x * sizeof(rgba_t);
+	if (cl->preferredEncoding == rfbEncodingRaw) {
+		cl->translateFn(cl->translateLookupTable, &screen->serverFormat, &cl->format,
+						fb, (char *)out, screen->paddedWidthInBytes, w, h);
+		return w * h * bpp;
+	}
+	cl->translateFn(cl->translateLookupTable, &screen->serverFormat, &cl->format,
+					fb, (char *)wvnc->rfb.pixels, screen->paddedWidthInBytes, w, h);
+	return encode_hextile(out, wvnc->rfb.pixels, bpp, w, h);
 }
 
 
-static void handle_keyboard_leave(void *data, struct wl_keyboard *wl,
-								  uint32_t serial, struct wl_surface *wls)
+static bool update_is_plain(rfbClientPtr cl)
 {
+	// Anything but plain pixel data is left to libvncserver
+	if (cl->newFBSizePending || !sraRgnEmpty(cl->copyRegion)) {
+		return false;
+	}
+	if (cl->enableCursorShapeUpdates ? cl->cursorWasChanged : cl->screen->cursor != NULL) {
+		return false;
+	}
+	if (cl->enableCursorPosUpdates && cl->cursorWasMoved) {
+		return false;
+	}
+	return true;
 }
 
 
-static void handle_keyboard_key(void *data, struct wl_keyboard *wl,
-								uint32_t serial, uint32_t time, uint32_t key,
-								uint32_t state)
+static bool client_uses_tile_cache(rfbClientPtr cl)
 {
+	if (cl->preferredEncoding != rfbEncodingHextile &&
+		cl->preferredEncoding != rfbEncodingRaw) {
+		// Everything else keeps per-client compression state
+		return false;
+	}
+	return update_is_plain(cl);
 }
 
 
-static void handle_keyboard_modifiers(void *data, struct wl_keyboard *wl,
-									  uint32_t serial, uint32_t mods_depressed,
-									  uint32_t mods_latched, uint32_t mods_locked,
-									  uint32_t group)
+static void send_cached_update(struct wvnc *wvnc, rfbClientPtr cl)
 {
+	// Same as rfbSendFramebufferUpdate, except that every full tile is
+	// encoded once per client profile and frame instead of once per client.
+	// The regions are shared with the input thread, so like libvncserver
+	// we take what we are going to send out of them up front.
+	pthread_mutex_lock(&cl->updateMutex);
+	sraRegion *region = sraRgnCreateRgn(cl->modifiedRegion);
+	sraRgnAnd(region, cl->requestedRegion);
+	if (sraRgnEmpty(region)) {
+		pthread_mutex_unlock(&cl->updateMutex);
+		sraRgnDestroy(region);
+		return;
+	}
+
+	// Split the update along the tile grid
+	uint32_t rect_count = 0;
+	sraRectangleIterator *iter = sraRgnGetIterator(region);
+	sraRect rect;
+	while (sraRgnIteratorNext(iter, &rect)) {
+		uint32_t x1 = rect.x1, y1 = rect.y1, x2 = rect.x2, y2 = rect.y2;
+		uint32_t tiles_x = (x2 - 1) / TILE_PIXELS - x1 / TILE_PIXELS + 1;
+		uint32_t tiles_y = (y2 - 1) / TILE_PIXELS - y1 / TILE_PIXELS + 1;
+		rect_count += tiles_x * tiles_y;
+	}
+	sraRgnReleaseIterator(iter);
+	if (rect_count > UINT16_MAX) {
+		pthread_mutex_unlock(&cl->updateMutex);
+		sraRgnDestroy(region);
+		rfbSendFramebufferUpdate(cl, cl->modifiedRegion);
+		return;
+	}
+	sraRgnSubtract(cl->modifiedRegion, region);
+	sraRgnMakeEmpty(cl->requestedRegion);
+	// Then the client is going to have all of the current frame
+	bool syncs = sraRgnEmpty(cl->modifiedRegion);
+	pthread_mutex_unlock(&cl->updateMutex);
+	trace_begin("send_cached_update");
+
+	// Tiles the client has elsewhere get copied over first, before anything
+	// in the update overwrites the sources. Each replaces all the pieces
+	// of its tile.
+	struct wvnc_client *client = cl->clientData;
+	struct dedup *dedup = &wvnc->dedup;
+	bool copying = dedup->hash != NULL && cl->useCopyRect && client->synced_generation != 0;
+	if (copying) {
+		dedup_begin(dedup);
+		iter = sraRgnGetIterator(region);
+		while (sraRgnIteratorNext(iter, &rect)) {
+			for (uint32_t tile_y = rect.y1 / TILE_PIXELS; tile_y * TILE_PIXELS < (uint32_t)rect.y2; tile_y++) {
+				for (uint32_t tile_x = rect.x1 / TILE_PIXELS; tile_x * TILE_PIXELS < (uint32_t)rect.x2; tile_x++) {
+					unsigned int tile = tile_y * wvnc->rfb.tile_count_x + tile_x;
+					if (dedup_copied(dedup, tile)) {
+						rect_count--;
+					} else if ((wvnc->rfb.tile_class[tile] & ~TILE_CLASS_STALE) != RECT_CLASS_SOLID) {
+						// Solid tiles are about as small as a copy anyway
+						dedup_find(dedup, wvnc->rfb.fb, wvnc->rfb.tile_generation,
+								   tile, client->synced_generation);
+					}
+				}
+			}
+		}
+		sraRgnReleaseIterator(iter);
+		dedup_order(dedup);
+	}
+
+	struct tile_profile profile;
+	memset(&profile, 0, sizeof(profile));
+	profile.encoding = cl->preferredEncoding;
+	profile.quality = -1;
+	profile.format = cl->format;
+
+	rfbFramebufferUpdateMsg msg = {
+		.type = rfbFramebufferUpdate,
+		.nRects = htons(rect_count),
+	};
+	bool ok = append_update(cl, &msg, sz_rfbFramebufferUpdateMsg);
+	uint32_t bytes = sz_rfbFramebufferUpdateMsg;
+	uint32_t raw_bytes = 0;
+	uint32_t copy_bytes = 0;
+	uint32_t copy_raw_bytes = 0;
+	for (unsigned int i = 0; copying && ok && i < dedup->copy_count; i++) {
+		unsigned int dest = dedup->copies[i].dest;
+		unsigned int source = dedup->copies[i].source;
+		uint32_t x = dest % wvnc->rfb.tile_count_x * TILE_PIXELS;
+		uint32_t y = dest / wvnc->rfb.tile_count_x * TILE_PIXELS;
+		uint32_t w = min(TILE_PIXELS, (uint32_t)cl->screen->width - x);
+		uint32_t h = min(TILE_PIXELS, (uint32_t)cl->screen->height - y);
+		rfbFramebufferUpdateRectHeader header = {
+			.r = { .x = htons(x), .y = htons(y), .w = htons(w), .h = htons(h) },
+			.encoding = htonl(rfbEncodingCopyRect),
+		};
+		rfbCopyRect copy = {
+			.srcX = htons(source % wvnc->rfb.tile_count_x * TILE_PIXELS),
+			.srcY = htons(source / wvnc->rfb.tile_count_x * TILE_PIXELS),
+		};
+		ok = append_update(cl, &header, sz_rfbFramebufferUpdateRectHeader) &&
+			append_update(cl, &copy, sz_rfbCopyRect);
+		copy_bytes += sz_rfbFramebufferUpdateRectHeader + sz_rfbCopyRect;
+		copy_raw_bytes += sz_rfbFramebufferUpdateRectHeader + w * h * cl->format.bitsPerPixel / 8;
+		if (wvnc->heatmap.bytes != NULL) {
+			heatmap_add_bytes(&wvnc->heatmap, dest, sz_rfbFramebufferUpdateRectHeader + sz_rfbCopyRect);
+		}
+	}
+	iter = sraRgnGetIterator(region);
+	while (ok && sraRgnIteratorNext(iter, &rect)) {
+		uint32_t x1 = rect.x1, y1 = rect.y1, x2 = rect.x2, y2 = rect.y2;
+		for (uint32_t tile_y = y1 / TILE_PIXELS; ok && tile_y * TILE_PIXELS < y2; tile_y++) {
+			for (uint32_t tile_x = x1 / TILE_PIXELS; ok && tile_x * TILE_PIXELS < x2; tile_x++) {
+				uint32_t x = max(x1, tile_x * TILE_PIXELS);
+				uint32_t y = max(y1, tile_y * TILE_PIXELS);
+				uint32_t w = min(x2, (tile_x + 1) * TILE_PIXELS) - x;
+				uint32_t h = min(y2, (tile_y + 1) * TILE_PIXELS) - y;
+				bool whole_tile = x == tile_x * TILE_PIXELS && y == tile_y * TILE_PIXELS &&
+					(w == TILE_PIXELS || x + w == (uint32_t)cl->screen->width) &&
+					(h == TILE_PIXELS || y + h == (uint32_t)cl->screen->height);
+				unsigned int tile = tile_y * wvnc->rfb.tile_count_x + tile_x;
+				if (copying && dedup_copied(dedup, tile)) {
+					continue;
+				}
+
+				const uint8_t *data = wvnc->rfb.encoded;
+				size_t size;
+				if (whole_tile) {
+					uint64_t generation = wvnc->rfb.tile_generation[tile];
+					struct tile_cache_entry *entry = tile_cache_lookup(
+						&wvnc->rfb.tile_cache, tile, generation, &profile
+					);
+					if (entry == NULL) {
+						entry = tile_cache_insert(
+							&wvnc->rfb.tile_cache, tile, generation, &profile,
+							encode_hextile_max_size(sizeof(rgba_t), w, h)
+						);
+						entry->size = encode_rect(cl, entry->data, x, y, w, h);
+					}
+					data = entry->data;
+					size = entry->size;
+				} else {
+					size = encode_rect(cl, wvnc->rfb.encoded, x, y, w, h);
+				}
+
+				rfbFramebufferUpdateRectHeader header = {
+					.r = { .x = htons(x), .y = htons(y), .w = htons(w), .h = htons(h) },
+					.encoding = htonl(cl->preferredEncoding),
+				};
+				ok = append_update(cl, &header, sz_rfbFramebufferUpdateRectHeader) &&
+					append_update(cl, data, size);
+				bytes += sz_rfbFramebufferUpdateRectHeader + size;
+				if (wvnc->heatmap.bytes != NULL) {
+					heatmap_add_bytes(&wvnc->heatmap, tile, sz_rfbFramebufferUpdateRectHeader + size);
+				}
+				raw_bytes += sz_rfbFramebufferUpdateRectHeader + w * h * cl->format.bitsPerPixel / 8;
+			}
+		}
+	}
+	sraRgnReleaseIterator(iter);
+	if (ok && flush_update(cl)) {
+		rfbStatRecordEncodingSent(cl, cl->preferredEncoding, bytes, raw_bytes);
+		if (copy_bytes > 0) {
+			rfbStatRecordEncodingSent(cl, rfbEncodingCopyRect, copy_bytes, copy_raw_bytes);
+		}
+		client_update_sent(cl, time_monotonic());
+		client->synced_generation = syncs ? wvnc->rfb.generation : 0;
+	}
+	wvnc->rfb.out_size = 0;
+	sraRgnDestroy(region);
+	trace_end("send_cached_update");
 }
 
 
-static void handle_keyboard_repeat_info(void *data, struct wl_keyboard *wl,
-										int32_t rate, int32_t delay)
+#ifdef WVNC_H264
+static bool h264_fresh(struct wvnc *wvnc)
 {
+	// Whether the current framebuffer is still to be encoded
+	return wvnc->h264.data == NULL || wvnc->h264.generation != wvnc->rfb.generation;
 }
 
 
-static const struct wl_keyboard_listener wl_keyboard_listener = {
-	.keymap = handle_keyboard_keymap,
-	.enter = handle_keyboard_enter,
-	.leave = handle_keyboard_leave,
-	.key = handle_keyboard_key,
-	.modifiers = handle_keyboard_modifiers,
-	.repeat_info = handle_keyboard_repeat_info,
-};
+static bool h264_in_step(struct wvnc *wvnc, struct wvnc_client *client)
+{
+	// A client decodes a frame only on top of the one before
+	uint64_t previous = h264_fresh(wvnc) ? wvnc->h264.frame : wvnc->h264.frame - 1;
+	return client->h264_frame != 0 && client->h264_frame == previous;
+}
+#endif
 
 
-static void init_virtual_keyboard(struct wvnc *wvnc)
+static bool h264_lockstep(struct wvnc *wvnc, rfbClientPtr cl, uint64_t now)
 {
-	// Now we create all the XKB context
-	struct wvnc_xkb *xkb = &wvnc->xkb;
-	xkb->ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	if (xkb->ctx == NULL) {
-		fail("Failed to create XKB context");
-	}
+	// Whether the client is in the H.264 stream and gets its next frame.
+	// Skipping one would take a key frame for everybody to make up for,
+	// while sending the frame that is encoded anyway costs next to
+	// nothing, so the scheduler's caps and budgets do not apply. The
+	// H.264 bitrate is what bounds these clients.
+#ifdef WVNC_H264
+	struct wvnc_client *client = cl->clientData;
+	return wvnc->h264.encoder != NULL && now < wvnc->rfb.video_until &&
+		atomic_load(&client->supports_h264) && h264_in_step(wvnc, client);
+#else
+	return false;
+#endif
+}
 
-	// We need to get a keymap _somewhere_. This could be either from our
-	// selected seat (preferred) or from libxkb (worse).
-	if (wvnc->selected_seat->capabilities & WL_SEAT_CAPABILITY_KEYBOARD) {
-		struct wl_keyboard *wl_keyboard =
-			wl_seat_get_keyboard(wvnc->selected_seat->wl);
-		wl_keyboard_add_listener(wl_keyboard, &wl_keyboard_listener, wvnc);
-		wl_display_dispatch(wvnc->wl.display);
-		wl_display_roundtrip(wvnc->wl.display);
+
+static bool send_h264_update(struct wvnc *wvnc, rfbClientPtr cl, uint64_t now)
+{
+	// Video-heavy content goes out as H.264 of the whole framebuffer, to
+	// the clients that can decode it. Returns false if the client should
+	// get tiles instead.
+#ifdef WVNC_H264
+	struct wvnc_client *client = cl->clientData;
+	uint32_t width = wvnc->capture.fb_width;
+	uint32_t height = wvnc->capture.fb_height;
+	if (wvnc->args.h264_bitrate == 0 || !atomic_load(&client->supports_h264) ||
+		cl->onHold || !update_is_plain(cl)) {
+		return false;
 	}
-	if (xkb->map == NULL) {
-		// Either getting the keymap from wl_seat failed or it has no keyboard
-		// attached. So we try to get a generic keymap and hope for the best.
-		// TODO: Maybe at least un-hardcode this?
-		struct xkb_rule_names names = {
-			.rules = "",
-			.model = "",
-			.layout = "us",
-			.variant = "",
-			.options = ""
-		};
-		xkb->map = xkb_keymap_new_from_names(xkb->ctx, &names, 0);
+	if (now >= wvnc->rfb.video_until || width % 2 != 0 || height % 2 != 0) {
+		if (client->h264_lossy) {
+			// The video stopped, repaint what it left behind losslessly
+			sraRegion *all = sraRgnCreateRect(0, 0, width, height);
+			pthread_mutex_lock(&cl->updateMutex);
+			sraRgnOr(cl->modifiedRegion, all);
+			pthread_mutex_unlock(&cl->updateMutex);
+			sraRgnDestroy(all);
+			client->h264_lossy = false;
+		}
+		return false;
 	}
-	if (xkb->map == NULL) {
-		fail("Failed to load keymap");
+
+	struct h264_encoder *encoder = wvnc->h264.encoder;
+	if (encoder != NULL &&
+		(h264_encoder_width(encoder) != width || h264_encoder_height(encoder) != height)) {
+		h264_encoder_destroy(encoder);
+		encoder = NULL;
+	}
+	if (encoder == NULL) {
+		encoder = h264_encoder_create(
+			width, height, wvnc->args.h264_bitrate * 1000,
+			wvnc->args.h264_keyint, 1000.0f / wvnc->args.period
+		);
+		wvnc->h264.encoder = encoder;
+		wvnc->h264.data = NULL;
+		// Nobody can go on decoding across encoders
+		wvnc->h264.frame++;
+		if (encoder == NULL) {
+			log_error("Failed to create an H.264 encoder for %s, using tiles", cl->host);
+			atomic_store(&client->supports_h264, false);
+			return false;
+		}
 	}
-	wvnc->wl.keyboard = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
-		wvnc->wl.keyboard_manager, wvnc->selected_seat->wl
-	);
 
-	xkb->state = xkb_state_new(xkb->map);
-	if (xkb->state == NULL) {
-		fail("Failed to create XKB state");
+	// The whole framebuffer goes out, so all of the update is taken care of
+	pthread_mutex_lock(&cl->updateMutex);
+	sraRegion *region = sraRgnCreateRgn(cl->modifiedRegion);
+	sraRgnAnd(region, cl->requestedRegion);
+	bool pending = !sraRgnEmpty(region);
+	pthread_mutex_unlock(&cl->updateMutex);
+	sraRgnDestroy(region);
+	if (!pending) {
+		return true;
 	}
 
-	int fd = shm_create();
-	char *str = xkb_keymap_get_as_string(xkb->map, XKB_KEYMAP_USE_ORIGINAL_FORMAT);
-	ssize_t length = strlen(str) + 1;
-	ssize_t ret = write(fd, str, length);
-	if (ret != length) {
-		fail("Failed to send keymap to the virtual keyboard");
+	// The first client to ask encodes the frame for all of them. Those
+	// that just joined or skipped a frame need a key frame, which they
+	// force only once in a while, so that a client that keeps falling
+	// behind does not turn the stream into key frames for everybody.
+	trace_begin("send_h264_update");
+	bool fresh = h264_fresh(wvnc);
+	bool joining = !h264_in_step(wvnc, client);
+	bool force = joining && now - wvnc->h264.forced_at >= H264_REJOIN_INTERVAL;
+	if (force) {
+		wvnc->h264.forced_at = now;
 	}
+	if (fresh) {
+		if (force) {
+			h264_encoder_force_key(encoder);
+		}
+		if (!h264_encode(encoder, wvnc->rfb.fb, now, &wvnc->h264.data, &wvnc->h264.size,
+						 &wvnc->h264.key)) {
+			// Nobody can go on decoding after a lost frame either
+			log_error("H.264 encoding failed for %s, using tiles", cl->host);
+			h264_encoder_destroy(encoder);
+			wvnc->h264.encoder = NULL;
+			wvnc->h264.data = NULL;
+			wvnc->h264.frame++;
+			atomic_store(&client->supports_h264, false);
+			trace_end("send_h264_update");
+			return false;
+		}
+		wvnc->h264.frame++;
+		wvnc->h264.generation = wvnc->rfb.generation;
+	} else if (force && !wvnc->h264.key) {
+		h264_encoder_force_key(encoder);
+	}
+	if (joining && !wvnc->h264.key) {
+		// Stays pending until a key frame comes along
+		trace_end("send_h264_update");
+		return true;
+	}
+	pthread_mutex_lock(&cl->updateMutex);
+	sraRgnMakeEmpty(cl->modifiedRegion);
+	sraRgnMakeEmpty(cl->requestedRegion);
+	pthread_mutex_unlock(&cl->updateMutex);
+
+	const uint8_t *data = wvnc->h264.data;
+	size_t size = wvnc->h264.size;
+	// A key frame is enough to start over, but the decoder may still hold
+	// another size or stream
+	uint32_t flags = joining ? H264_FLAG_RESET_CONTEXT : 0;
+	if (size == 0 && !joining) {
+		// Dropped, so there is nothing to decode in between
+		client->h264_frame = wvnc->h264.frame;
+	}
+	if (size > 0) {
+		rfbFramebufferUpdateMsg msg = {
+			.type = rfbFramebufferUpdate,
+			.nRects = htons(1),
+		};
+		rfbFramebufferUpdateRectHeader header = {
+			.r = { .x = 0, .y = 0, .w = htons(width), .h = htons(height) },
+			.encoding = htonl(H264_ENCODING),
+		};
+		uint32_t prefix[2] = { htonl(size), htonl(flags) };
+		bool ok = append_update(cl, &msg, sz_rfbFramebufferUpdateMsg) &&
+			append_update(cl, &header, sz_rfbFramebufferUpdateRectHeader) &&
+			append_update(cl, prefix, sizeof(prefix)) &&
+			append_update(cl, data, size) &&
+			flush_update(cl);
+		if (ok) {
+			uint32_t bytes = sz_rfbFramebufferUpdateMsg + sz_rfbFramebufferUpdateRectHeader +
+				sizeof(prefix) + size;
+			rfbStatRecordEncodingSent(cl, H264_ENCODING, bytes,
+									  width * height * cl->format.bitsPerPixel / 8);
+			client_update_sent(cl, now);
+			client->h264_lossy = true;
+			client->h264_frame = wvnc->h264.frame;
+		}
+		wvnc->rfb.out_size = 0;
+	}
+	trace_end("send_h264_update");
+	return true;
+#else
+	return false;
+#endif
+}
 
-	zwp_virtual_keyboard_v1_keymap(wvnc->wl.keyboard, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, length);
-	wl_display_dispatch_pending(wvnc->wl.display);
-	log_info("Uploaded keymap to the virtual keyboard");
+
+static void drain_eventfd(int fd)
+{
+	eventfd_t value;
+	eventfd_read(fd, &value);
 }
 
 
-static void init_wayland(struct wvnc *wvnc)
+static bool update_pending(rfbClientPtr cl)
+{
+	// Whether there is anything to send, rather than just a request. With
+	// continuous updates there always is one.
+	pthread_mutex_lock(&cl->updateMutex);
+	sraRegion *region = sraRgnCreateRgn(cl->modifiedRegion);
+	sraRgnOr(region, cl->copyRegion);
+	sraRgnAnd(region, cl->requestedRegion);
+	bool pending = !sraRgnEmpty(region);
+	pthread_mutex_unlock(&cl->updateMutex);
+	sraRgnDestroy(region);
+	return pending;
+}
+
+
+static void update_client_list(struct wvnc *wvnc)
+{
+	// Adds the clients the input thread accepted and frees those it
+	// closed. Both change the list that the input thread walks, and
+	// freeing has to wait until nothing refers to the client anymore,
+	// which libvncserver only ensures for its own background threads.
+	rfbScreenInfo *screen = wvnc->rfb.screen_info;
+	mtx_lock(&wvnc->input.clients_lock);
+	for (unsigned int i = 0; i < wvnc->input.pending_count; i++) {
+		// From here on TCP and unix socket clients are all the same.
+		// rfbNewClient closes the socket itself if the handshake fails.
+		rfbNewClient(screen, wvnc->input.pending_fds[i]);
+	}
+	if (wvnc->input.pending_count > 0) {
+		eventfd_write(wvnc->input.added_fd, 1);
+	}
+	wvnc->input.pending_count = 0;
+	rfbClientIteratorPtr iter = rfbGetClientIteratorWithClosed(screen);
+	rfbClientPtr cl = rfbClientIteratorHead(iter);
+	while (cl != NULL) {
+		rfbClientPtr prev = cl;
+		cl = rfbClientIteratorNext(iter);
+		if (prev->sock == -1) {
+			rfbClientConnectionGone(prev);
+		}
+	}
+	rfbReleaseClientIterator(iter);
+	mtx_unlock(&wvnc->input.clients_lock);
+}
+
+
+static void serve_clients(struct wvnc *wvnc)
+{
+	// The sending half of rfbProcessEvents, with our own update path for
+	// the clients that can share encoded tiles, in the order the scheduler
+	// picks. Reading from the clients is up to the input thread.
+	struct sched *sched = &wvnc->sched;
+	update_client_list(wvnc);
+	uint64_t now = time_monotonic();
+	sched_plan(sched, wvnc->rfb.screen_info, now);
+	for (size_t i = 0; i < sched->count; i++) {
+		rfbClientPtr cl = sched->order[i];
+		struct wvnc_client *client = cl->clientData;
+		client_update_estimates(cl, now);
+		continuous_request(cl);
+		if (update_pending(cl) && client_congested(cl)) {
+			// Let the client drain its backlog first
+			continue;
+		}
+		uint64_t start = time_monotonic();
+		if (!h264_lockstep(wvnc, cl, now) && !sched_admit(sched, cl, start)) {
+			// Stays pending, with the newest contents once it is its turn
+			continue;
+		}
+		uint32_t sent = rfbStatGetSentBytes(cl);
+		// The input thread answers fences and such in between
+		pthread_mutex_lock(&cl->sendMutex);
+		if (send_h264_update(wvnc, cl, now)) {
+			// Video-heavy content, which the client only has approximately
+			client->synced_generation = 0;
+		} else if (!cl->onHold && client_uses_tile_cache(cl)) {
+			send_cached_update(wvnc, cl);
+		} else {
+			// We can't tell what libvncserver sent
+			rfbUpdateClient(cl);
+			client->synced_generation = 0;
+		}
+		if (cl->sock != -1) {
+			continuous_update_sent(cl, now);
+		}
+		pthread_mutex_unlock(&cl->sendMutex);
+		sched_charge(sched, cl, start, time_monotonic(), (uint32_t)rfbStatGetSentBytes(cl) - sent);
+	}
+	sched_finish(sched);
+}
+
+
+static int input_thread(void *data)
+{
+	// Services the clients as soon as they send something, so that input
+	// injection never waits for a frame being diffed or encoded. This is
+	// rfbCheckFds() without touching the client list: new connections go
+	// to the main thread, which adds them and frees the closed clients.
+	struct wvnc *wvnc = data;
+	global_wvnc = wvnc;
+	trace_thread_name("input");
+	rfbScreenInfo *screen = wvnc->rfb.screen_info;
+	int listen_fds[] = { screen->listenSock, wvnc->rfb.unix_fd };
+	while (!atomic_load(&wvnc->input.stop)) {
+		// Our own set rather than allFds, which rfbNewClient() changes on
+		// the main thread
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(wvnc->input.added_fd, &fds);
+		int max_fd = wvnc->input.added_fd;
+		for (size_t i = 0; i < ARRAY_SIZE(listen_fds); i++) {
+			if (listen_fds[i] >= 0) {
+				FD_SET(listen_fds[i], &fds);
+				max_fd = max(max_fd, listen_fds[i]);
+			}
+		}
+		mtx_lock(&wvnc->input.clients_lock);
+		rfbClientIteratorPtr iter = rfbGetClientIterator(screen);
+		for (rfbClientPtr cl = rfbClientIteratorHead(iter); cl != NULL;
+			 cl = rfbClientIteratorNext(iter)) {
+			if (cl->sock != -1 && !cl->onHold) {
+				FD_SET(cl->sock, &fds);
+				max_fd = max(max_fd, cl->sock);
+			}
+		}
+		rfbReleaseClientIterator(iter);
+		mtx_unlock(&wvnc->input.clients_lock);
+
+		// Only bounded so that we notice when to stop
+		struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+		int ret = select(max_fd + 1, &fds, NULL, NULL, &timeout);
+		if (ret <= 0) {
+			// Including a client closed by libvncserver on the main
+			// thread in the meantime, which is gone from the next set
+			continue;
+		}
+		if (FD_ISSET(wvnc->input.added_fd, &fds)) {
+			drain_eventfd(wvnc->input.added_fd);
+		}
+		for (size_t i = 0; i < ARRAY_SIZE(listen_fds); i++) {
+			if (listen_fds[i] >= 0 && FD_ISSET(listen_fds[i], &fds)) {
+				accept_clients(wvnc, listen_fds[i]);
+			}
+		}
+		trace_begin("process_clients");
+		mtx_lock(&wvnc->input.clients_lock);
+		iter = rfbGetClientIterator(screen);
+		for (rfbClientPtr cl = rfbClientIteratorHead(iter); cl != NULL;
+			 cl = rfbClientIteratorNext(iter)) {
+			int sock = cl->sock;
+			if (sock != -1 && !cl->onHold && FD_ISSET(sock, &fds)) {
+				rfbProcessClientMessage(cl);
+			}
+		}
+		rfbReleaseClientIterator(iter);
+		mtx_unlock(&wvnc->input.clients_lock);
+		trace_end("process_clients");
+		if (wvnc->input.queue != NULL) {
+			// Get the injected keys out right away
+			wl_display_dispatch_queue_pending(wvnc->wl.display, wvnc->input.queue);
+			wl_display_flush(wvnc->wl.display);
+		}
+		eventfd_write(wvnc->input.wakeup_fd, 1);
+	}
+	return 0;
+}
+
+
+static void start_input_thread(struct wvnc *wvnc)
+{
+	wvnc->input.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	wvnc->input.added_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wvnc->input.wakeup_fd < 0 || wvnc->input.added_fd < 0) {
+		fail("Failed to create an eventfd");
+	}
+	if (wvnc->wl.keyboard != NULL) {
+		wvnc->input.queue = wl_display_create_queue(wvnc->wl.display);
+		wl_proxy_set_queue((struct wl_proxy *)wvnc->wl.keyboard, wvnc->input.queue);
+	}
+	atomic_store(&wvnc->input.stop, false);
+	if (thrd_create(&wvnc->input.thread, input_thread, wvnc) != thrd_success) {
+		fail("Failed to start the input thread");
+	}
+}
+
+
+static void stop_input_thread(struct wvnc *wvnc)
+{
+	atomic_store(&wvnc->input.stop, true);
+	thrd_join(wvnc->input.thread, NULL);
+	close(wvnc->input.wakeup_fd);
+	close(wvnc->input.added_fd);
+}
+
+
+static unsigned int count_buffers(struct wvnc *wvnc, enum wvnc_buffer_state state)
+{
+	unsigned int count = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(wvnc->buffers); i++) {
+		if (wvnc->buffers[i].state == state) {
+			count++;
+		}
+	}
+	return count;
+}
+
+
+static struct wvnc_buffer *find_buffer(struct wvnc *wvnc, enum wvnc_buffer_state state)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(wvnc->buffers); i++) {
+		if (wvnc->buffers[i].state == state) {
+			return &wvnc->buffers[i];
+		}
+	}
+	return NULL;
+}
+
+
+static struct wvnc_buffer *next_ready_buffer(struct wvnc *wvnc)
+{
+	// Frames have to be processed in the order they were requested, so
+	// only the oldest in-flight one is eligible
+	struct wvnc_buffer *oldest = NULL;
+	for (size_t i = 0; i < ARRAY_SIZE(wvnc->buffers); i++) {
+		struct wvnc_buffer *buffer = &wvnc->buffers[i];
+		if (buffer->state != WVNC_BUFFER_CAPTURING && buffer->state != WVNC_BUFFER_READY) {
+			continue;
+		}
+		if (oldest == NULL || buffer->seq < oldest->seq) {
+			oldest = buffer;
+		}
+	}
+	if (oldest == NULL || oldest->state != WVNC_BUFFER_READY) {
+		return NULL;
+	}
+	return oldest;
+}
+
+
+static void start_capture(struct wvnc *wvnc, struct wvnc_buffer *buffer)
+{
+	buffer->state = WVNC_BUFFER_CAPTURING;
+	buffer->seq = wvnc->capturer.seq++;
+	buffer->y_invert = false;
+	bool overlay_cursor = wvnc->args.cursor == WVNC_CURSOR_OVERLAY;
+	// The frame is created through the wrapper, so that its events go to
+	// the capture queue
+	mtx_lock(&wvnc->input.lock);
+	if (wvnc->args.region) {
+		buffer->frame = zwlr_screencopy_manager_v1_capture_output_region(
+			wvnc->capturer.manager, overlay_cursor, wvnc->selected_output->wl,
+			wvnc->capture.x, wvnc->capture.y, wvnc->capture.width, wvnc->capture.height
+		);
+	} else {
+		buffer->frame = zwlr_screencopy_manager_v1_capture_output(
+			wvnc->capturer.manager, overlay_cursor, wvnc->selected_output->wl
+		);
+	}
+	mtx_unlock(&wvnc->input.lock);
+	zwlr_screencopy_frame_v1_add_listener(buffer->frame, &frame_listener, buffer);
+	wl_display_flush(wvnc->wl.display);
+	trace_instant("capture_request", buffer->seq);
+}
+
+
+static void update_capture(struct wvnc *wvnc)
+{
+	struct wvnc_output *output = wvnc->selected_output;
+	if (wvnc->args.region) {
+		// The region was checked against the output at startup, it can
+		// only stop fitting after a mode change
+		struct wvnc_capture *region = &wvnc->args.capture_region;
+		wvnc->capture.x = min(region->x, max((int32_t)output->width - 1, 0));
+		wvnc->capture.y = min(region->y, max((int32_t)output->height - 1, 0));
+		wvnc->capture.width = min(region->width, output->width - wvnc->capture.x);
+		wvnc->capture.height = min(region->height, output->height - wvnc->capture.y);
+		if (wvnc->capture.width != region->width || wvnc->capture.height != region->height) {
+			log_error("Capture region clipped to %dx%d+%d+%d",
+					  wvnc->capture.width, wvnc->capture.height,
+					  wvnc->capture.x, wvnc->capture.y);
+		}
+	} else {
+		wvnc->capture.x = 0;
+		wvnc->capture.y = 0;
+		wvnc->capture.width = output->width;
+		wvnc->capture.height = output->height;
+	}
+	wvnc->capture.transform = output->transform;
+}
+
+
+static void calculate_logical_size(struct wvnc *wvnc)
+{
+	int32_t min_x = INT32_MAX;
+	int32_t max_x = INT32_MIN;
+	int32_t min_y = INT32_MAX;
+	int32_t max_y = INT32_MIN;
+	struct wvnc_output *output;
+	wl_list_for_each(output, &wvnc->outputs, link) {
+		min_x = min(min_x, output->x);
+		max_x = max(max_x, output->x + (int32_t)output->width);
+		min_y = min(min_y, output->y);
+		max_y = max(max_y, output->y + (int32_t)output->height);
+	}
+	wvnc->logical_width = max_x - min_x;
+	wvnc->logical_height = max_y - min_y;
+}
+
+
+static void handle_keyboard_keymap(void *data, struct wl_keyboard *wl,
+								   uint32_t format, int32_t fd, uint32_t size)
+{
+	struct wvnc *wvnc = data;
+	if (wvnc->xkb.map != NULL) {
+		return; // We already have a keymap from somewhere
+	}
+
+	void *mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED) {
+		return;
+	}
+	wvnc->xkb.map = xkb_keymap_new_from_string(wvnc->xkb.ctx, mem,
+		XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+}
+
+
+static void handle_keyboard_enter(void *data, struct wl_keyboard *wl,
+								  uint32_t serial, struct wl_surface *wls,
+								  struct wl_array *keys)
+{
+}
+
+
+static void handle_keyboard_leave(void *data, struct wl_keyboard *wl,
+								  uint32_t serial, struct wl_surface *wls)
+{
+}
+
+
+static void handle_keyboard_key(void *data, struct wl_keyboard *wl,
+								uint32_t serial, uint32_t time, uint32_t key,
+								uint32_t state)
+{
+}
+
+
+static void handle_keyboard_modifiers(void *data, struct wl_keyboard *wl,
+									  uint32_t serial, uint32_t mods_depressed,
+									  uint32_t mods_latched, uint32_t mods_locked,
+									  uint32_t group)
+{
+}
+
+
+static void handle_keyboard_repeat_info(void *data, struct wl_keyboard *wl,
+										int32_t rate, int32_t delay)
+{
+}
+
+
+static const struct wl_keyboard_listener wl_keyboard_listener = {
+	.keymap = handle_keyboard_keymap,
+	.enter = handle_keyboard_enter,
+	.leave = handle_keyboard_leave,
+	.key = handle_keyboard_key,
+	.modifiers = handle_keyboard_modifiers,
+	.repeat_info = handle_keyboard_repeat_info,
+};
+
+
+static void load_default_keymap(struct wvnc_xkb *xkb)
+{
+	// TODO: Maybe at least un-hardcode this?
+	struct xkb_rule_names names = {
+		.rules = "",
+		.model = "",
+		.layout = "us",
+		.variant = "",
+		.options = ""
+	};
+	xkb->map = xkb_keymap_new_from_names(xkb->ctx, &names, 0);
+}
+
+
+static void init_virtual_keyboard(struct wvnc *wvnc)
+{
+	// Now we create all the XKB context
+	struct wvnc_xkb *xkb = &wvnc->xkb;
+	xkb->ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (xkb->ctx == NULL) {
+		fail("Failed to create XKB context");
+	}
+
+	// We need to get a keymap _somewhere_. This could be either from our
+	// selected seat (preferred) or from libxkb (worse).
+	if (wvnc->selected_seat->capabilities & WL_SEAT_CAPABILITY_KEYBOARD) {
+		struct wl_keyboard *wl_keyboard =
+			wl_seat_get_keyboard(wvnc->selected_seat->wl);
+		wl_keyboard_add_listener(wl_keyboard, &wl_keyboard_listener, wvnc);
+		wl_display_dispatch(wvnc->wl.display);
+		wl_display_roundtrip(wvnc->wl.display);
+	}
+	if (xkb->map == NULL) {
+		// Either getting the keymap from wl_seat failed or it has no keyboard
+		// attached. So we try to get a generic keymap and hope for the best.
+		load_default_keymap(xkb);
+	}
+	if (xkb->map == NULL) {
+		fail("Failed to load keymap");
+	}
+	wvnc->wl.keyboard = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
+		wvnc->wl.keyboard_manager, wvnc->selected_seat->wl
+	);
+
+	xkb->state = xkb_state_new(xkb->map);
+	if (xkb->state == NULL) {
+		fail("Failed to create XKB state");
+	}
+
+	int fd = shm_create();
+	char *str = xkb_keymap_get_as_string(xkb->map, XKB_KEYMAP_USE_ORIGINAL_FORMAT);
+	ssize_t length = strlen(str) + 1;
+	ssize_t ret = write(fd, str, length);
+	if (ret != length) {
+		fail("Failed to send keymap to the virtual keyboard");
+	}
+
+	zwp_virtual_keyboard_v1_keymap(wvnc->wl.keyboard, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, length);
+	wl_display_dispatch_pending(wvnc->wl.display);
+	log_info("Uploaded keymap to the virtual keyboard");
+}
+
+
+static void init_wayland(struct wvnc *wvnc)
 {
 	wvnc->wl.display = wl_display_connect(NULL);
 	if (wvnc->wl.display == NULL) {
@@ -727,39 +2012,504 @@ static void init_wayland(struct wvnc *wvnc)
 	if (wvnc->selected_output == NULL) {
 		fail("No output found");
 	}
+
+	output = wvnc->selected_output;
+	if (wvnc->args.region) {
+		struct wvnc_capture *region = &wvnc->args.capture_region;
+		if (region->x + region->width > output->width ||
+			region->y + region->height > output->height) {
+			fail("Capture region does not fit into output %s (%dx%d)",
+				 output->name, output->width, output->height);
+		}
+	}
+	update_capture(wvnc);
+	// Assume no scaling until the first frame tells us otherwise
+	wvnc->capture.fb_width = wvnc->capture.width;
+	wvnc->capture.fb_height = wvnc->capture.height;
 }
 
 
-static void init_rfb(struct wvnc *wvnc)
+// We have no way of getting the actual cursor image out of the compositor,
+// so just send a generic arrow
+static char cursor_arrow_source[] =
+	"           "
+	" x         "
+	" xx        "
+	" xxx       "
+	" xxxx      "
+	" xxxxx     "
+	" xxxxxx    "
+	" xxxxxxx   "
+	" xxxxxxxx  "
+	" xxxxx     "
+	" xx xx     "
+	" x   xx    "
+	"     xx    "
+	"      xx   "
+	"      xx   "
+	"           ";
+
+static char cursor_arrow_mask[] =
+	"xxx        "
+	"xxxx       "
+	"xxxxx      "
+	"xxxxxx     "
+	"xxxxxxx    "
+	"xxxxxxxx   "
+	"xxxxxxxxx  "
+	"xxxxxxxxxx "
+	"xxxxxxxxxx "
+	"xxxxxxxxxx "
+	"xxxxxxxx   "
+	"xxxxxxxx   "
+	"xxx xxxxx  "
+	"    xxxxx  "
+	"     xxxx  "
+	"     xxxx  ";
+
+
+static void init_rfb_cursor(struct wvnc *wvnc)
 {
-	log_info("Initializing RFB");
-	// 4 bytes per pixel only at the moment. Probably not worth using anything
-	// else.
-	wvnc->rfb.screen_info = rfbGetScreen(
-		NULL, NULL,
-		wvnc->selected_output->width, wvnc->selected_output->height,
-		8, 3, 4
-	);
-	wvnc->rfb.screen_info->desktopName = "wvnc";
-	wvnc->rfb.screen_info->alwaysShared = true;
-	wvnc->rfb.screen_info->port = wvnc->args.port;
-	wvnc->rfb.screen_info->listenInterface = wvnc->args.address;
-	// TODO: Maybe enable IPv6 someday
-	wvnc->rfb.screen_info->ipv6port = 0;
-	wvnc->rfb.screen_info->listen6Interface = NULL;
-	wvnc->rfb.screen_info->screenData = wvnc;
-	wvnc->rfb.screen_info->newClientHook = rfb_new_client_hook;
-	wvnc->rfb.screen_info->kbdAddEvent = rfb_key_hook;
-	wvnc->rfb.screen_info->ptrAddEvent = rfb_ptr_hook;
-	rfbLog = log_info;
-	rfbErr = log_error;
+	rfbCursorPtr cursor = rfbMakeXCursor(11, 16, cursor_arrow_source, cursor_arrow_mask);
+	cursor->xhot = 1;
+	cursor->yhot = 1;
+	rfbSetCursor(wvnc->rfb.screen_info, cursor);
+	wvnc->rfb.screen_info->cursorX = wvnc->capture.fb_width / 2;
+	wvnc->rfb.screen_info->cursorY = wvnc->capture.fb_height / 2;
+}
 
-	size_t fb_size = wvnc->selected_output->width * wvnc->selected_output->height * sizeof(rgba_t);
-	wvnc->rfb.fb = xmalloc(fb_size);
-	wvnc->rfb.screen_info->frameBuffer = (char *)wvnc->rfb.fb;
 
-	log_info("Starting the VNC server");
-	rfbInitServer(wvnc->rfb.screen_info);
+static void alloc_framebuffer(struct wvnc *wvnc)
+{
+	size_t fb_size = wvnc->capture.fb_width * wvnc->capture.fb_height * sizeof(rgba_t);
+	if (wvnc->args.export != NULL) {
+		// Converted right into the shared memory, the consumers need no copy
+		wvnc->rfb.fb = export_map(&wvnc->export, wvnc->capture.fb_width,
+								  wvnc->capture.fb_height, TILE_PIXELS);
+	} else {
+		wvnc->rfb.fb = xmalloc(fb_size);
+	}
+
+	wvnc->rfb.tile_count_x = (wvnc->capture.fb_width + TILE_PIXELS - 1) / TILE_PIXELS;
+	wvnc->rfb.tile_count_y = (wvnc->capture.fb_height + TILE_PIXELS - 1) / TILE_PIXELS;
+	unsigned int tile_count = wvnc->rfb.tile_count_x * wvnc->rfb.tile_count_y;
+	wvnc->rfb.tile_class = xmalloc(tile_count);
+	wvnc->rfb.tile_generation = xmalloc(tile_count * sizeof(uint64_t));
+	size_t diff_tile_count = (wvnc->rfb.tile_count_x + 1) * (wvnc->rfb.tile_count_y + 1);
+	wvnc->rfb.damage_bits = xmalloc((diff_tile_count / 64 + 1) * sizeof(uint64_t));
+	wvnc->rfb.damage_boxes = xmalloc(diff_tile_count * sizeof(struct damage_box));
+	tile_cache_init(&wvnc->rfb.tile_cache, tile_count);
+}
+
+
+static bool configure_framebuffer(struct wvnc *wvnc, struct wvnc_buffer *buffer)
+{
+	// Returns true if the framebuffer layout changed and the frame has to
+	// be converted in full
+	bool rotated = wvnc->capture.transform & WL_OUTPUT_TRANSFORM_90;
+	uint32_t width = rotated ? buffer->height : buffer->width;
+	uint32_t height = rotated ? buffer->width : buffer->height;
+	bool changed = wvnc->rfb.transform != wvnc->capture.transform;
+	wvnc->rfb.transform = wvnc->capture.transform;
+	if (width == wvnc->capture.fb_width && height == wvnc->capture.fb_height) {
+		return changed;
+	}
+
+	log_info("Resizing the framebuffer to %ux%u", width, height);
+	trace_begin("resize");
+	// The input thread clips update requests to the screen and maps
+	// pointer events by the framebuffer size, so it has to wait for the
+	// whole swap
+	mtx_lock(&wvnc->input.clients_lock);
+	rgba_t *old_fb = wvnc->rfb.fb;
+	free(wvnc->rfb.tile_class);
+	free(wvnc->rfb.tile_generation);
+	free(wvnc->rfb.damage_bits);
+	free(wvnc->rfb.damage_boxes);
+	tile_cache_destroy(&wvnc->rfb.tile_cache);
+	mtx_lock(&wvnc->input.lock);
+	wvnc->capture.fb_width = width;
+	wvnc->capture.fb_height = height;
+	mtx_unlock(&wvnc->input.lock);
+	alloc_framebuffer(wvnc);
+	// Sends DesktopSize/ExtendedDesktopSize to the clients which support
+	// them and marks everything as modified, the sessions stay up
+	rfbNewFramebuffer(
+		wvnc->rfb.screen_info, (char *)wvnc->rfb.fb,
+		width, height, 8, 3, 4
+	);
+	mtx_unlock(&wvnc->input.clients_lock);
+	if (wvnc->args.export != NULL) {
+		export_unmap_stale(&wvnc->export);
+	} else {
+		free(old_fb);
+	}
+	trace_end("resize");
+	return true;
+}
+
+
+static void configure_sched(struct wvnc *wvnc)
+{
+	sched_configure(&wvnc->sched, wvnc->args.period * 1000,
+					(uint64_t)wvnc->args.max_rate * 1000 / 8, wvnc->args.viewer_fps);
+}
+
+
+static bool is_whole(double value, double low, double high)
+{
+	return value >= low && value <= high && value == (uint64_t)value;
+}
+
+
+static double get_period(struct wvnc *wvnc)
+{
+	return wvnc->args.period;
+}
+
+
+static const char *set_period(struct wvnc *wvnc, double value)
+{
+	if (!is_whole(value, 1, 10000)) {
+		return "invalid period";
+	}
+	wvnc->args.period = value;
+	atomic_store(&wvnc->capturer.period, wvnc->args.period * 1000);
+	configure_sched(wvnc);
+#ifdef WVNC_H264
+	if (wvnc->h264.encoder != NULL) {
+		h264_encoder_set_rate(wvnc->h264.encoder, 1000.0f / wvnc->args.period);
+	}
+#endif
+	return NULL;
+}
+
+
+static double get_depth(struct wvnc *wvnc)
+{
+	return wvnc->args.depth;
+}
+
+
+static const char *set_depth(struct wvnc *wvnc, double value)
+{
+	// Frames already in flight beyond a lowered depth just finish
+	if (!is_whole(value, 1, WVNC_BUFFER_COUNT - 3)) {
+		return "invalid capture depth";
+	}
+	wvnc->args.depth = value;
+	atomic_store(&wvnc->capturer.depth, wvnc->args.depth);
+	return NULL;
+}
+
+
+static double get_granularity(struct wvnc *wvnc)
+{
+	return wvnc->args.damage_granularity;
+}
+
+
+static const char *set_granularity(struct wvnc *wvnc, double value)
+{
+	if (!is_whole(value, 1, TILE_PIXELS) || TILE_PIXELS % (unsigned int)value != 0) {
+		return "invalid damage granularity";
+	}
+	wvnc->args.damage_granularity = value;
+	return NULL;
+}
+
+
+static double get_tile_size(struct wvnc *wvnc)
+{
+	return TILE_PIXELS;
+}
+
+
+static double get_quality(struct wvnc *wvnc)
+{
+	return wvnc->args.max_quality;
+}
+
+
+static const char *set_quality(struct wvnc *wvnc, double value)
+{
+	// Picked up by each client with its next update
+	if (!is_whole(value, 0, 9)) {
+		return "invalid quality level";
+	}
+	wvnc->args.max_quality = value;
+	return NULL;
+}
+
+
+static double get_viewer_fps(struct wvnc *wvnc)
+{
+	return wvnc->args.viewer_fps;
+}
+
+
+static const char *set_viewer_fps(struct wvnc *wvnc, double value)
+{
+	if (!is_whole(value, 0, 1000)) {
+		return "invalid frame rate";
+	}
+	wvnc->args.viewer_fps = value;
+	configure_sched(wvnc);
+	return NULL;
+}
+
+
+static double get_max_rate(struct wvnc *wvnc)
+{
+	return wvnc->args.max_rate;
+}
+
+
+static const char *set_max_rate(struct wvnc *wvnc, double value)
+{
+	if (!is_whole(value, 0, UINT_MAX)) {
+		return "invalid rate";
+	}
+	wvnc->args.max_rate = value;
+	configure_sched(wvnc);
+	return NULL;
+}
+
+
+static double get_diff_budget(struct wvnc *wvnc)
+{
+	return wvnc->args.diff_budget;
+}
+
+
+static const char *set_diff_budget(struct wvnc *wvnc, double value)
+{
+	if (!(value >= 0 && value <= 10000)) {
+		return "invalid diff budget";
+	}
+	wvnc->args.diff_budget = value;
+	wvnc->probe.budget = value * 1e6;
+	return NULL;
+}
+
+
+// What the control socket can get and set, 0 is off for those that can be
+static const struct {
+	const char *name;
+	double (*get)(struct wvnc *wvnc);
+	// NULL if fixed
+	const char *(*set)(struct wvnc *wvnc, double value);
+} control_settings[] = {
+	{ "period", get_period, set_period },              // ms
+	{ "depth", get_depth, set_depth },
+	{ "granularity", get_granularity, set_granularity },  // pixels
+	{ "tile-size", get_tile_size, NULL },               // pixels
+	{ "quality", get_quality, set_quality },            // highest JPEG level
+	{ "viewer-fps", get_viewer_fps, set_viewer_fps },
+	{ "max-rate", get_max_rate, set_max_rate },         // kbit/s
+	{ "diff-budget", get_diff_budget, set_diff_budget },  // ms
+};
+
+
+static const char *control_get(struct wvnc *wvnc, const char *name, struct control_reply *reply)
+{
+	bool found = false;
+	for (size_t i = 0; i < ARRAY_SIZE(control_settings); i++) {
+		if (name == NULL || !strcmp(name, control_settings[i].name)) {
+			control_printf(reply, "%s %g\n", control_settings[i].name,
+						   control_settings[i].get(wvnc));
+			found = true;
+		}
+	}
+	return found ? NULL : "unknown setting";
+}
+
+
+static const char *control_set(struct wvnc *wvnc, const char *name, const char *value,
+							   struct control_reply *reply)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(control_settings); i++) {
+		if (strcmp(name, control_settings[i].name)) {
+			continue;
+		}
+		if (control_settings[i].set == NULL) {
+			return "fixed at build time";
+		}
+		char *end;
+		double number = strtod(value, &end);
+		if (*value == '\0' || *end != '\0') {
+			return "not a number";
+		}
+		const char *error = control_settings[i].set(wvnc, number);
+		if (error == NULL) {
+			log_info("Control: %s set to %g", name, control_settings[i].get(wvnc));
+		}
+		return error;
+	}
+	return "unknown setting";
+}
+
+
+static void control_list_clients(struct wvnc *wvnc, struct control_reply *reply)
+{
+	// Clients are only added and freed in update_client_list(), on this
+	// thread, so clientData stays valid for the walk
+	rfbClientIteratorPtr iter = rfbGetClientIterator(wvnc->rfb.screen_info);
+	for (rfbClientPtr cl = rfbClientIteratorHead(iter); cl != NULL;
+		 cl = rfbClientIteratorNext(iter)) {
+		struct wvnc_client *client = cl->clientData;
+		if (cl->sock == -1 || client == NULL) {
+			continue;
+		}
+		// INT_MIN until the first Tight update, -1 for lossless
+		char quality[16] = "none";
+		if (client->applied_quality == -1) {
+			snprintf(quality, sizeof(quality), "lossless");
+		} else if (client->applied_quality != INT_MIN) {
+			snprintf(quality, sizeof(quality), "%d", client->applied_quality);
+		}
+		control_printf(reply, "%u %s %s rtt %.1f ms, %.0f kbit/s, quality %s, caps %.0f fps %lu kbit/s\n",
+					   client->id, cl->host,
+					   client->sched_class == SCHED_CLASS_OPERATOR ? "operator" : "viewer",
+					   client->rtt / 1000.0, client->throughput * 8 / 1000,
+					   quality,
+					   client->frame_interval != 0 ? 1e6 / client->frame_interval : 0.0,
+					   (unsigned long)(client->byte_rate * 8 / 1000));
+	}
+	rfbReleaseClientIterator(iter);
+}
+
+
+static const char *control_cap_client(struct wvnc *wvnc, const char *id, const char *cap,
+									  const char *value)
+{
+	char *end;
+	unsigned long client_id = strtoul(id, &end, 10);
+	if (*id == '\0' || *end != '\0') {
+		return "invalid client";
+	}
+	unsigned long number = strtoul(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || number > UINT_MAX) {
+		return "invalid cap";
+	}
+	bool fps = !strcmp(cap, "fps");
+	if (!fps && strcmp(cap, "rate")) {
+		return "unknown cap, expected fps or rate";
+	}
+	const char *error = "no such client";
+	// Safe to walk, clients are only freed on this thread
+	rfbClientIteratorPtr iter = rfbGetClientIterator(wvnc->rfb.screen_info);
+	for (rfbClientPtr cl = rfbClientIteratorHead(iter); cl != NULL;
+		 cl = rfbClientIteratorNext(iter)) {
+		struct wvnc_client *client = cl->clientData;
+		if (client == NULL || client->id != client_id) {
+			continue;
+		}
+		// Both only ever read by the scheduler, on this thread
+		if (fps) {
+			client->frame_interval = number != 0 ? 1000000 / number : 0;
+		} else {
+			client->byte_rate = (uint64_t)number * 1000 / 8;
+			client->rate_tokens = 0;
+		}
+		log_info("Control: %s cap of client %u set to %lu", cap, client->id, number);
+		error = NULL;
+		break;
+	}
+	rfbReleaseClientIterator(iter);
+	return error;
+}
+
+
+static const char *handle_control(void *data, int argc, char **argv,
+								  struct control_reply *reply)
+{
+	// get [NAME], set NAME VALUE, clients, client ID fps|rate VALUE
+	struct wvnc *wvnc = data;
+	if (!strcmp(argv[0], "get") && argc <= 2) {
+		return control_get(wvnc, argc == 2 ? argv[1] : NULL, reply);
+	} else if (!strcmp(argv[0], "set") && argc == 3) {
+		return control_set(wvnc, argv[1], argv[2], reply);
+	} else if (!strcmp(argv[0], "clients") && argc == 1) {
+		control_list_clients(wvnc, reply);
+		return NULL;
+	} else if (!strcmp(argv[0], "client") && argc == 4) {
+		return control_cap_client(wvnc, argv[1], argv[2], argv[3]);
+	}
+	return "unknown command";
+}
+
+
+static void init_rfb(struct wvnc *wvnc)
+{
+	log_info("Initializing RFB");
+	// 4 bytes per pixel only at the moment. Probably not worth using anything
+	// else.
+	wvnc->rfb.screen_info = rfbGetScreen(
+		NULL, NULL,
+		wvnc->capture.fb_width, wvnc->capture.fb_height,
+		8, 3, 4
+	);
+	wvnc->rfb.screen_info->desktopName = "wvnc";
+	wvnc->rfb.screen_info->alwaysShared = true;
+	wvnc->rfb.screen_info->port = wvnc->args.port;
+	wvnc->rfb.screen_info->listenInterface = wvnc->args.address;
+	// TODO: Maybe enable IPv6 someday
+	wvnc->rfb.screen_info->ipv6port = 0;
+	wvnc->rfb.screen_info->listen6Interface = NULL;
+	wvnc->rfb.screen_info->screenData = wvnc;
+	wvnc->rfb.screen_info->newClientHook = rfb_new_client_hook;
+	wvnc->rfb.screen_info->kbdAddEvent = rfb_key_hook;
+	wvnc->rfb.screen_info->ptrAddEvent = rfb_ptr_hook;
+	wvnc->rfb.screen_info->displayHook = rfb_display_hook;
+	wvnc->rfb.screen_info->displayFinishedHook = rfb_display_finished_hook;
+	rfbLog = log_info;
+	rfbErr = log_error;
+
+	if (wvnc->args.export != NULL) {
+		export_listen(&wvnc->export, wvnc->args.export);
+		log_info("Exporting the framebuffer on %s", wvnc->args.export);
+	}
+	alloc_framebuffer(wvnc);
+	wvnc->rfb.screen_info->frameBuffer = (char *)wvnc->rfb.fb;
+
+	size_t tile_max = TILE_PIXELS * TILE_PIXELS * sizeof(rgba_t);
+	wvnc->rfb.pixels = xmalloc(tile_max);
+	wvnc->rfb.encoded = xmalloc(encode_hextile_max_size(sizeof(rgba_t), TILE_PIXELS, TILE_PIXELS));
+	wvnc->rfb.out = xmalloc(UPDATE_BUF_SIZE);
+
+	if (wvnc->args.cursor == WVNC_CURSOR_RFB) {
+		init_rfb_cursor(wvnc);
+	}
+
+	wvnc->rfb.unix_fd = -1;
+	if (wvnc->args.unix_path != NULL) {
+		// No TCP listener at all then, libvncserver only gets the clients
+		// we accept ourselves
+		wvnc->rfb.screen_info->port = 0;
+	}
+
+	sched_init(&wvnc->sched, wvnc->args.period * 1000, (uint64_t)wvnc->args.max_rate * 1000 / 8,
+			   wvnc->args.viewer_fps);
+	probe_init(&wvnc->probe, wvnc->args.diff_budget * 1e6, TILE_PIXELS);
+
+	log_info("Starting the VNC server");
+	continuous_register();
+#ifdef WVNC_H264
+	if (wvnc->args.h264_bitrate != 0) {
+		h264_register();
+	}
+#endif
+	rfbInitServer(wvnc->rfb.screen_info);
+
+	if (wvnc->args.unix_path != NULL) {
+		wvnc->rfb.unix_fd = unix_listen(wvnc->args.unix_path, wvnc->args.unix_mode);
+		log_info("Listening on %s", wvnc->args.unix_path);
+	}
+	if (wvnc->args.control != NULL) {
+		control_listen(&wvnc->control, wvnc->args.control, handle_control, wvnc);
+		log_info("Accepting control commands on %s", wvnc->args.control);
+	}
 }
 
 
@@ -771,8 +2521,34 @@ static struct argp_option argp_options[] = {
 	{ "output", 'o', "OUTPUT", 0, "Select output", 0 },
 	{ "bind", 'b', "ADDRESS", 0, "Select bind address", 0 },
 	{ "port", 'p', "PORT", 0, "Select port", 0 },
+	{ "unix", 'u', "PATH", 0, "Listen on a unix socket instead of TCP", 0 },
+	{ "unix-mode", 'm', "MODE", 0, "Permissions of the unix socket, in octal (default 0600)", 0 },
 	{ "period", 't', "PERIOD", 0, "Sampling period in ms", 0 },
+	{ "region", 'r', "X,Y,W,H", 0, "Capture only the given region of the output", 0 },
+	{ "granularity", 'g', "PIXELS", 0, "Round damaged areas to multiples of PIXELS, from 1 (exact) to 32 (whole tiles)", 0 },
+	{ "depth", 'd', "DEPTH", 0, "Maximum number of frames captured in parallel", 0 },
 	{ "no-uinput", 'U', NULL, 0, "Disable uinput tablet", 0 },
+	{ "trace", 'T', "FILE", 0, "Record a Chrome trace, written on exit or SIGUSR1", 0 },
+	{ "record", 'R', "FILE", 0, "Record the processed frames into FILE", 0 },
+	{ "replay", 'P', "FILE", 0, "Replay a recording instead of capturing, no compositor needed", 0 },
+	{ "replay-fast", 'F', NULL, 0, "Replay as fast as possible instead of at the recorded pace", 0 },
+	{ "replay-input", 'J', "FIFO", 0, "Write the pointer events of a replay to FIFO the way uinput gets them, for timing the injection", 0 },
+	{ "cursor", 'c', "MODE", 0, "Cursor handling: none, overlay (composited) or rfb (cursor pseudo-encoding)", 0 },
+	{ "heatmap", 'M', "FILE", 0, "Count damage per tile, dumped to FILE (CSV if it ends in .csv, PPM otherwise) on exit or SIGUSR2", 0 },
+	{ "heatmap-tint", 'N', NULL, 0, "Tint the tiles that changed in the last frame red", 0 },
+	{ "h264", 'H', "KBPS", 0, "Send video-heavy content as H.264 at KBPS to clients that support it", 0 },
+	{ "h264-keyint", 'K', "FRAMES", 0, "Keyframe interval of the H.264 stream (default 120)", 0 },
+	{ "viewer-fps", 'v', "FPS", 0, "Cap the frame rate of the clients that have not sent input recently", 0 },
+	{ "max-rate", 'B', "KBPS", 0, "Limit what is sent to the clients, operators excepted, to KBPS in total", 0 },
+	{ "export", 'E', "PATH", 0, "Share the framebuffer with local consumers through memfds handed out on the unix socket PATH", 0 },
+	{ "no-copyrect", 'C', NULL, 0, "Do not look for dirty tiles the clients have elsewhere on screen to send as CopyRect", 0 },
+	{ "diff-budget", 'D', "MS", 0, "Spend at most MS per frame finding the damage, probing only some rows of each tile if a full diff would take longer", 0 },
+	{ "thumbnail", 'S', "PATH", 0, "Keep a downscaled copy of the screen written to PATH as a PNG", 0 },
+	{ "thumbnail-width", 'W', "PIXELS", 0, "Width of the thumbnail, the height follows the aspect ratio (default 320)", 0 },
+	{ "thumbnail-interval", 'i', "MS", 0, "How often the thumbnail gets written if the screen changed (default 1000)", 0 },
+	{ "max-quality", 'q', "LEVEL", 0, "Cap the JPEG quality level the clients ask for, from 0 to 9", 0 },
+	{ "control", 'L', "PATH", 0, "Accept commands for changing the settings at runtime on the unix socket PATH", 0 },
+	{ "bench-input", 'I', "SCENARIO[@RATE]", 0, "Benchmark the input injection into fake devices and exit, SCENARIO is typing, paste, drag, scroll or all, RATE in events/s (default back to back)", 0 },
 	{ NULL, 0, NULL, 0, NULL, 0 }
 };
 
@@ -796,15 +2572,179 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 			argp_failure(state, EXIT_FAILURE, 0, "Invalid port");
 		}
 		break;
+	case 'u':
+		args->unix_path = arg;
+		break;
+	case 'R':
+		args->record = arg;
+		break;
+	case 'P':
+		args->replay = arg;
+		break;
+	case 'F':
+		args->replay_fast = true;
+		break;
+	case 'J':
+		args->replay_input = arg;
+		break;
+	case 'm': {
+		char *end;
+		args->unix_mode = strtoul(arg, &end, 8);
+		if (*arg == '\0' || *end != '\0' || args->unix_mode > 0777) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid unix socket mode");
+		}
+		break;
+	}
 	case 't':
 		args->period = atoi(arg);
 		if (args->period <= 0) {
 			argp_failure(state, EXIT_FAILURE, 0, "Invalid period");
 		}
 		break;
+	case 'r': {
+		struct wvnc_capture *region = &args->capture_region;
+		if (sscanf(arg, "%d,%d,%u,%u", &region->x, &region->y,
+				   &region->width, &region->height) != 4 ||
+			region->x < 0 || region->y < 0 ||
+			region->width == 0 || region->height == 0) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid capture region");
+		}
+		args->region = true;
+		break;
+	}
+	case 'g':
+		args->damage_granularity = atoi(arg);
+		// Has to divide the tile size so that the rounding stays within
+		// the tile
+		if (args->damage_granularity == 0 || args->damage_granularity > TILE_PIXELS ||
+			TILE_PIXELS % args->damage_granularity != 0) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid damage granularity");
+		}
+		break;
+	case 'd':
+		args->depth = atoi(arg);
+		// One buffer is always held as the diff reference and one is
+		// being processed
+		if (args->depth <= 0 || args->depth > WVNC_BUFFER_COUNT - 3) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid capture depth");
+		}
+		break;
 	case 'U':
 		args->no_uinput = true;
 		break;
+	case 'T':
+		args->trace = arg;
+		break;
+	case 'c':
+		if (!strcmp(arg, "none")) {
+			args->cursor = WVNC_CURSOR_NONE;
+		} else if (!strcmp(arg, "overlay")) {
+			args->cursor = WVNC_CURSOR_OVERLAY;
+		} else if (!strcmp(arg, "rfb")) {
+			args->cursor = WVNC_CURSOR_RFB;
+		} else {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid cursor mode");
+		}
+		break;
+	case 'M':
+		args->heatmap = arg;
+		break;
+	case 'N':
+		args->heatmap_tint = true;
+		break;
+	case 'H':
+#ifndef WVNC_H264
+		argp_failure(state, EXIT_FAILURE, 0, "Built without H.264 support");
+#endif
+		args->h264_bitrate = atoi(arg);
+		if (args->h264_bitrate == 0) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid H.264 bitrate");
+		}
+		break;
+	case 'K':
+		args->h264_keyint = atoi(arg);
+		if (args->h264_keyint == 0) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid keyframe interval");
+		}
+		break;
+	case 'v':
+		args->viewer_fps = atoi(arg);
+		if (args->viewer_fps == 0) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid frame rate");
+		}
+		break;
+	case 'B':
+		args->max_rate = atoi(arg);
+		if (args->max_rate == 0) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid rate");
+		}
+		break;
+	case 'E':
+		args->export = arg;
+		break;
+	case 'C':
+		args->no_copyrect = true;
+		break;
+	case 'D': {
+		char *end;
+		args->diff_budget = strtod(arg, &end);
+		if (*arg == '\0' || *end != '\0' || !(args->diff_budget > 0)) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid diff budget");
+		}
+		break;
+	}
+	case 'S':
+		args->thumbnail = arg;
+		break;
+	case 'W':
+		args->thumbnail_width = atoi(arg);
+		if (args->thumbnail_width == 0) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid thumbnail width");
+		}
+		break;
+	case 'i':
+		args->thumbnail_interval = atoi(arg);
+		if (args->thumbnail_interval == 0) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid thumbnail interval");
+		}
+		break;
+	case 'q': {
+		char *end;
+		args->max_quality = strtol(arg, &end, 10);
+		if (*arg == '\0' || *end != '\0' || args->max_quality < 0 || args->max_quality > 9) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid quality level");
+		}
+		break;
+	}
+	case 'L':
+		args->control = arg;
+		break;
+	case ARGP_KEY_END:
+		if (args->heatmap_tint && args->export != NULL) {
+			// The consumers would get the tint, the framebuffer is the
+			// export segment
+			argp_failure(state, EXIT_FAILURE, 0, "--heatmap-tint does not work with --export");
+		}
+		break;
+	case 'I': {
+		char *rate = strchr(arg, '@');
+		if (rate != NULL) {
+			*rate++ = '\0';
+			args->bench_rate = atoi(rate);
+			if (args->bench_rate == 0) {
+				argp_failure(state, EXIT_FAILURE, 0, "Invalid event rate");
+			}
+		}
+		bool known = !strcmp(arg, "all");
+		for (const char **name = input_bench_scenarios; *name != NULL; name++) {
+			known = known || !strcmp(arg, *name);
+		}
+		if (!known) {
+			argp_failure(state, EXIT_FAILURE, 0, "Invalid input benchmark scenario");
+		}
+		args->bench_input = arg;
+		break;
+	}
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -812,16 +2752,758 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 }
 
 
+static volatile sig_atomic_t trace_requested = false;
+static volatile sig_atomic_t heatmap_requested = false;
+static volatile sig_atomic_t exit_requested = false;
+
+
+static void handle_signal(int signum)
+{
+	if (signum == SIGUSR1) {
+		trace_requested = true;
+	} else if (signum == SIGUSR2) {
+		heatmap_requested = true;
+	} else {
+		exit_requested = true;
+	}
+}
+
+
+static void init_signals()
+{
+	struct sigaction action = {
+		.sa_handler = handle_signal,
+	};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, NULL);
+	sigaction(SIGUSR2, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+}
+
+
+static void detect_video(struct wvnc *wvnc)
+{
+	if (wvnc->args.h264_bitrate == 0) {
+		return;
+	}
+	unsigned int tile_count = wvnc->rfb.tile_count_x * wvnc->rfb.tile_count_y;
+	unsigned int changed = 0;
+	for (unsigned int tile = 0; tile < tile_count; tile++) {
+		changed += wvnc->rfb.tile_generation[tile] == wvnc->rfb.generation;
+	}
+	if (changed * H264_VIDEO_FRACTION >= tile_count) {
+		wvnc->rfb.video_until = time_monotonic() + H264_SETTLE_TIME;
+	}
+}
+
+
+static void update_heatmap(struct wvnc *wvnc)
+{
+	struct heatmap *heatmap = &wvnc->heatmap;
+	uint32_t fb_width = wvnc->capture.fb_width;
+	uint32_t fb_height = wvnc->capture.fb_height;
+	if (heatmap->width != fb_width || heatmap->height != fb_height) {
+		if (heatmap->frames > 0) {
+			log_info("Framebuffer resized, starting the heatmap over");
+		}
+		heatmap_destroy(heatmap);
+		heatmap_init(heatmap, fb_width, fb_height, TILE_PIXELS, wvnc->args.heatmap_tint);
+	}
+	heatmap_frame(heatmap, wvnc->rfb.tile_generation, wvnc->rfb.generation);
+	if (!heatmap->tint) {
+		return;
+	}
+	heatmap_tint(heatmap, wvnc->rfb.fb, wvnc->rfb.tile_generation, wvnc->rfb.generation);
+	// Tinting changed the whole of these tiles, not just their damage
+	for (uint32_t tile_y = 0; tile_y < wvnc->rfb.tile_count_y; tile_y++) {
+		for (uint32_t tile_x = 0; tile_x < wvnc->rfb.tile_count_x; tile_x++) {
+			unsigned int tile = tile_y * wvnc->rfb.tile_count_x + tile_x;
+			if (heatmap->restored[tile]) {
+				// Same generation, but what got cached of it is tinted
+				tile_cache_invalidate(&wvnc->rfb.tile_cache, tile);
+			} else if (wvnc->rfb.tile_generation[tile] != wvnc->rfb.generation) {
+				continue;
+			}
+			rfbMarkRectAsModified(
+				wvnc->rfb.screen_info, tile_x * TILE_PIXELS, tile_y * TILE_PIXELS,
+				min((tile_x + 1) * TILE_PIXELS, fb_width),
+				min((tile_y + 1) * TILE_PIXELS, fb_height)
+			);
+		}
+	}
+}
+
+
+static void update_thumbnail(struct wvnc *wvnc)
+{
+	uint64_t now = time_monotonic();
+	if (now < wvnc->thumbnail_due) {
+		// The tiles that change in the meantime get picked up later
+		return;
+	}
+	wvnc->thumbnail_due = now + wvnc->args.thumbnail_interval * 1000ull;
+	struct thumbnail *thumbnail = &wvnc->thumbnail;
+	uint32_t fb_width = wvnc->capture.fb_width;
+	uint32_t fb_height = wvnc->capture.fb_height;
+	if (thumbnail->fb_width != fb_width || thumbnail->fb_height != fb_height) {
+		thumbnail_destroy(thumbnail);
+		thumbnail_init(thumbnail, fb_width, fb_height, TILE_PIXELS, wvnc->args.thumbnail_width);
+	}
+	trace_begin("thumbnail");
+	if (thumbnail_update(thumbnail, wvnc->rfb.fb, wvnc->rfb.tile_generation,
+						 wvnc->rfb.generation)) {
+		thumbnail_write(thumbnail, wvnc->args.thumbnail);
+	}
+	trace_end("thumbnail");
+}
+
+
+static void update_dedup(struct wvnc *wvnc)
+{
+	struct dedup *dedup = &wvnc->dedup;
+	uint32_t fb_width = wvnc->capture.fb_width;
+	uint32_t fb_height = wvnc->capture.fb_height;
+	if (dedup->width != fb_width || dedup->height != fb_height) {
+		dedup_destroy(dedup);
+		dedup_init(dedup, fb_width, fb_height, TILE_PIXELS);
+	}
+	trace_begin("dedup");
+	dedup_frame(dedup, wvnc->rfb.fb, wvnc->rfb.tile_generation, wvnc->rfb.generation);
+	trace_end("dedup");
+}
+
+
+// Returns whether new is the diff reference from now on, see
+// update_framebuffer()
+static bool process_buffer(struct wvnc *wvnc,
+						   struct wvnc_buffer *old, struct wvnc_buffer *new)
+{
+	if (wvnc->args.export != NULL) {
+		export_begin(&wvnc->export);
+	}
+	if (wvnc->heatmap.tint) {
+		// The diff and the conversion work on the real contents
+		heatmap_untint(&wvnc->heatmap, wvnc->rfb.fb);
+	}
+	bool reconfigured = configure_framebuffer(wvnc, new);
+	bool complete = true;
+	if (old == NULL || reconfigured ||
+		old->width != new->width || old->height != new->height ||
+		old->stride != new->stride || old->format != new->format ||
+		old->y_invert != new->y_invert) {
+		// The first frame, or the output mode changed
+		update_framebuffer_full(wvnc, new);
+	} else {
+		complete = update_framebuffer(wvnc, old, new);
+		detect_video(wvnc);
+	}
+	if (!wvnc->args.no_copyrect && !wvnc->args.heatmap_tint) {
+		// Tinting would have the clients copy the tint around
+		update_dedup(wvnc);
+	}
+	if (wvnc->args.thumbnail != NULL) {
+		// Before the tint goes on
+		update_thumbnail(wvnc);
+	}
+	if (wvnc->args.heatmap != NULL || wvnc->args.heatmap_tint) {
+		update_heatmap(wvnc);
+	}
+	if (wvnc->args.export != NULL) {
+		export_end(&wvnc->export, wvnc->rfb.tile_generation,
+				   wvnc->rfb.tile_count_x * wvnc->rfb.tile_count_y, wvnc->rfb.generation);
+	}
+	return complete;
+}
+
+
+static void wait_for_events(struct wvnc *wvnc, uint64_t timeout)
+{
+	// Waits until the input thread reports client traffic, the capture
+	// thread publishes a frame or the main Wayland queue (output changes)
+	// gets events. The capture thread reads from the same display fd, so
+	// this has to go through wl_display_prepare_read().
+	// TODO: Maybe use epoll or something
+	struct timeval tv = {
+		.tv_sec = timeout / 1000000,
+		.tv_usec = timeout % 1000000,
+	};
+	struct wl_display *display = wvnc->wl.display;
+	int wakeup_fd = wvnc->input.wakeup_fd;
+	int ready_fd = wvnc->capturer.ready_fd;
+	int export_fd = wvnc->args.export != NULL ? wvnc->export.listen_fd : -1;
+	int wl_fd = -1;
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(wakeup_fd, &fds);
+	int max_fd = wakeup_fd;
+	if (export_fd >= 0) {
+		FD_SET(export_fd, &fds);
+		max_fd = max(max_fd, export_fd);
+	}
+	if (display != NULL) {
+		while (wl_display_prepare_read(display) != 0) {
+			wl_display_dispatch_pending(display);
+		}
+		wl_display_flush(display);
+		wl_fd = wl_display_get_fd(display);
+		FD_SET(wl_fd, &fds);
+		FD_SET(ready_fd, &fds);
+		max_fd = max(max_fd, max(wl_fd, ready_fd));
+	}
+	if (wvnc->args.control != NULL) {
+		max_fd = control_set_fds(&wvnc->control, &fds, max_fd);
+	}
+	int ret = select(max_fd + 1, &fds, NULL, NULL, &tv);
+	if (display != NULL) {
+		if (ret > 0 && FD_ISSET(wl_fd, &fds)) {
+			wl_display_read_events(display);
+		} else {
+			wl_display_cancel_read(display);
+		}
+		wl_display_dispatch_pending(display);
+		if (ret > 0 && FD_ISSET(ready_fd, &fds)) {
+			drain_eventfd(ready_fd);
+		}
+	}
+	if (ret > 0 && export_fd >= 0 && FD_ISSET(export_fd, &fds)) {
+		export_accept(&wvnc->export);
+	}
+	if (ret > 0 && wvnc->args.control != NULL) {
+		// Between frames, so the new settings hold from the next one on
+		control_process(&wvnc->control, &fds);
+	}
+	if (ret > 0 && FD_ISSET(wakeup_fd, &fds)) {
+		drain_eventfd(wakeup_fd);
+	}
+}
+
+
+static void publish_frames(struct wvnc *wvnc)
+{
+	bool published = false;
+	struct wvnc_buffer *buffer;
+	while ((buffer = next_ready_buffer(wvnc)) != NULL) {
+		// From here on the buffer belongs to the main thread, until it
+		// gets released
+		zwlr_screencopy_frame_v1_destroy(buffer->frame);
+		buffer->frame = NULL;
+		buffer->state = WVNC_BUFFER_PUBLISHED;
+		if (!frame_ring_push(&wvnc->capturer.ring, buffer, buffer->seq)) {
+			fail("Frame ring overflow");
+		}
+		trace_instant("frame_published", buffer->seq);
+		published = true;
+	}
+	if (published) {
+		eventfd_write(wvnc->capturer.ready_fd, 1);
+	}
+}
+
+
+static int capture_thread(void *data)
+{
+	// Keeps requesting frames at the capture period, regardless of how
+	// long the main thread takes to process them
+	struct wvnc *wvnc = data;
+	global_wvnc = wvnc;
+	trace_thread_name("capture");
+	struct wl_display *display = wvnc->wl.display;
+	struct wl_event_queue *queue = wvnc->capturer.queue;
+	int wl_fd = wl_display_get_fd(display);
+	int release_fd = wvnc->capturer.release_fd;
+	uint64_t last_capture = 0; // Start of last capture
+	while (!atomic_load(&wvnc->capturer.stop)) {
+		const uint64_t capture_period = atomic_load_explicit(&wvnc->capturer.period,
+															 memory_order_relaxed);
+		const unsigned int depth = atomic_load_explicit(&wvnc->capturer.depth,
+														memory_order_relaxed);
+		uint64_t t_now = time_monotonic();
+		uint64_t t_delta = t_now - last_capture;
+		bool can_capture = count_buffers(wvnc, WVNC_BUFFER_CAPTURING) < depth;
+		if (t_delta >= capture_period && can_capture) {
+			struct wvnc_buffer *buffer = find_buffer(wvnc, WVNC_BUFFER_FREE);
+			if (buffer != NULL) {
+				start_capture(wvnc, buffer);
+				last_capture = t_now;
+				t_delta = 0;
+			}
+		}
+
+		while (wl_display_prepare_read_queue(display, queue) != 0) {
+			wl_display_dispatch_queue_pending(display, queue);
+			publish_frames(wvnc);
+		}
+		wl_display_flush(display);
+		// If we are blocked by the pipeline depth, the frame events wake us
+		// up, and if we ran out of buffers, the main thread releasing one
+		struct timeval tv = { 0 };
+		uint64_t timeout = t_delta < capture_period ? (capture_period - t_delta) : capture_period;
+		tv.tv_sec = timeout / 1000000;
+		tv.tv_usec = timeout % 1000000;
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(wl_fd, &fds);
+		FD_SET(release_fd, &fds);
+		int ret = select(max(wl_fd, release_fd) + 1, &fds, NULL, NULL, &tv);
+		if (ret > 0 && FD_ISSET(wl_fd, &fds)) {
+			wl_display_read_events(display);
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (ret > 0 && FD_ISSET(release_fd, &fds)) {
+			drain_eventfd(release_fd);
+		}
+		wl_display_dispatch_queue_pending(display, queue);
+		publish_frames(wvnc);
+	}
+	return 0;
+}
+
+
+static void release_buffer(struct wvnc *wvnc, struct wvnc_buffer *buffer)
+{
+	buffer->state = WVNC_BUFFER_FREE;
+	eventfd_write(wvnc->capturer.release_fd, 1);
+}
+
+
+static struct wvnc_buffer *take_latest_frame(struct wvnc *wvnc)
+{
+	// Only the newest published frame is worth processing, the older ones
+	// are handed right back. Diffing against the last processed frame
+	// keeps skipping them correct.
+	struct frame_ring_entry entry;
+	struct wvnc_buffer *latest = NULL;
+	while (frame_ring_pop(&wvnc->capturer.ring, &entry)) {
+		assert(entry.generation >= wvnc->capturer.generation);
+		if (latest != NULL) {
+			trace_instant("frame_dropped", latest->seq);
+			release_buffer(wvnc, latest);
+			wvnc->capturer.dropped++;
+		}
+		latest = entry.buffer;
+		wvnc->capturer.generation = entry.generation;
+	}
+	return latest;
+}
+
+
+static void start_capture_thread(struct wvnc *wvnc)
+{
+	struct wl_display *display = wvnc->wl.display;
+	frame_ring_init(&wvnc->capturer.ring);
+	wvnc->capturer.ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	wvnc->capturer.release_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wvnc->capturer.ready_fd < 0 || wvnc->capturer.release_fd < 0) {
+		fail("Failed to create an eventfd");
+	}
+	wvnc->capturer.queue = wl_display_create_queue(display);
+	wvnc->capturer.manager = wl_proxy_create_wrapper(wvnc->wl.screencopy_manager);
+	wl_proxy_set_queue((struct wl_proxy *)wvnc->capturer.manager, wvnc->capturer.queue);
+	atomic_store(&wvnc->capturer.period, wvnc->args.period * 1000);
+	atomic_store(&wvnc->capturer.depth, wvnc->args.depth);
+	atomic_store(&wvnc->capturer.stop, false);
+	if (thrd_create(&wvnc->capturer.thread, capture_thread, wvnc) != thrd_success) {
+		fail("Failed to start the capture thread");
+	}
+}
+
+
+static void stop_capture_thread(struct wvnc *wvnc)
+{
+	atomic_store(&wvnc->capturer.stop, true);
+	eventfd_write(wvnc->capturer.release_fd, 1);
+	thrd_join(wvnc->capturer.thread, NULL);
+	if (wvnc->capturer.dropped > 0) {
+		log_info("Skipped %lu stale frames", (unsigned long)wvnc->capturer.dropped);
+	}
+}
+
+
+static void run_capture(struct wvnc *wvnc)
+{
+	struct wvnc_buffer *buffer_old = NULL;
+	while (!exit_requested) {
+		if (trace_requested) {
+			trace_requested = false;
+			trace_write();
+		}
+		if (heatmap_requested && wvnc->args.heatmap != NULL) {
+			heatmap_requested = false;
+			heatmap_dump(&wvnc->heatmap, wvnc->rfb.fb, wvnc->args.heatmap);
+		}
+
+		struct wvnc_buffer *buffer_new = take_latest_frame(wvnc);
+		if (buffer_new != NULL && !process_buffer(wvnc, buffer_old, buffer_new)) {
+			// Only probed, the changes found are in the old one now
+			release_buffer(wvnc, buffer_new);
+		} else if (buffer_new != NULL) {
+			if (buffer_old != NULL) {
+				release_buffer(wvnc, buffer_old);
+			}
+			buffer_new->state = WVNC_BUFFER_HELD;
+			buffer_old = buffer_new;
+		}
+
+		serve_clients(wvnc);
+		// Bounded, since the signals may well end up on another thread
+		wait_for_events(wvnc, wvnc->args.period * 1000);
+	}
+}
+
+
+static void init_replay(struct wvnc *wvnc)
+{
+	replay_open(&wvnc->replay, wvnc->args.replay);
+	if (!replay_next(&wvnc->replay)) {
+		fail("The recording is empty");
+	}
+	struct recording_frame *frame = &wvnc->replay.frame;
+	if (!(frame->flags & RECORDING_FRAME_KEY)) {
+		fail("The recording does not start with a key frame");
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(wvnc->buffers); i++) {
+		wvnc->buffers[i].wvnc = wvnc;
+	}
+	// We know nothing about the output, so the logical size is the
+	// recorded buffer size
+	bool rotated = frame->transform & WL_OUTPUT_TRANSFORM_90;
+	wvnc->capture.transform = frame->transform;
+	wvnc->capture.width = rotated ? frame->height : frame->width;
+	wvnc->capture.height = rotated ? frame->width : frame->height;
+	wvnc->capture.fb_width = wvnc->capture.width;
+	wvnc->capture.fb_height = wvnc->capture.height;
+	log_info("Replaying %s, %ux%u %s",
+			 wvnc->args.replay, frame->width, frame->height,
+			 buffer_format_name(frame->format));
+}
+
+
+static void init_replay_input(struct wvnc *wvnc)
+{
+	// Stands in for uinput, so that bench_input_latency can tell when a
+	// pointer event got injected. The recording is all there is of the
+	// layout, a single output of its size.
+	static struct wvnc_output output = { .name = "replay" };
+	output.wvnc = wvnc;
+	output.width = wvnc->capture.width;
+	output.height = wvnc->capture.height;
+	wvnc->selected_output = &output;
+	wvnc->logical_width = wvnc->capture.width;
+	wvnc->logical_height = wvnc->capture.height;
+
+	const char *path = wvnc->args.replay_input;
+	if (mkfifo(path, 0600) < 0 && errno != EEXIST) {
+		fail("Failed to create FIFO %s: %s", path, strerror(errno));
+	}
+	// Opening it read-write does not wait for a reader, and without one
+	// the events get dropped rather than blocking the input thread
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		fail("Failed to open FIFO %s: %s", path, strerror(errno));
+	}
+	wvnc->uinput.fd = fd;
+	wvnc->uinput.initialized = true;
+	log_info("Writing pointer events to %s", path);
+}
+
+
+static void prepare_replay_buffer(struct wvnc_buffer *buffer, struct recording_frame *frame,
+								  struct wvnc_buffer *previous)
+{
+	if (buffer->data == NULL || buffer->width != frame->width ||
+		buffer->height != frame->height || buffer->stride != frame->stride ||
+		buffer->format != frame->format) {
+		free(buffer->data);
+		buffer->size = (size_t)frame->stride * frame->height;
+		buffer->data = xmalloc(buffer->size);
+		buffer->width = frame->width;
+		buffer->height = frame->height;
+		buffer->stride = frame->stride;
+		buffer->format = frame->format;
+	}
+	if (frame->flags & RECORDING_FRAME_KEY) {
+		return;
+	}
+	// Other frames only carry the dirty tiles on top of the previous one
+	if (previous == NULL || previous->size != buffer->size ||
+		previous->stride != buffer->stride) {
+		fail("Recorded frame does not match the previous one");
+	}
+	memcpy(buffer->data, previous->data, buffer->size);
+}
+
+
+static void run_replay(struct wvnc *wvnc)
+{
+	struct replay *replay = &wvnc->replay;
+	struct recording_frame *frame = &replay->frame;
+	struct wvnc_buffer *buffer_old = NULL;
+	uint64_t start = time_monotonic();
+	uint64_t busy = 0;
+	uint64_t frames = 0;
+	do {
+		if (!wvnc->args.replay_fast) {
+			// Keep the clients going until the frame is due
+			uint64_t due = start + frame->timestamp;
+			uint64_t t_now;
+			while ((t_now = time_monotonic()) < due && !exit_requested) {
+				serve_clients(wvnc);
+				wait_for_events(wvnc, due - t_now);
+			}
+		}
+
+		// Alternate between two buffers, the other one is the diff
+		// reference just like when capturing
+		struct wvnc_buffer *buffer_new = buffer_old == &wvnc->buffers[0] ?
+			&wvnc->buffers[1] : &wvnc->buffers[0];
+		prepare_replay_buffer(buffer_new, frame, buffer_old);
+		replay_apply(replay, buffer_new);
+		wvnc->capture.transform = frame->transform;
+
+		uint64_t t_start = time_monotonic();
+		bool complete = process_buffer(wvnc, buffer_old, buffer_new);
+		serve_clients(wvnc);
+		busy += time_monotonic() - t_start;
+		frames++;
+		if (complete) {
+			buffer_old = buffer_new;
+		}
+	} while (!exit_requested && replay_next(replay));
+
+	uint64_t total = time_monotonic() - start;
+	log_info("Replayed %lu frames in %.2f s, %.3f ms per frame processing",
+			 (unsigned long)frames, total / 1e6,
+			 frames > 0 ? busy / 1e3 / frames : 0.0);
+	for (size_t i = 0; i < ARRAY_SIZE(wvnc->buffers); i++) {
+		free(wvnc->buffers[i].data);
+	}
+}
+
+
+static size_t drain(int fd)
+{
+	uint8_t buf[65536];
+	size_t total = 0;
+	ssize_t ret;
+	while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+		total += ret;
+	}
+	return total;
+}
+
+
+static void sleep_until(const struct timespec *epoch, uint64_t offset)
+{
+	// clock_nanosleep() does not support CLOCK_MONOTONIC_RAW, which the
+	// timing uses, so the deadlines are kept on a clock of their own
+	uint64_t due = epoch->tv_sec * 1000000000ull + epoch->tv_nsec + offset;
+	struct timespec ts = { .tv_sec = due / 1000000000, .tv_nsec = due % 1000000000 };
+	int ret;
+	while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR &&
+		   !exit_requested) {
+	}
+	if (ret != 0 && ret != EINTR) {
+		fail("Failed to sleep: %s", strerror(ret));
+	}
+}
+
+
+static void run_input_bench(struct wvnc *wvnc)
+{
+	// The hooks write into a pipe instead of uinput, and the virtual
+	// keyboard requests go into a socket with nobody answering. Both get
+	// drained between the events, outside of the timing.
+	int uinput_pipe[2];
+	if (pipe(uinput_pipe) < 0) {
+		fail("Failed to create a pipe: %s", strerror(errno));
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(uinput_pipe[i], F_SETFL, fcntl(uinput_pipe[i], F_GETFL) | O_NONBLOCK);
+	}
+	wvnc->uinput.fd = uinput_pipe[1];
+	wvnc->uinput.initialized = true;
+
+	int wl_socks[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, wl_socks) < 0) {
+		fail("Failed to create a socket pair: %s", strerror(errno));
+	}
+	wvnc->wl.display = wl_display_connect_to_fd(wl_socks[0]);
+	if (wvnc->wl.display == NULL) {
+		fail("Failed to set up the fake Wayland connection");
+	}
+	// Binding globals that were never advertised is fine as long as
+	// nobody reads the requests
+	wvnc->wl.registry = wl_display_get_registry(wvnc->wl.display);
+	struct wl_seat *seat = wl_registry_bind(wvnc->wl.registry, 1, &wl_seat_interface, 1);
+	wvnc->wl.keyboard_manager = wl_registry_bind(
+		wvnc->wl.registry, 2, &zwp_virtual_keyboard_manager_v1_interface, 1
+	);
+	wvnc->wl.keyboard = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
+		wvnc->wl.keyboard_manager, seat
+	);
+	struct wvnc_xkb *xkb = &wvnc->xkb;
+	xkb->ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (xkb->ctx == NULL) {
+		fail("Failed to create XKB context");
+	}
+	load_default_keymap(xkb);
+	if (xkb->map == NULL) {
+		fail("Failed to load keymap");
+	}
+	xkb->state = xkb_state_new(xkb->map);
+	if (xkb->state == NULL) {
+		fail("Failed to create XKB state");
+	}
+
+	// A single output the size of the region, if any
+	struct wvnc_output output = { .wvnc = wvnc, .name = "bench" };
+	uint32_t width = wvnc->args.region ? wvnc->args.capture_region.width : 1920;
+	uint32_t height = wvnc->args.region ? wvnc->args.capture_region.height : 1080;
+	wvnc->selected_output = &output;
+	wvnc->capture.width = wvnc->capture.fb_width = width;
+	wvnc->capture.height = wvnc->capture.fb_height = height;
+	wvnc->logical_width = width;
+	wvnc->logical_height = height;
+
+	// A screen that is never served, but --cursor rfb moves its cursor
+	// and tells its clients about it
+	rfbScreenInfo *screen = rfbGetScreen(NULL, NULL, width, height, 8, 3, 4);
+	wvnc->rfb.screen_info = screen;
+	rfbClientRec *cl = xmalloc(sizeof(rfbClientRec));
+	struct wvnc_client *client = xmalloc(sizeof(struct wvnc_client));
+	client->wvnc = wvnc;
+	cl->clientData = client;
+	cl->screen = screen;
+
+	bool all = !strcmp(wvnc->args.bench_input, "all");
+	for (const char **name = input_bench_scenarios; *name != NULL && !exit_requested; name++) {
+		if (!all && strcmp(*name, wvnc->args.bench_input)) {
+			continue;
+		}
+		struct input_bench bench;
+		input_bench_init(&bench, *name, wvnc->args.bench_rate, width, height);
+		size_t uinput_bytes = 0;
+		size_t wl_bytes = 0;
+		struct timespec epoch;
+		clock_gettime(CLOCK_MONOTONIC, &epoch);
+		uint64_t start = time_monotonic_ns();
+		for (size_t i = 0; i < bench.count && !exit_requested; i++) {
+			if (bench.rate != 0) {
+				sleep_until(&epoch, i * 1000000000ull / bench.rate);
+			}
+			struct input_bench_event *event = &bench.events[i];
+			uint64_t t_start = time_monotonic_ns();
+			if (event->type == INPUT_BENCH_KEY) {
+				rfb_key_hook(event->down, event->keysym, cl);
+			} else {
+				rfb_ptr_hook(event->mask, event->x, event->y, cl);
+			}
+			// As the input thread does after each batch
+			wl_display_flush(wvnc->wl.display);
+			bench.latency[i] = time_monotonic_ns() - t_start;
+			uinput_bytes += drain(uinput_pipe[0]);
+			wl_bytes += drain(wl_socks[1]);
+		}
+		uint64_t elapsed = time_monotonic_ns() - start;
+		input_bench_report(&bench, elapsed);
+		log_info("%s: %.1f bytes of uinput events and %.1f bytes of Wayland requests per event",
+				 *name, (double)uinput_bytes / bench.count, (double)wl_bytes / bench.count);
+		input_bench_destroy(&bench);
+	}
+
+	free(client);
+	free(cl);
+	rfbScreenCleanup(screen);
+	xkb_state_unref(xkb->state);
+	xkb_keymap_unref(xkb->map);
+	xkb_context_unref(xkb->ctx);
+	wl_display_disconnect(wvnc->wl.display);
+	close(wl_socks[1]);
+	close(uinput_pipe[0]);
+	close(uinput_pipe[1]);
+}
+
+
 int main(int argc, char *argv[])
 {
 	struct wvnc *wvnc = xmalloc(sizeof(struct wvnc));
 	global_wvnc = wvnc;
+	mtx_init(&wvnc->input.lock, mtx_plain);
+	mtx_init(&wvnc->input.clients_lock, mtx_plain);
 	wvnc->args.port = 5100;
 	wvnc->args.address = inet_addr("127.0.0.1");
+	wvnc->args.unix_mode = 0600;
 	wvnc->args.period = 30;  // 30 FPS-ish
+	wvnc->args.depth = 1;
+	wvnc->args.damage_granularity = 1;
+	wvnc->args.h264_keyint = 120;
+	wvnc->args.thumbnail_width = 320;
+	wvnc->args.thumbnail_interval = 1000;
+	wvnc->args.max_quality = 9;
 
 	struct argp argp = { argp_options, parse_opt, NULL, NULL, NULL, NULL, NULL };
 	argp_parse(&argp, argc, argv, 0, NULL, &wvnc->args);
+	if (wvnc->args.replay_input != NULL && wvnc->args.replay == NULL) {
+		fail("--replay-input only works with --replay");
+	}
+
+	if (wvnc->args.trace != NULL) {
+		trace_init(wvnc->args.trace);
+		trace_thread_name("main");
+	}
+	if (wvnc->args.trace != NULL || wvnc->args.unix_path != NULL ||
+		wvnc->args.record != NULL || wvnc->args.heatmap != NULL ||
+		wvnc->args.export != NULL || wvnc->args.control != NULL ||
+		wvnc->args.replay_input != NULL) {
+		// Only needed so that we get to write out the trace, the recording
+		// and the heatmap, and remove the sockets and the FIFO on exit
+		init_signals();
+	}
+
+	if (wvnc->args.bench_input != NULL) {
+		// No compositor, devices or clients
+		run_input_bench(wvnc);
+		trace_write();
+		free(wvnc);
+		return 0;
+	}
+
+	if (wvnc->args.replay != NULL) {
+		// No compositor, and no input injection other than into the FIFO
+		init_replay(wvnc);
+		if (wvnc->args.replay_input != NULL) {
+			init_replay_input(wvnc);
+		}
+		init_rfb(wvnc);
+		start_input_thread(wvnc);
+		run_replay(wvnc);
+		stop_input_thread(wvnc);
+		replay_close(&wvnc->replay);
+		sched_destroy(&wvnc->sched);
+		if (wvnc->args.heatmap != NULL) {
+			heatmap_dump(&wvnc->heatmap, wvnc->rfb.fb, wvnc->args.heatmap);
+		}
+		if (wvnc->args.export != NULL) {
+			export_destroy(&wvnc->export);
+			unlink(wvnc->args.export);
+		}
+		if (wvnc->args.control != NULL) {
+			control_destroy(&wvnc->control);
+			unlink(wvnc->args.control);
+		}
+		if (wvnc->args.unix_path != NULL) {
+			unlink(wvnc->args.unix_path);
+		}
+		if (wvnc->args.replay_input != NULL) {
+			close(wvnc->uinput.fd);
+			unlink(wvnc->args.replay_input);
+		}
+		trace_write();
+		free(wvnc);
+		return 0;
+	}
 
 	// Initialize uinput
 	// For some reason, we absolutely have to initialize this
@@ -833,73 +3515,45 @@ int main(int argc, char *argv[])
 		}
 	}
 	init_wayland(wvnc);
-	// TODO: Handle size and transformations
 	log_info("Starting on output %s with resolution %dx%d",
 			 wvnc->selected_output->name,
-			 wvnc->selected_output->width, wvnc->selected_output->height);
+			 wvnc->capture.width, wvnc->capture.height);
+	if (wvnc->args.region) {
+		log_info("Capturing region %dx%d+%d+%d",
+				 wvnc->capture.width, wvnc->capture.height,
+				 wvnc->capture.x, wvnc->capture.y);
+	}
 
 	// Initialize RFB
 	init_rfb(wvnc);
 
-	// Start capture
-	uint64_t last_capture = 0; // Start of last capture
-	const uint64_t capture_period = wvnc->args.period * 1000;
-	struct zwlr_screencopy_frame_v1 *frame = NULL;
-	bool capturing = false;
-	struct wvnc_buffer *buffer_old = NULL;
-	struct wvnc_buffer *buffer_new = NULL;
-	while (true) {
-		// TODO: Should we composite the cursor or not?
-		uint64_t t_now = time_monotonic();
-		uint64_t t_delta = t_now - last_capture;
-		if (t_delta >= capture_period && !capturing) {
-			buffer_old = buffer_new;
-			wvnc->buffer_i = (wvnc->buffer_i + 1) % ARRAY_SIZE(wvnc->buffers);
-			buffer_new = &wvnc->buffers[wvnc->buffer_i];
-			last_capture = t_now;
-			capturing = true;
-			buffer_new->done = false;
-			frame = zwlr_screencopy_manager_v1_capture_output(
-				wvnc->wl.screencopy_manager, 0, wvnc->selected_output->wl
-			);
-			zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, buffer_new);
-			wl_display_dispatch(wvnc->wl.display);
-			wl_display_flush(wvnc->wl.display);
-		} else if (capturing && buffer_new->done) {
-			capturing = false;
-
-			if (buffer_old == NULL) {
-				// Happens only on the first frame we get
-				update_framebuffer_full(wvnc, buffer_new);
-			} else {
-				update_framebuffer(wvnc, buffer_old, buffer_new);
-			}
-
-			zwlr_screencopy_frame_v1_destroy(frame);
-		}
-
-		// TODO: Maybe use epoll or something
-		struct timeval timeout = {
-			.tv_sec = 0,
-			.tv_usec = t_delta < capture_period ? (capture_period - t_delta) : 0
-		};
-		int wl_fd = wl_display_get_fd(wvnc->wl.display);
-		fd_set fds;
-		memcpy(&fds, &wvnc->rfb.screen_info->allFds, sizeof(fd_set));
-		FD_SET(wl_fd, &fds);
-		int ret = select(wvnc->rfb.screen_info->maxFd + 2, &fds, NULL, NULL, &timeout);
-		if (ret != 0) {
-			bool is_wl = FD_ISSET(wl_fd, &fds);
-			if (is_wl) {
-				wl_display_dispatch(wvnc->wl.display);
-			}
-			// No way of checking directly
-			if ((is_wl && ret > 1) || ret == 1) {
-				rfbProcessEvents(wvnc->rfb.screen_info, 0);
-			}
-		}
+	if (wvnc->args.record != NULL) {
+		recorder_open(&wvnc->recorder, wvnc->args.record);
+		log_info("Recording to %s", wvnc->args.record);
+	}
+	start_input_thread(wvnc);
+	start_capture_thread(wvnc);
+	run_capture(wvnc);
+	stop_capture_thread(wvnc);
+	stop_input_thread(wvnc);
+	recorder_close(&wvnc->recorder);
+	sched_destroy(&wvnc->sched);
+	if (wvnc->args.heatmap != NULL) {
+		heatmap_dump(&wvnc->heatmap, wvnc->rfb.fb, wvnc->args.heatmap);
+	}
+	if (wvnc->args.export != NULL) {
+		export_destroy(&wvnc->export);
+		unlink(wvnc->args.export);
+	}
+	if (wvnc->args.control != NULL) {
+		control_destroy(&wvnc->control);
+		unlink(wvnc->args.control);
 	}
 
+	trace_write();
+	if (wvnc->args.unix_path != NULL) {
+		unlink(wvnc->args.unix_path);
+	}
 
 	free(wvnc);
 }
@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "utils.h"
+
+#include "probe.h"
+
+
+// Weight of the newest frame in the smoothed row cost
+#define PROBE_COST_ALPHA 0.25
+
+
+void probe_init(struct diff_probe *probe, uint64_t budget, unsigned int max_stride)
+{
+	memset(probe, 0, sizeof(*probe));
+	probe->budget = budget;
+	probe->max_stride = max(max_stride, 1u);
+	probe->stride = 1;
+}
+
+
+void probe_plan(struct diff_probe *probe, uint32_t height)
+{
+	if (probe->budget == 0 || probe->row_cost == 0) {
+		// Nothing to go by before the first frame
+		probe->stride = 1;
+		probe->phase = 0;
+		return;
+	}
+	// Probing costs 1 / stride of a full diff, and the dirty tiles then
+	// cost the rows that were not probed on top
+	double full = probe->row_cost * height;
+	unsigned int stride = 1;
+	while (stride < probe->max_stride &&
+		   full * (1.0 / stride + probe->dirty_fraction * (1 - 1.0 / stride)) > probe->budget) {
+		stride++;
+	}
+	if (stride <= probe->stride && probe->phase + 1 < probe->stride) {
+		// Lowering the stride in the middle of a round could leave rows
+		// out, so the round gets finished first
+		probe->phase++;
+	} else {
+		// A new round, which a higher stride starts right away
+		probe->stride = stride;
+		probe->phase = 0;
+	}
+}
+
+
+void probe_update(struct diff_probe *probe, uint64_t elapsed, double rows,
+				  double dirty_fraction)
+{
+	probe->dirty_fraction = dirty_fraction;
+	if (rows < 1) {
+		return;
+	}
+	double cost = elapsed / rows;
+	probe->row_cost = probe->row_cost == 0 ? cost :
+		probe->row_cost + PROBE_COST_ALPHA * (cost - probe->row_cost);
+}
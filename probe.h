@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Keeps finding the damage within a CPU budget per frame. If diffing all
+// of the buffer would not fit, only every stride-th row of each tile gets
+// compared, a different one each frame, so that every row is covered within
+// stride frames. Tiles found dirty that way are then compared in full, or
+// taken as changed as a whole once the budget has run out.
+//
+// The cost of a row is learned from the frames so far, and the stride
+// picked as the smallest one that is expected to fit, given how much of
+// the screen was dirty in the last frame.
+
+struct diff_probe {
+	uint64_t budget;          // ns per frame, 0 to always diff in full
+	unsigned int max_stride;
+	unsigned int stride;
+	unsigned int phase;       // Row of each tile probed this frame, modulo stride
+	double row_cost;          // ns to diff a whole buffer row, smoothed
+	double dirty_fraction;    // of the tiles in the last frame
+};
+
+
+void probe_init(struct diff_probe *probe, uint64_t budget, unsigned int max_stride);
+
+// Picks the rows to probe in the next frame, of height rows
+void probe_plan(struct diff_probe *probe, uint32_t height);
+
+// Whether the row, counted from the top of its tile, gets probed
+static inline bool probe_row(const struct diff_probe *probe, uint32_t tile_row)
+{
+	return tile_row % probe->stride == probe->phase;
+}
+
+// Accounts a frame that took elapsed ns to diff the equivalent of rows
+// whole buffer rows, with the given fraction of the tiles dirty
+void probe_update(struct diff_probe *probe, uint64_t elapsed, double rows,
+				  double dirty_fraction);
@@ -0,0 +1,281 @@
+#include <string.h>
+#include <zlib.h>
+
+#include "buffer.h"
+#include "utils.h"
+
+#include "recorder.h"
+
+
+// Cheap enough to keep up with the capture, most of the gain is from only
+// storing the dirty tiles anyway
+#define RECORDING_COMPRESSION 1
+
+
+static void tile_rect(uint32_t tile_x, uint32_t tile_y, uint32_t tile_size,
+					  uint32_t shift_x, uint32_t shift_y,
+					  uint32_t width, uint32_t height,
+					  uint32_t *x, uint32_t *y, uint32_t *w, uint32_t *h)
+{
+	// Same grid as in update_framebuffer()
+	*x = max(tile_x * tile_size, shift_x) - shift_x;
+	*y = max(tile_y * tile_size, shift_y) - shift_y;
+	*w = min((tile_x + 1) * tile_size - shift_x, width) - *x;
+	*h = min((tile_y + 1) * tile_size - shift_y, height) - *y;
+}
+
+
+static void tile_counts(uint32_t width, uint32_t height, uint32_t tile_size,
+						uint32_t shift_x, uint32_t shift_y,
+						uint32_t *count_x, uint32_t *count_y)
+{
+	*count_x = (width + shift_x + tile_size - 1) / tile_size;
+	*count_y = (height + shift_y + tile_size - 1) / tile_size;
+}
+
+
+void recorder_open(struct recorder *recorder, const char *path)
+{
+	memset(recorder, 0, sizeof(*recorder));
+	recorder->file = fopen(path, "wb");
+	if (recorder->file == NULL) {
+		fail("Failed to open recording %s", path);
+	}
+	fwrite(RECORDING_MAGIC, 1, strlen(RECORDING_MAGIC), recorder->file);
+	recorder->start = time_monotonic();
+}
+
+
+void recorder_close(struct recorder *recorder)
+{
+	if (recorder->file == NULL) {
+		return;
+	}
+	fclose(recorder->file);
+	recorder->file = NULL;
+	free(recorder->raw);
+	free(recorder->compressed);
+	log_info("Recorded %lu frames, %lu MiB of tiles in %lu MiB",
+			 (unsigned long)recorder->frames,
+			 (unsigned long)(recorder->raw_bytes >> 20),
+			 (unsigned long)(recorder->written_bytes >> 20));
+}
+
+
+static void reserve(struct recorder *recorder, struct wvnc_buffer *buffer)
+{
+	// Worst case is every tile dirty, plus their indices. Tiles are at
+	// least 1x1, so the index list can't be longer than a pixel per tile.
+	uint32_t bpp = buffer_bytes_per_pixel(buffer->format);
+	size_t size = (size_t)buffer->width * buffer->height * (bpp + sizeof(uint32_t));
+	if (size <= recorder->capacity) {
+		return;
+	}
+	free(recorder->raw);
+	free(recorder->compressed);
+	recorder->raw = xmalloc(size);
+	recorder->compressed = xmalloc(compressBound(size));
+	recorder->capacity = size;
+}
+
+
+static void write_frame(struct recorder *recorder, struct recording_frame *frame)
+{
+	uLongf compressed_size = compressBound(frame->raw_size);
+	int ret = compress2(
+		recorder->compressed, &compressed_size,
+		recorder->raw, frame->raw_size, RECORDING_COMPRESSION
+	);
+	if (ret != Z_OK) {
+		fail("Failed to compress a recorded frame");
+	}
+	frame->timestamp = time_monotonic() - recorder->start;
+	frame->compressed_size = compressed_size;
+	if (fwrite(frame, sizeof(*frame), 1, recorder->file) != 1 ||
+		fwrite(recorder->compressed, 1, compressed_size, recorder->file) != compressed_size) {
+		fail("Failed to write the recording");
+	}
+	recorder->frames++;
+	recorder->raw_bytes += frame->raw_size;
+	recorder->written_bytes += sizeof(*frame) + compressed_size;
+}
+
+
+static void init_frame(struct recording_frame *frame, struct wvnc_buffer *buffer,
+					   enum wl_output_transform transform)
+{
+	memset(frame, 0, sizeof(*frame));
+	frame->flags = buffer->y_invert ? RECORDING_FRAME_Y_INVERT : 0;
+	frame->width = buffer->width;
+	frame->height = buffer->height;
+	frame->stride = buffer->stride;
+	frame->format = buffer->format;
+	frame->transform = transform;
+}
+
+
+void recorder_key_frame(struct recorder *recorder, struct wvnc_buffer *buffer,
+						enum wl_output_transform transform)
+{
+	if (recorder->file == NULL) {
+		return;
+	}
+	reserve(recorder, buffer);
+	struct recording_frame frame;
+	init_frame(&frame, buffer, transform);
+	frame.flags |= RECORDING_FRAME_KEY;
+
+	uint32_t row = buffer->width * buffer_bytes_per_pixel(buffer->format);
+	for (uint32_t y = 0; y < buffer->height; y++) {
+		memcpy(recorder->raw + y * row, (uint8_t *)buffer->data + y * buffer->stride, row);
+	}
+	frame.raw_size = row * buffer->height;
+	write_frame(recorder, &frame);
+}
+
+
+void recorder_frame(struct recorder *recorder, struct wvnc_buffer *buffer,
+					enum wl_output_transform transform,
+					const uint64_t *bits, uint32_t tile_size,
+					uint32_t shift_x, uint32_t shift_y)
+{
+	if (recorder->file == NULL) {
+		return;
+	}
+	reserve(recorder, buffer);
+	struct recording_frame frame;
+	init_frame(&frame, buffer, transform);
+	frame.tile_size = tile_size;
+	frame.shift_x = shift_x;
+	frame.shift_y = shift_y;
+
+	uint32_t count_x, count_y;
+	tile_counts(buffer->width, buffer->height, tile_size, shift_x, shift_y, &count_x, &count_y);
+	uint32_t *indices = (uint32_t *)recorder->raw;
+	for (uint32_t tile = 0; tile < count_x * count_y; tile++) {
+		if (bits[tile / 64] & ((uint64_t)1 << (tile % 64))) {
+			indices[frame.tile_count++] = tile;
+		}
+	}
+
+	uint32_t bpp = buffer_bytes_per_pixel(buffer->format);
+	uint8_t *out = recorder->raw + frame.tile_count * sizeof(uint32_t);
+	for (uint32_t i = 0; i < frame.tile_count; i++) {
+		uint32_t x, y, w, h;
+		tile_rect(indices[i] % count_x, indices[i] / count_x, tile_size, shift_x, shift_y,
+				  buffer->width, buffer->height, &x, &y, &w, &h);
+		for (uint32_t row = y; row < y + h; row++) {
+			memcpy(out, (uint8_t *)buffer->data + row * buffer->stride + x * bpp, w * bpp);
+			out += w * bpp;
+		}
+	}
+	frame.raw_size = out - recorder->raw;
+	write_frame(recorder, &frame);
+}
+
+
+void replay_open(struct replay *replay, const char *path)
+{
+	memset(replay, 0, sizeof(*replay));
+	replay->file = fopen(path, "rb");
+	if (replay->file == NULL) {
+		fail("Failed to open recording %s", path);
+	}
+	char magic[sizeof(RECORDING_MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), replay->file) != sizeof(magic) ||
+		memcmp(magic, RECORDING_MAGIC, sizeof(magic))) {
+		fail("%s is not a wvnc recording", path);
+	}
+}
+
+
+void replay_close(struct replay *replay)
+{
+	fclose(replay->file);
+	free(replay->raw);
+	free(replay->compressed);
+}
+
+
+bool replay_next(struct replay *replay)
+{
+	struct recording_frame *frame = &replay->frame;
+	if (fread(frame, sizeof(*frame), 1, replay->file) != 1) {
+		return false;
+	}
+	if (buffer_format_cost(frame->format) == 0 ||
+		frame->transform > WL_OUTPUT_TRANSFORM_FLIPPED_270 ||
+		frame->stride < frame->width * buffer_bytes_per_pixel(frame->format) ||
+		(!(frame->flags & RECORDING_FRAME_KEY) && frame->tile_size == 0)) {
+		fail("Corrupted recording frame");
+	}
+	if (frame->compressed_size > replay->compressed_capacity) {
+		free(replay->compressed);
+		replay->compressed = xmalloc(frame->compressed_size);
+		replay->compressed_capacity = frame->compressed_size;
+	}
+	if (frame->raw_size > replay->raw_capacity) {
+		free(replay->raw);
+		replay->raw = xmalloc(frame->raw_size);
+		replay->raw_capacity = frame->raw_size;
+	}
+	if (fread(replay->compressed, 1, frame->compressed_size, replay->file) != frame->compressed_size) {
+		log_error("Recording ends in the middle of a frame");
+		return false;
+	}
+	uLongf raw_size = frame->raw_size;
+	if (uncompress(replay->raw, &raw_size, replay->compressed, frame->compressed_size) != Z_OK ||
+		raw_size != frame->raw_size) {
+		fail("Corrupted recording frame");
+	}
+	return true;
+}
+
+
+void replay_apply(struct replay *replay, struct wvnc_buffer *buffer)
+{
+	struct recording_frame *frame = &replay->frame;
+	uint32_t bpp = buffer_bytes_per_pixel(frame->format);
+	assert(buffer->width == frame->width && buffer->height == frame->height &&
+		   buffer->stride == frame->stride && buffer->format == frame->format);
+	buffer->y_invert = frame->flags & RECORDING_FRAME_Y_INVERT;
+
+	const uint8_t *in = replay->raw;
+	const uint8_t *end = replay->raw + frame->raw_size;
+	if (frame->flags & RECORDING_FRAME_KEY) {
+		uint32_t row = frame->width * bpp;
+		if ((size_t)row * frame->height != frame->raw_size) {
+			fail("Corrupted recording frame");
+		}
+		for (uint32_t y = 0; y < frame->height; y++) {
+			memcpy((uint8_t *)buffer->data + y * buffer->stride, in + y * row, row);
+		}
+		return;
+	}
+
+	if (frame->shift_x >= frame->tile_size || frame->shift_y >= frame->tile_size ||
+		(size_t)frame->tile_count * sizeof(uint32_t) > frame->raw_size) {
+		fail("Corrupted recording frame");
+	}
+	uint32_t count_x, count_y;
+	tile_counts(frame->width, frame->height, frame->tile_size,
+				frame->shift_x, frame->shift_y, &count_x, &count_y);
+	const uint32_t *indices = (const uint32_t *)in;
+	in += frame->tile_count * sizeof(uint32_t);
+	for (uint32_t i = 0; i < frame->tile_count; i++) {
+		uint32_t x, y, w, h;
+		if (indices[i] >= count_x * count_y) {
+			fail("Corrupted recording frame");
+		}
+		tile_rect(indices[i] % count_x, indices[i] / count_x, frame->tile_size,
+				  frame->shift_x, frame->shift_y, frame->width, frame->height,
+				  &x, &y, &w, &h);
+		if (in + (size_t)w * h * bpp > end) {
+			fail("Corrupted recording frame");
+		}
+		for (uint32_t row = y; row < y + h; row++) {
+			memcpy((uint8_t *)buffer->data + row * buffer->stride + x * bpp, in, w * bpp);
+			in += w * bpp;
+		}
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "wvnc.h"
+
+
+// Session recordings, made of the frames wvnc processed as dirty tiles of
+// the screencopy buffers. The file starts with RECORDING_MAGIC and is then
+// just a sequence of frames, each a struct recording_frame followed by
+// compressed_size bytes of zlib data. Inflated, that is:
+//
+//  - key frames: the whole buffer, height rows of width * bpp bytes
+//  - other frames: tile_count uint32_t tile indices into the shifted tile
+//    grid of update_framebuffer(), then the rows of each of these tiles
+//
+// Everything is in host byte order.
+
+#define RECORDING_MAGIC "WVNCREC1"
+
+#define RECORDING_FRAME_KEY       (1 << 0)
+#define RECORDING_FRAME_Y_INVERT  (1 << 1)
+
+struct recording_frame {
+	uint64_t timestamp;  // us since the start of the recording
+	uint32_t flags;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format;
+	uint32_t transform;
+	uint32_t tile_size;
+	uint32_t shift_x;
+	uint32_t shift_y;
+	uint32_t tile_count;
+	uint32_t raw_size;
+	uint32_t compressed_size;
+};
+
+
+struct recorder {
+	FILE *file;
+	uint64_t start;
+	uint8_t *raw;
+	uint8_t *compressed;
+	size_t capacity;
+	// Totals for the log
+	uint64_t frames;
+	uint64_t raw_bytes;
+	uint64_t written_bytes;
+};
+
+void recorder_open(struct recorder *recorder, const char *path);
+void recorder_close(struct recorder *recorder);
+
+void recorder_key_frame(struct recorder *recorder, struct wvnc_buffer *buffer,
+						enum wl_output_transform transform);
+void recorder_frame(struct recorder *recorder, struct wvnc_buffer *buffer,
+					enum wl_output_transform transform,
+					const uint64_t *bits, uint32_t tile_size,
+					uint32_t shift_x, uint32_t shift_y);
+
+
+struct replay {
+	FILE *file;
+	struct recording_frame frame;
+	uint8_t *raw;
+	uint8_t *compressed;
+	size_t raw_capacity;
+	size_t compressed_capacity;
+};
+
+void replay_open(struct replay *replay, const char *path);
+void replay_close(struct replay *replay);
+
+// Reads the next frame header into replay->frame, false at the end
+bool replay_next(struct replay *replay);
+
+// Applies the frame read by replay_next() onto the buffer, which must
+// hold the previous frame unless this is a key frame
+void replay_apply(struct replay *replay, struct wvnc_buffer *buffer);
@@ -0,0 +1,41 @@
+#include "ring.h"
+
+
+static_assert((FRAME_RING_SIZE & (FRAME_RING_SIZE - 1)) == 0,
+			  "FRAME_RING_SIZE has to be a power of two");
+
+
+void frame_ring_init(struct frame_ring *ring)
+{
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+
+bool frame_ring_push(struct frame_ring *ring, struct wvnc_buffer *buffer, uint64_t generation)
+{
+	uint_fast32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint_fast32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail == FRAME_RING_SIZE) {
+		return false;
+	}
+	struct frame_ring_entry *entry = &ring->entries[head % FRAME_RING_SIZE];
+	entry->buffer = buffer;
+	entry->generation = generation;
+	// Publishes the entry, and the buffer contents along with it
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+
+bool frame_ring_pop(struct frame_ring *ring, struct frame_ring_entry *entry)
+{
+	uint_fast32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint_fast32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	*entry = ring->entries[tail % FRAME_RING_SIZE];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
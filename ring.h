@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wvnc.h"
+
+
+// Hands captured frames from the capture thread to the main thread. There
+// is exactly one producer and one consumer, so the indices are all the
+// synchronization needed.
+
+// Has to be a power of two, and at least WVNC_BUFFER_COUNT so that the
+// capture thread never finds it full
+#define FRAME_RING_SIZE 8
+
+struct frame_ring_entry {
+	struct wvnc_buffer *buffer;
+	uint64_t generation;
+};
+
+struct frame_ring {
+	struct frame_ring_entry entries[FRAME_RING_SIZE];
+	// Only ever incremented, by the producer and the consumer respectively
+	atomic_uint_fast32_t head;
+	atomic_uint_fast32_t tail;
+};
+
+
+void frame_ring_init(struct frame_ring *ring);
+
+// Producer side, false if the ring is full
+bool frame_ring_push(struct frame_ring *ring, struct wvnc_buffer *buffer, uint64_t generation);
+
+// Consumer side, false if the ring is empty
+bool frame_ring_pop(struct frame_ring *ring, struct frame_ring_entry *entry);
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+
+#include "client.h"
+#include "utils.h"
+
+#include "scheduler.h"
+
+
+// Share of each period the main thread may spend serving viewers, the
+// rest is for processing the frames
+#define SCHED_BUSY_FRACTION 0.75
+// For how long a client counts as an operator after its last input
+#define SCHED_OPERATOR_TIMEOUT 5000000
+// Operators accrue this many times the budget of a viewer
+#define SCHED_OPERATOR_WEIGHT 4
+// How many periods of budget a client can save up while it is idle
+#define SCHED_MAX_BURST 2
+
+
+void sched_init(struct sched *sched, uint64_t period, uint64_t byte_rate,
+				unsigned int viewer_fps)
+{
+	sched->byte_tokens = 0;
+	sched->last_plan = 0;
+	sched->rotation = 0;
+	sched->order = NULL;
+	sched->count = 0;
+	sched->capacity = 0;
+	sched->period_start = 0;
+	sched->time_used = 0;
+	sched_configure(sched, period, byte_rate, viewer_fps);
+	// Starts out with a full period's worth
+	sched->byte_tokens = sched->byte_budget;
+}
+
+
+void sched_configure(struct sched *sched, uint64_t period, uint64_t byte_rate,
+					 unsigned int viewer_fps)
+{
+	sched->period = period;
+	sched->time_budget = period * SCHED_BUSY_FRACTION;
+	sched->byte_budget = byte_rate * period / 1000000;
+	sched->frame_interval[SCHED_CLASS_OPERATOR] = 0;
+	sched->frame_interval[SCHED_CLASS_VIEWER] = viewer_fps > 0 ? 1000000 / viewer_fps : 0;
+	// Not carrying over a burst the old budget would not have allowed
+	sched->byte_tokens = min(sched->byte_tokens, (double)SCHED_MAX_BURST * sched->byte_budget);
+}
+
+
+void sched_destroy(struct sched *sched)
+{
+	free(sched->order);
+	sched->order = NULL;
+	sched->capacity = 0;
+}
+
+
+void sched_input(rfbClientPtr cl, uint64_t now)
+{
+	struct wvnc_client *client = cl->clientData;
+	atomic_store_explicit(&client->last_input, now, memory_order_relaxed);
+}
+
+
+static unsigned int class_weight(enum sched_class class)
+{
+	return class == SCHED_CLASS_OPERATOR ? SCHED_OPERATOR_WEIGHT : 1;
+}
+
+
+static int compare_clients(const void *a, const void *b)
+{
+	const struct wvnc_client *x = (*(const rfbClientPtr *)a)->clientData;
+	const struct wvnc_client *y = (*(const rfbClientPtr *)b)->clientData;
+	if (x->sched_class != y->sched_class) {
+		return x->sched_class < y->sched_class ? -1 : 1;
+	}
+	if (x->sched_share != y->sched_share) {
+		return x->sched_share > y->sched_share ? -1 : 1;
+	}
+	return x->sched_rank < y->sched_rank ? -1 : x->sched_rank > y->sched_rank;
+}
+
+
+void sched_plan(struct sched *sched, rfbScreenInfo *screen, uint64_t now)
+{
+	sched->count = 0;
+	rfbClientIteratorPtr iter = rfbGetClientIteratorWithClosed(screen);
+	for (rfbClientPtr cl = rfbClientIteratorHead(iter); cl != NULL;
+		 cl = rfbClientIteratorNext(iter)) {
+		if (cl->sock == -1 || cl->clientData == NULL) {
+			// Nothing to do, or still in the handshake
+			continue;
+		}
+		if (sched->count == sched->capacity) {
+			sched->capacity = max(sched->capacity * 2, (size_t)16);
+			sched->order = realloc(sched->order, sched->capacity * sizeof(rfbClientPtr));
+			if (sched->order == NULL) {
+				fail("Memory allocation failed");
+			}
+		}
+		sched->order[sched->count++] = cl;
+	}
+	rfbReleaseClientIterator(iter);
+
+	unsigned int total_weight = 0;
+	for (size_t i = 0; i < sched->count; i++) {
+		rfbClientPtr cl = sched->order[i];
+		struct wvnc_client *client = cl->clientData;
+		uint64_t last_input = atomic_load_explicit(&client->last_input, memory_order_relaxed);
+		bool active = last_input != 0 && now - last_input < SCHED_OPERATOR_TIMEOUT;
+		client->sched_class = active && !cl->viewOnly ?
+			SCHED_CLASS_OPERATOR : SCHED_CLASS_VIEWER;
+		total_weight += class_weight(client->sched_class);
+	}
+
+	// The budget accrues with time rather than per cycle, as we get woken
+	// up much more often than once a period
+	double periods = sched->last_plan == 0 ? 1.0 :
+		min((double)(now - sched->last_plan) / sched->period, (double)SCHED_MAX_BURST);
+	sched->last_plan = now;
+	if (now - sched->period_start >= sched->period) {
+		sched->period_start = now;
+		sched->time_used = 0;
+	}
+	if (sched->byte_budget != 0) {
+		sched->byte_tokens = min(sched->byte_tokens + periods * sched->byte_budget,
+								 (double)SCHED_MAX_BURST * sched->byte_budget);
+	}
+	for (size_t i = 0; i < sched->count; i++) {
+		struct wvnc_client *client = sched->order[i]->clientData;
+		double share = (double)class_weight(client->sched_class) / total_weight;
+		double quantum = share * sched->time_budget;
+		client->time_credit = min(client->time_credit + periods * quantum,
+								  SCHED_MAX_BURST * quantum);
+		client->sched_share = client->time_credit / quantum;
+		if (sched->byte_budget != 0) {
+			quantum = share * sched->byte_budget;
+			client->byte_credit = min(client->byte_credit + periods * quantum,
+									  SCHED_MAX_BURST * quantum);
+			client->sched_share = min(client->sched_share, client->byte_credit / quantum);
+		}
+		if (client->byte_rate != 0) {
+			double rate_quantum = (double)client->byte_rate * sched->period / 1000000;
+			client->rate_tokens = min(client->rate_tokens + periods * rate_quantum,
+									  SCHED_MAX_BURST * rate_quantum);
+		}
+		// Breaks the ties in a different order every cycle
+		client->sched_rank = (i + sched->rotation) % sched->count;
+	}
+	sched->rotation++;
+	qsort(sched->order, sched->count, sizeof(rfbClientPtr), compare_clients);
+}
+
+
+bool sched_admit(struct sched *sched, rfbClientPtr cl, uint64_t now)
+{
+	struct wvnc_client *client = cl->clientData;
+	if (cl->sock == -1 || now < client->next_update_at) {
+		return false;
+	}
+	// Caps of the client itself hold for operators too
+	if (client->byte_rate != 0 && client->rate_tokens <= 0) {
+		return false;
+	}
+	if (client->sched_class == SCHED_CLASS_OPERATOR) {
+		return true;
+	}
+	// The viewers left over keep their credit, so they go first next time
+	return sched->time_used < sched->time_budget &&
+		(sched->byte_budget == 0 || sched->byte_tokens > 0);
+}
+
+
+void sched_charge(struct sched *sched, rfbClientPtr cl, uint64_t start, uint64_t now,
+				  uint32_t bytes)
+{
+	struct wvnc_client *client = cl->clientData;
+	client->time_credit -= now - start;
+	sched->time_used += now - start;
+	if (sched->byte_budget != 0) {
+		client->byte_credit -= bytes;
+		sched->byte_tokens -= bytes;
+	}
+	if (client->byte_rate != 0) {
+		client->rate_tokens -= bytes;
+	}
+	uint64_t interval = max(sched->frame_interval[client->sched_class], client->frame_interval);
+	if (interval != 0 && bytes > 0) {
+		// Without catching up on updates we could not send in time, but
+		// also without letting the jitter of the cycles eat into the cap
+		client->next_update_at = max(client->next_update_at + interval, start + interval / 2);
+	}
+}
+
+
+void sched_finish(struct sched *sched)
+{
+	sched->count = 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rfb/rfb.h>
+
+
+// Decides in which order and how often the clients get their updates, so
+// that many of them do not simply get served in socket order. The main
+// thread may spend a share of every capture period serving clients, and
+// optionally send a limited number of bytes. Both accrue to the clients by
+// the weight of their class, and whoever is owed the most goes first,
+// like in deficit round robin. Operators are always served, viewers only
+// while the budget lasts, and each class can be capped to a frame rate.
+// Single clients can be capped further, to a frame rate and a byte rate
+// of their own.
+
+enum sched_class {
+	SCHED_CLASS_OPERATOR,  // Sent input recently
+	SCHED_CLASS_VIEWER,
+	SCHED_CLASS_COUNT,
+};
+
+
+struct sched {
+	uint64_t period;       // us
+	uint64_t time_budget;  // us of serving per period
+	uint64_t byte_budget;  // bytes per period, 0 for no limit
+	uint64_t frame_interval[SCHED_CLASS_COUNT];  // us, 0 for no cap
+	double byte_tokens;
+	uint64_t last_plan;
+	uint32_t rotation;
+	// Clients of the current cycle in service order, until sched_finish().
+	// Only the main thread frees clients, and not during a cycle.
+	rfbClientPtr *order;
+	size_t count;
+	size_t capacity;
+	// Time spent serving in the current period, which spans many cycles
+	uint64_t period_start;
+	uint64_t time_used;
+};
+
+
+void sched_init(struct sched *sched, uint64_t period, uint64_t byte_rate,
+				unsigned int viewer_fps);
+// Changes the settings sched_init() was given, from the next cycle on
+void sched_configure(struct sched *sched, uint64_t period, uint64_t byte_rate,
+					 unsigned int viewer_fps);
+void sched_destroy(struct sched *sched);
+
+// Called on the input thread whenever the client sent input
+void sched_input(rfbClientPtr cl, uint64_t now);
+
+// Starts a cycle, putting the clients into sched->order
+void sched_plan(struct sched *sched, rfbScreenInfo *screen, uint64_t now);
+// Whether the client gets to send an update now
+bool sched_admit(struct sched *sched, rfbClientPtr cl, uint64_t now);
+// Accounts for serving the client from start to now, which sent bytes
+void sched_charge(struct sched *sched, rfbClientPtr cl, uint64_t start, uint64_t now,
+				  uint32_t bytes);
+void sched_finish(struct sched *sched);
@@ -0,0 +1,169 @@
+// Checks buffer_to_fb() for every format, transform and y_invert against
+// a per-pixel reference. The conversion is done in odd-sized rectangles,
+// so that both the vector blocks and the scalar tails get exercised, and
+// once one pixel at a time, which only ever takes the scalar path.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "utils.h"
+
+
+#define TEST_WIDTH 77
+#define TEST_HEIGHT 45
+// Not a multiple of the vector width, so rects have a tail
+#define TEST_RECT 19u
+
+
+static const enum wl_shm_format formats[] = {
+	WL_SHM_FORMAT_XRGB8888,
+	WL_SHM_FORMAT_ARGB8888,
+	WL_SHM_FORMAT_XBGR8888,
+	WL_SHM_FORMAT_ABGR8888,
+	WL_SHM_FORMAT_XRGB2101010,
+	WL_SHM_FORMAT_ARGB2101010,
+	WL_SHM_FORMAT_XBGR2101010,
+	WL_SHM_FORMAT_ABGR2101010,
+	WL_SHM_FORMAT_RGB565,
+	WL_SHM_FORMAT_BGR565,
+};
+
+
+static uint8_t widen(uint32_t value, unsigned int bits)
+{
+	// The top bits of the channel, or its bits replicated if it has fewer
+	// than 8
+	if (bits >= 8) {
+		return value >> (bits - 8);
+	}
+	return (value << (8 - bits)) | (value >> (2 * bits - 8));
+}
+
+
+static rgba_t decode(enum wl_shm_format format, uint32_t p)
+{
+	uint32_t r, g, b;
+	unsigned int bits;
+	switch (format) {
+	case WL_SHM_FORMAT_XRGB8888:
+	case WL_SHM_FORMAT_ARGB8888:
+		r = p >> 16 & 0xff; g = p >> 8 & 0xff; b = p & 0xff; bits = 8;
+		break;
+	case WL_SHM_FORMAT_XBGR8888:
+	case WL_SHM_FORMAT_ABGR8888:
+		b = p >> 16 & 0xff; g = p >> 8 & 0xff; r = p & 0xff; bits = 8;
+		break;
+	case WL_SHM_FORMAT_XRGB2101010:
+	case WL_SHM_FORMAT_ARGB2101010:
+		r = p >> 20 & 0x3ff; g = p >> 10 & 0x3ff; b = p & 0x3ff; bits = 10;
+		break;
+	case WL_SHM_FORMAT_XBGR2101010:
+	case WL_SHM_FORMAT_ABGR2101010:
+		b = p >> 20 & 0x3ff; g = p >> 10 & 0x3ff; r = p & 0x3ff; bits = 10;
+		break;
+	case WL_SHM_FORMAT_RGB565:
+		return (rgba_t) { widen(p >> 11 & 0x1f, 5), widen(p >> 5 & 0x3f, 6),
+						  widen(p & 0x1f, 5), 0xff };
+	case WL_SHM_FORMAT_BGR565:
+		return (rgba_t) { widen(p & 0x1f, 5), widen(p >> 5 & 0x3f, 6),
+						  widen(p >> 11 & 0x1f, 5), 0xff };
+	default:
+		fail("Untested format %d", format);
+	}
+	return (rgba_t) { widen(r, bits), widen(g, bits), widen(b, bits), 0xff };
+}
+
+
+static void reference(rgba_t *fb, struct wvnc_capture *capture, struct wvnc_buffer *buffer)
+{
+	uint32_t width = capture->fb_width, height = capture->fb_height;
+	uint32_t bpp = buffer_bytes_per_pixel(buffer->format);
+	for (uint32_t y = 0; y < buffer->height; y++) {
+		for (uint32_t x = 0; x < buffer->width; x++) {
+			uint32_t p = 0;
+			memcpy(&p, (uint8_t *)buffer->data + y * buffer->stride + x * bpp, bpp);
+			// Rows in output order first, then the output transform
+			uint32_t oy = buffer->y_invert ? buffer->height - 1 - y : y;
+			uint32_t fb_x, fb_y;
+			switch (capture->transform) {
+			case WL_OUTPUT_TRANSFORM_NORMAL: fb_x = x; fb_y = oy; break;
+			case WL_OUTPUT_TRANSFORM_90: fb_x = oy; fb_y = height - 1 - x; break;
+			case WL_OUTPUT_TRANSFORM_180: fb_x = width - 1 - x; fb_y = height - 1 - oy; break;
+			case WL_OUTPUT_TRANSFORM_270: fb_x = width - 1 - oy; fb_y = x; break;
+			case WL_OUTPUT_TRANSFORM_FLIPPED: fb_x = width - 1 - x; fb_y = oy; break;
+			case WL_OUTPUT_TRANSFORM_FLIPPED_90: fb_x = oy; fb_y = x; break;
+			case WL_OUTPUT_TRANSFORM_FLIPPED_180: fb_x = x; fb_y = height - 1 - oy; break;
+			default: fb_x = width - 1 - oy; fb_y = height - 1 - x; break;
+			}
+			fb[fb_y * width + fb_x] = decode(buffer->format, p);
+		}
+	}
+}
+
+
+static void convert_rects(rgba_t *fb, struct wvnc_capture *capture, struct wvnc_buffer *buffer,
+						  uint32_t size)
+{
+	for (uint32_t y = 0; y < buffer->height; y += size) {
+		for (uint32_t x = 0; x < buffer->width; x += size) {
+			buffer_to_fb(fb, capture, buffer, x, y, min(size, buffer->width - x),
+						 min(size, buffer->height - y));
+		}
+	}
+}
+
+
+int main()
+{
+	size_t fb_size = TEST_WIDTH * TEST_HEIGHT * sizeof(rgba_t);
+	rgba_t *expected = xmalloc(fb_size);
+	rgba_t *rects = xmalloc(fb_size);
+	rgba_t *pixels = xmalloc(fb_size);
+	unsigned int failures = 0;
+	srand(1);
+	for (size_t i = 0; i < ARRAY_SIZE(formats); i++) {
+		uint32_t bpp = buffer_bytes_per_pixel(formats[i]);
+		// Padding at the end of the rows, which must not be read as pixels
+		struct wvnc_buffer buffer = {
+			.width = TEST_WIDTH,
+			.height = TEST_HEIGHT,
+			.stride = TEST_WIDTH * bpp + 6,
+			.format = formats[i],
+		};
+		buffer.data = xmalloc(buffer.stride * buffer.height);
+		for (size_t j = 0; j < buffer.stride * buffer.height; j++) {
+			((uint8_t *)buffer.data)[j] = rand();
+		}
+		for (int transform = 0; transform < 8; transform++) {
+			for (int y_invert = 0; y_invert < 2; y_invert++) {
+				bool rotated = transform & 1;
+				struct wvnc_capture capture = {
+					.transform = transform,
+					.fb_width = rotated ? TEST_HEIGHT : TEST_WIDTH,
+					.fb_height = rotated ? TEST_WIDTH : TEST_HEIGHT,
+				};
+				capture.width = capture.fb_width;
+				capture.height = capture.fb_height;
+				buffer.y_invert = y_invert;
+				memset(expected, 0, fb_size);
+				memset(rects, 0, fb_size);
+				memset(pixels, 0, fb_size);
+				reference(expected, &capture, &buffer);
+				convert_rects(rects, &capture, &buffer, TEST_RECT);
+				convert_rects(pixels, &capture, &buffer, 1);
+				if (memcmp(rects, expected, fb_size) || memcmp(pixels, expected, fb_size)) {
+					printf("FAIL %s transform %d y_invert %d\n",
+						   buffer_format_name(formats[i]), transform, y_invert);
+					failures++;
+				}
+			}
+		}
+		free(buffer.data);
+	}
+	free(expected);
+	free(rects);
+	free(pixels);
+	printf("%zu formats, %u failures\n", ARRAY_SIZE(formats), failures);
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,161 @@
+// Publishes frames to a forked consumer through the export segment. Every
+// pixel of a frame carries its generation, so that the consumer can tell
+// a torn read that the seqlock let through. Also checks that the segment
+// cannot be mapped writable, and that a resize marks the old one stale
+// and closes the connection.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "export.h"
+#include "utils.h"
+
+
+#define TEST_WIDTH 100
+#define TEST_HEIGHT 70
+#define TEST_TILE 32
+#define TEST_FRAMES 2000
+
+
+static int consume(const char *path)
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	while (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		usleep(1000);
+	}
+
+	struct export_hello hello;
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	if (recvmsg(sock, &msg, 0) != sizeof(hello) || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+		cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+		printf("consumer: no hello\n");
+		return EXIT_FAILURE;
+	}
+	int fds[2];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if (mmap(NULL, hello.size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0) != MAP_FAILED) {
+		printf("consumer: the segment can be mapped writable\n");
+		return EXIT_FAILURE;
+	}
+	struct export_header *header = mmap(NULL, hello.size, PROT_READ, MAP_SHARED, fds[0], 0);
+	if (header == MAP_FAILED || memcmp(header->magic, EXPORT_MAGIC, sizeof(header->magic)) ||
+		header->width != TEST_WIDTH || header->height != TEST_HEIGHT) {
+		printf("consumer: bad segment\n");
+		return EXIT_FAILURE;
+	}
+
+	size_t row_bytes = header->width * sizeof(rgba_t);
+	rgba_t *copy = xmalloc(header->height * row_bytes);
+	int torn = 0;
+	while (true) {
+		eventfd_t value;
+		eventfd_read(fds[1], &value);
+		uint64_t seq, generation;
+		uint32_t flags;
+		do {
+			seq = atomic_load_explicit(&header->seq, memory_order_acquire);
+			for (uint32_t y = 0; y < header->height; y++) {
+				memcpy((uint8_t *)copy + y * row_bytes,
+					   (uint8_t *)header + header->fb_offset + y * header->stride, row_bytes);
+			}
+			generation = header->generation;
+			flags = header->flags;
+			atomic_thread_fence(memory_order_acquire);
+		} while ((seq & 1) || seq != atomic_load_explicit(&header->seq, memory_order_relaxed));
+		if (flags & EXPORT_FLAG_STALE) {
+			break;
+		}
+		for (size_t i = 0; i < (size_t)header->width * header->height; i++) {
+			if (copy[i].r != (uint8_t)generation) {
+				torn++;
+				break;
+			}
+		}
+	}
+	free(copy);
+	if (torn > 0) {
+		printf("consumer: %d torn frames\n", torn);
+		return EXIT_FAILURE;
+	}
+	// The stale segment is followed by the end of the connection
+	char c;
+	if (recv(sock, &c, 1, 0) != 0) {
+		printf("consumer: still connected after a resize\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+
+int main()
+{
+	char dir[] = "/tmp/wvnc-test-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		fail("Failed to create a temporary directory");
+	}
+	char path[sizeof(dir) + 16];
+	snprintf(path, sizeof(path), "%s/export", dir);
+
+	struct export export;
+	export_listen(&export, path);
+	pid_t pid = fork();
+	if (pid == 0) {
+		exit(consume(path));
+	}
+
+	rgba_t *fb = export_map(&export, TEST_WIDTH, TEST_HEIGHT, TEST_TILE);
+	uint32_t tile_count = ((TEST_WIDTH + TEST_TILE - 1) / TEST_TILE) *
+		((TEST_HEIGHT + TEST_TILE - 1) / TEST_TILE);
+	// Also big enough for the resized grid
+	uint64_t tile_generation[((2 * TEST_WIDTH + TEST_TILE - 1) / TEST_TILE) *
+							 ((2 * TEST_HEIGHT + TEST_TILE - 1) / TEST_TILE)];
+	memset(tile_generation, 0, sizeof(tile_generation));
+	while (export.consumer_count == 0) {
+		export_accept(&export);
+		usleep(1000);
+	}
+	uint64_t generation;
+	for (generation = 1; generation <= TEST_FRAMES; generation++) {
+		export_begin(&export);
+		for (uint32_t y = 0; y < TEST_HEIGHT; y++) {
+			rgba_t *row = (rgba_t *)((uint8_t *)fb + y * export.header->stride);
+			for (uint32_t x = 0; x < TEST_WIDTH; x++) {
+				row[x].r = generation;
+			}
+		}
+		tile_generation[generation % tile_count] = generation;
+		export_end(&export, tile_generation, tile_count, generation);
+	}
+	export_begin(&export);
+	export_map(&export, 2 * TEST_WIDTH, 2 * TEST_HEIGHT, TEST_TILE);
+	export_unmap_stale(&export);
+	export_end(&export, tile_generation, ARRAY_SIZE(tile_generation), generation);
+
+	int status;
+	waitpid(pid, &status, 0);
+	export_destroy(&export);
+	unlink(path);
+	rmdir(dir);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
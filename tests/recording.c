@@ -0,0 +1,132 @@
+// Records a key frame and a few frames of scattered dirty tiles on an odd
+// sized buffer with a shifted tile grid, then replays the file and checks
+// that every replayed buffer matches the one that was recorded.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "utils.h"
+
+
+#define TEST_WIDTH 101
+#define TEST_HEIGHT 67
+// Rows are padded, which the recording must not depend on
+#define TEST_STRIDE (TEST_WIDTH * 4 + 8)
+#define TEST_TILE 32u
+#define TEST_SHIFT_X 5u
+#define TEST_SHIFT_Y 17u
+#define TEST_FRAMES 5
+#define TEST_TILES_PER_FRAME 3
+
+
+static void fill_random(uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		data[i] = rand();
+	}
+}
+
+
+static void dirty_tile(struct wvnc_buffer *buffer, uint64_t *bits,
+					   uint32_t columns, uint32_t rows)
+{
+	uint32_t tx = rand() % columns, ty = rand() % rows;
+	uint32_t tile = ty * columns + tx;
+	bits[tile / 64] |= 1ull << (tile % 64);
+
+	// The grid is shifted, so the first row and column of tiles are cut
+	uint32_t x0 = tx * TEST_TILE < TEST_SHIFT_X ? 0 : tx * TEST_TILE - TEST_SHIFT_X;
+	uint32_t y0 = ty * TEST_TILE < TEST_SHIFT_Y ? 0 : ty * TEST_TILE - TEST_SHIFT_Y;
+	uint32_t x1 = min((tx + 1) * TEST_TILE - TEST_SHIFT_X, buffer->width);
+	uint32_t y1 = min((ty + 1) * TEST_TILE - TEST_SHIFT_Y, buffer->height);
+	for (uint32_t y = y0; y < y1; y++) {
+		uint8_t *row = (uint8_t *)buffer->data + y * buffer->stride;
+		fill_random(row + x0 * 4, (x1 - x0) * 4);
+	}
+}
+
+
+int main()
+{
+	char path[] = "/tmp/wvnc-test-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fail("Failed to create a temporary file");
+	}
+	close(fd);
+
+	size_t size = TEST_STRIDE * TEST_HEIGHT;
+	struct wvnc_buffer buffer = {
+		.width = TEST_WIDTH,
+		.height = TEST_HEIGHT,
+		.stride = TEST_STRIDE,
+		.format = WL_SHM_FORMAT_XRGB8888,
+		.data = xmalloc(size),
+	};
+	uint8_t *recorded[TEST_FRAMES];
+	uint32_t columns = (TEST_WIDTH + TEST_SHIFT_X + TEST_TILE - 1) / TEST_TILE;
+	uint32_t rows = (TEST_HEIGHT + TEST_SHIFT_Y + TEST_TILE - 1) / TEST_TILE;
+
+	srand(1);
+	struct recorder recorder;
+	recorder_open(&recorder, path);
+	for (int f = 0; f < TEST_FRAMES; f++) {
+		if (f == 0) {
+			fill_random(buffer.data, size);
+			recorder_key_frame(&recorder, &buffer, WL_OUTPUT_TRANSFORM_90);
+		} else {
+			uint64_t bits[(columns * rows + 63) / 64];
+			memset(bits, 0, sizeof(bits));
+			for (int i = 0; i < TEST_TILES_PER_FRAME; i++) {
+				dirty_tile(&buffer, bits, columns, rows);
+			}
+			recorder_frame(&recorder, &buffer, WL_OUTPUT_TRANSFORM_90, bits,
+						   TEST_TILE, TEST_SHIFT_X, TEST_SHIFT_Y);
+		}
+		recorded[f] = xmalloc(size);
+		memcpy(recorded[f], buffer.data, size);
+	}
+	recorder_close(&recorder);
+
+	struct wvnc_buffer replayed = buffer;
+	replayed.data = xmalloc(size);
+	struct replay replay;
+	replay_open(&replay, path);
+	int frames = 0, failures = 0;
+	while (replay_next(&replay)) {
+		if (frames == TEST_FRAMES) {
+			frames++;
+			break;
+		}
+		replay_apply(&replay, &replayed);
+		if (replay.frame.transform != WL_OUTPUT_TRANSFORM_90) {
+			printf("frame %d: transform %u\n", frames, replay.frame.transform);
+			failures++;
+		}
+		// Only the pixels count, not the padding
+		for (uint32_t y = 0; y < TEST_HEIGHT; y++) {
+			if (memcmp((uint8_t *)replayed.data + y * TEST_STRIDE,
+					   recorded[frames] + y * TEST_STRIDE, TEST_WIDTH * 4) != 0) {
+				printf("frame %d: row %u differs\n", frames, y);
+				failures++;
+				break;
+			}
+		}
+		frames++;
+	}
+	replay_close(&replay);
+	unlink(path);
+
+	if (frames != TEST_FRAMES) {
+		printf("replayed %d frames of %d\n", frames, TEST_FRAMES);
+		failures++;
+	}
+	for (int f = 0; f < TEST_FRAMES; f++) {
+		free(recorded[f]);
+	}
+	free(buffer.data);
+	free(replayed.data);
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,66 @@
+// Hands frames from a producer thread to the main thread through a frame
+// ring as fast as both can go, and checks that each arrives exactly once,
+// in order and with its own buffer.
+
+#include <stdio.h>
+#include <threads.h>
+
+#include "ring.h"
+#include "utils.h"
+
+
+#define TEST_FRAMES 200000u
+
+
+static struct frame_ring ring;
+static struct wvnc_buffer buffers[FRAME_RING_SIZE];
+
+
+static struct wvnc_buffer *buffer_for(uint64_t generation)
+{
+	return &buffers[generation % ARRAY_SIZE(buffers)];
+}
+
+
+static int produce(void *data)
+{
+	for (uint64_t generation = 1; generation <= TEST_FRAMES; ) {
+		if (frame_ring_push(&ring, buffer_for(generation), generation)) {
+			generation++;
+		} else {
+			thrd_yield();
+		}
+	}
+	return 0;
+}
+
+
+int main()
+{
+	frame_ring_init(&ring);
+	thrd_t producer;
+	if (thrd_create(&producer, produce, NULL) != thrd_success) {
+		fail("Failed to start the producer");
+	}
+
+	uint64_t last = 0;
+	int ret = EXIT_SUCCESS;
+	while (last < TEST_FRAMES) {
+		struct frame_ring_entry entry;
+		if (!frame_ring_pop(&ring, &entry)) {
+			thrd_yield();
+			continue;
+		}
+		if (entry.generation != last + 1 || entry.buffer != buffer_for(entry.generation)) {
+			printf("got frame %lu after %lu\n", entry.generation, last);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		last = entry.generation;
+	}
+	// The producer only finishes once everything got through
+	if (ret == EXIT_SUCCESS) {
+		thrd_join(producer, NULL);
+	}
+	return ret;
+}
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "utils.h"
+
+#include "thumbnail.h"
+
+
+// Thumbnails are small and written rarely, so this can afford to try
+#define THUMBNAIL_COMPRESSION 6
+
+// Plain GCC vector extensions like in buffer.c, two pixels of channels
+#define SUM_LANES 8
+typedef uint8_t v8u8 __attribute__((vector_size(SUM_LANES)));
+typedef uint32_t v8u32 __attribute__((vector_size(SUM_LANES * 4)));
+
+
+void thumbnail_init(struct thumbnail *thumbnail, uint32_t fb_width, uint32_t fb_height,
+					uint32_t tile_size, uint32_t width)
+{
+	memset(thumbnail, 0, sizeof(*thumbnail));
+	// Only ever scaled down, so that every pixel covers at least one
+	width = clamp(width, 1u, fb_width);
+	uint32_t height = ((uint64_t)fb_height * width + fb_width / 2) / fb_width;
+	thumbnail->width = width;
+	thumbnail->height = clamp(height, 1u, fb_height);
+	thumbnail->fb_width = fb_width;
+	thumbnail->fb_height = fb_height;
+	thumbnail->tile_size = tile_size;
+	thumbnail->tile_count_x = (fb_width + tile_size - 1) / tile_size;
+	thumbnail->tile_count_y = (fb_height + tile_size - 1) / tile_size;
+	thumbnail->stride = 1 + (size_t)thumbnail->width * 3;
+	// Filter type 0 everywhere, which xmalloc already did
+	thumbnail->pixels = xmalloc(thumbnail->stride * thumbnail->height);
+	thumbnail->span_start = xmalloc(thumbnail->height * sizeof(uint32_t));
+	thumbnail->span_end = xmalloc(thumbnail->height * sizeof(uint32_t));
+	thumbnail->column_sums = xmalloc((size_t)fb_width * 4 * sizeof(uint32_t));
+	thumbnail->compressed_capacity = compressBound(thumbnail->stride * thumbnail->height);
+	thumbnail->compressed = xmalloc(thumbnail->compressed_capacity);
+}
+
+
+void thumbnail_destroy(struct thumbnail *thumbnail)
+{
+	free(thumbnail->pixels);
+	free(thumbnail->span_start);
+	free(thumbnail->span_end);
+	free(thumbnail->column_sums);
+	free(thumbnail->compressed);
+	memset(thumbnail, 0, sizeof(*thumbnail));
+}
+
+
+// Framebuffer pixels covered by thumbnail pixel n along an axis
+static uint32_t footprint_start(uint32_t n, uint32_t size, uint32_t fb_size)
+{
+	return (uint64_t)n * fb_size / size;
+}
+
+
+static uint32_t footprint_end(uint32_t n, uint32_t size, uint32_t fb_size)
+{
+	return (uint64_t)(n + 1) * fb_size / size;
+}
+
+
+static void mark_tile(struct thumbnail *thumbnail, unsigned int tile)
+{
+	uint32_t x = tile % thumbnail->tile_count_x * thumbnail->tile_size;
+	uint32_t y = tile / thumbnail->tile_count_x * thumbnail->tile_size;
+	uint32_t x_end = min(x + thumbnail->tile_size, thumbnail->fb_width);
+	uint32_t y_end = min(y + thumbnail->tile_size, thumbnail->fb_height);
+	// The thumbnail pixels whose footprint overlaps the tile
+	uint32_t start = (uint64_t)x * thumbnail->width / thumbnail->fb_width;
+	uint32_t end = ((uint64_t)x_end * thumbnail->width + thumbnail->fb_width - 1) / thumbnail->fb_width;
+	uint32_t row_start = (uint64_t)y * thumbnail->height / thumbnail->fb_height;
+	uint32_t row_end = ((uint64_t)y_end * thumbnail->height + thumbnail->fb_height - 1) /
+		thumbnail->fb_height;
+	for (uint32_t row = row_start; row < row_end; row++) {
+		if (thumbnail->span_start[row] == thumbnail->span_end[row]) {
+			thumbnail->span_start[row] = start;
+			thumbnail->span_end[row] = end;
+		} else {
+			thumbnail->span_start[row] = min(thumbnail->span_start[row], start);
+			thumbnail->span_end[row] = max(thumbnail->span_end[row], end);
+		}
+	}
+}
+
+
+static void sum_columns(uint32_t *sums, const rgba_t *fb, uint32_t fb_width,
+						uint32_t x_start, uint32_t x_end, uint32_t y_start, uint32_t y_end)
+{
+	// All four channels of each column added up over the rows
+	size_t count = (size_t)(x_end - x_start) * 4;
+	memset(sums, 0, count * sizeof(uint32_t));
+	for (uint32_t y = y_start; y < y_end; y++) {
+		const uint8_t *row = (const uint8_t *)(fb + (size_t)y * fb_width + x_start);
+		size_t i = 0;
+		for (; i + SUM_LANES <= count; i += SUM_LANES) {
+			v8u8 in;
+			v8u32 sum;
+			memcpy(&in, row + i, sizeof(in));
+			memcpy(&sum, sums + i, sizeof(sum));
+			sum += __builtin_convertvector(in, v8u32);
+			memcpy(sums + i, &sum, sizeof(sum));
+		}
+		for (; i < count; i++) {
+			sums[i] += row[i];
+		}
+	}
+}
+
+
+static void filter_row(struct thumbnail *thumbnail, const rgba_t *fb, uint32_t row)
+{
+	uint32_t start = thumbnail->span_start[row];
+	uint32_t end = thumbnail->span_end[row];
+	uint32_t y_start = footprint_start(row, thumbnail->height, thumbnail->fb_height);
+	uint32_t y_end = footprint_end(row, thumbnail->height, thumbnail->fb_height);
+	uint32_t x_start = footprint_start(start, thumbnail->width, thumbnail->fb_width);
+	uint32_t x_end = footprint_end(end - 1, thumbnail->width, thumbnail->fb_width);
+	sum_columns(thumbnail->column_sums, fb, thumbnail->fb_width, x_start, x_end, y_start, y_end);
+
+	uint8_t *out = thumbnail->pixels + row * thumbnail->stride + 1 + start * 3;
+	for (uint32_t n = start; n < end; n++) {
+		uint32_t column_start = footprint_start(n, thumbnail->width, thumbnail->fb_width);
+		uint32_t column_end = footprint_end(n, thumbnail->width, thumbnail->fb_width);
+		uint64_t r = 0, g = 0, b = 0;
+		for (uint32_t x = column_start; x < column_end; x++) {
+			const uint32_t *sum = thumbnail->column_sums + (x - x_start) * 4;
+			r += sum[0];
+			g += sum[1];
+			b += sum[2];
+		}
+		uint64_t area = (uint64_t)(column_end - column_start) * (y_end - y_start);
+		*out++ = (r + area / 2) / area;
+		*out++ = (g + area / 2) / area;
+		*out++ = (b + area / 2) / area;
+	}
+}
+
+
+bool thumbnail_update(struct thumbnail *thumbnail, const rgba_t *fb,
+					  const uint64_t *tile_generation, uint64_t generation)
+{
+	memset(thumbnail->span_start, 0, thumbnail->height * sizeof(uint32_t));
+	memset(thumbnail->span_end, 0, thumbnail->height * sizeof(uint32_t));
+	bool changed = false;
+	unsigned int tile_count = thumbnail->tile_count_x * thumbnail->tile_count_y;
+	for (unsigned int tile = 0; tile < tile_count; tile++) {
+		if (tile_generation[tile] > thumbnail->generation) {
+			mark_tile(thumbnail, tile);
+			changed = true;
+		}
+	}
+	for (uint32_t row = 0; row < thumbnail->height; row++) {
+		if (thumbnail->span_start[row] != thumbnail->span_end[row]) {
+			filter_row(thumbnail, fb, row);
+		}
+	}
+	thumbnail->generation = generation;
+	return changed;
+}
+
+
+static void put_be32(uint8_t *out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+
+static bool write_chunk(FILE *file, const char *type, const uint8_t *data, uint32_t length)
+{
+	uint8_t header[8];
+	put_be32(header, length);
+	memcpy(header + 4, type, 4);
+	// Not handing zlib a NULL, which would start the CRC over
+	uLong value = crc32(0, header + 4, 4);
+	if (length > 0) {
+		value = crc32(value, data, length);
+	}
+	uint8_t crc[4];
+	put_be32(crc, value);
+	return fwrite(header, sizeof(header), 1, file) == 1 &&
+		(length == 0 || fwrite(data, length, 1, file) == 1) &&
+		fwrite(crc, sizeof(crc), 1, file) == 1;
+}
+
+
+void thumbnail_write(struct thumbnail *thumbnail, const char *path)
+{
+	uLongf compressed_size = thumbnail->compressed_capacity;
+	if (compress2(thumbnail->compressed, &compressed_size, thumbnail->pixels,
+				  thumbnail->stride * thumbnail->height, THUMBNAIL_COMPRESSION) != Z_OK) {
+		log_error("Failed to compress the thumbnail");
+		return;
+	}
+
+	size_t length = strlen(path) + sizeof(".tmp");
+	char *tmp_path = xmalloc(length);
+	snprintf(tmp_path, length, "%s.tmp", path);
+	FILE *file = fopen(tmp_path, "wb");
+	if (file == NULL) {
+		log_error("Failed to open %s for the thumbnail", tmp_path);
+		free(tmp_path);
+		return;
+	}
+	// 8 bit RGB, no interlacing
+	uint8_t ihdr[13] = { 0 };
+	put_be32(ihdr, thumbnail->width);
+	put_be32(ihdr + 4, thumbnail->height);
+	ihdr[8] = 8;
+	ihdr[9] = 2;
+	bool ok = fwrite("\x89PNG\r\n\x1a\n", 8, 1, file) == 1 &&
+		write_chunk(file, "IHDR", ihdr, sizeof(ihdr)) &&
+		write_chunk(file, "IDAT", thumbnail->compressed, compressed_size) &&
+		write_chunk(file, "IEND", NULL, 0);
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(tmp_path, path) < 0) {
+		log_error("Failed to write the thumbnail to %s", path);
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wvnc.h"
+
+
+// Downscaled copy of the framebuffer, written out as a PNG for previews.
+// Each thumbnail pixel is the average of the framebuffer pixels it covers,
+// and only the ones covering tiles that changed since the last update get
+// computed again.
+
+struct thumbnail {
+	uint32_t width;
+	uint32_t height;
+	uint32_t fb_width;
+	uint32_t fb_height;
+	uint32_t tile_size;
+	uint32_t tile_count_x;
+	uint32_t tile_count_y;
+	// Frame the pixels are up to date with
+	uint64_t generation;
+	// PNG scanlines, a filter type byte and then RGB
+	uint8_t *pixels;
+	size_t stride;
+	// Columns to compute again in each row, start == end if none
+	uint32_t *span_start;
+	uint32_t *span_end;
+	// Scratch space, per channel sums of framebuffer columns and the
+	// compressed image
+	uint32_t *column_sums;
+	uint8_t *compressed;
+	size_t compressed_capacity;
+};
+
+
+// The height follows from the aspect ratio of the framebuffer
+void thumbnail_init(struct thumbnail *thumbnail, uint32_t fb_width, uint32_t fb_height,
+					uint32_t tile_size, uint32_t width);
+void thumbnail_destroy(struct thumbnail *thumbnail);
+
+// Brings the pixels up to date with the tiles that changed since the last
+// call, returns whether there were any
+bool thumbnail_update(struct thumbnail *thumbnail, const rgba_t *fb,
+					  const uint64_t *tile_generation, uint64_t generation);
+
+// Writes a PNG, through a temporary file so that readers never see half
+// of one
+void thumbnail_write(struct thumbnail *thumbnail, const char *path);
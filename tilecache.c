@@ -0,0 +1,107 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "tilecache.h"
+
+
+// Number of distinct client profiles we keep per tile. More than that
+// just means some of them get re-encoded each frame.
+#define TILE_CACHE_SLOTS 4
+
+
+void tile_cache_init(struct tile_cache *cache, unsigned int tile_count)
+{
+	cache->tile_count = tile_count;
+	cache->entries = xmalloc(tile_count * TILE_CACHE_SLOTS * sizeof(struct tile_cache_entry));
+	cache->hits = 0;
+	cache->misses = 0;
+}
+
+
+void tile_cache_destroy(struct tile_cache *cache)
+{
+	for (unsigned int i = 0; i < cache->tile_count * TILE_CACHE_SLOTS; i++) {
+		free(cache->entries[i].data);
+	}
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->tile_count = 0;
+}
+
+
+static bool format_equal(const rfbPixelFormat *a, const rfbPixelFormat *b)
+{
+	// Field by field, the struct has padding and the pad members are
+	// whatever the client sent
+	return a->bitsPerPixel == b->bitsPerPixel && a->depth == b->depth &&
+		a->bigEndian == b->bigEndian && a->trueColour == b->trueColour &&
+		a->redMax == b->redMax && a->greenMax == b->greenMax && a->blueMax == b->blueMax &&
+		a->redShift == b->redShift && a->greenShift == b->greenShift &&
+		a->blueShift == b->blueShift;
+}
+
+
+static bool profile_equal(const struct tile_profile *a, const struct tile_profile *b)
+{
+	return a->encoding == b->encoding && a->quality == b->quality &&
+		format_equal(&a->format, &b->format);
+}
+
+
+struct tile_cache_entry *tile_cache_lookup(struct tile_cache *cache, unsigned int tile,
+										   uint64_t generation,
+										   const struct tile_profile *profile)
+{
+	struct tile_cache_entry *slots = &cache->entries[tile * TILE_CACHE_SLOTS];
+	for (unsigned int i = 0; i < TILE_CACHE_SLOTS; i++) {
+		if (slots[i].data != NULL && slots[i].generation == generation &&
+			profile_equal(&slots[i].profile, profile)) {
+			cache->hits++;
+			return &slots[i];
+		}
+	}
+	cache->misses++;
+	return NULL;
+}
+
+
+struct tile_cache_entry *tile_cache_insert(struct tile_cache *cache, unsigned int tile,
+										   uint64_t generation,
+										   const struct tile_profile *profile,
+										   size_t capacity)
+{
+	// Reuse the slot of the same profile if there is one, otherwise evict
+	// the one that has been stale the longest
+	struct tile_cache_entry *slots = &cache->entries[tile * TILE_CACHE_SLOTS];
+	struct tile_cache_entry *entry = &slots[0];
+	for (unsigned int i = 0; i < TILE_CACHE_SLOTS; i++) {
+		if (slots[i].data != NULL && profile_equal(&slots[i].profile, profile)) {
+			entry = &slots[i];
+			break;
+		}
+		if (slots[i].generation < entry->generation) {
+			entry = &slots[i];
+		}
+	}
+	if (entry->capacity < capacity) {
+		free(entry->data);
+		entry->data = xmalloc(capacity);
+		entry->capacity = capacity;
+	}
+	entry->profile = *profile;
+	entry->generation = generation;
+	entry->size = 0;
+	return entry;
+}
+
+
+void tile_cache_invalidate(struct tile_cache *cache, unsigned int tile)
+{
+	struct tile_cache_entry *slots = &cache->entries[tile * TILE_CACHE_SLOTS];
+	for (unsigned int i = 0; i < TILE_CACHE_SLOTS; i++) {
+		free(slots[i].data);
+		slots[i] = (struct tile_cache_entry) { 0 };
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rfb/rfb.h>
+
+
+// Everything besides the pixels that determines the encoded bytes
+struct tile_profile {
+	int32_t encoding;
+	int32_t quality;
+	rfbPixelFormat format;
+};
+
+
+struct tile_cache_entry {
+	struct tile_profile profile;
+	uint64_t generation;
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+};
+
+
+struct tile_cache {
+	unsigned int tile_count;
+	struct tile_cache_entry *entries;
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
+
+void tile_cache_init(struct tile_cache *cache, unsigned int tile_count);
+void tile_cache_destroy(struct tile_cache *cache);
+
+struct tile_cache_entry *tile_cache_lookup(struct tile_cache *cache, unsigned int tile,
+										   uint64_t generation,
+										   const struct tile_profile *profile);
+struct tile_cache_entry *tile_cache_insert(struct tile_cache *cache, unsigned int tile,
+										   uint64_t generation,
+										   const struct tile_profile *profile,
+										   size_t capacity);
+// Drops what is cached of the tile, for when its pixels changed without a
+// new generation
+void tile_cache_invalidate(struct tile_cache *cache, unsigned int tile);
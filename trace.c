@@ -0,0 +1,135 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#include "trace.h"
+
+
+#define TRACE_RING_SIZE (1 << 16)
+
+
+struct trace_entry {
+	const char *name;
+	uint64_t ts;
+	int64_t arg;
+	char phase;
+};
+
+
+struct trace_ring {
+	struct trace_entry entries[TRACE_RING_SIZE];
+	atomic_uint_fast64_t head;
+	pid_t tid;
+	const char *name;
+
+	struct trace_ring *next;
+};
+
+
+bool trace_enabled = false;
+
+static const char *trace_path;
+static _Atomic(struct trace_ring *) trace_rings;
+static thread_local struct trace_ring *trace_ring;
+
+
+void trace_init(const char *path)
+{
+	trace_path = path;
+	trace_enabled = true;
+}
+
+
+uint64_t trace_now()
+{
+	// Not CLOCK_MONOTONIC_RAW, so that we are in the same time base as the
+	// compositor timestamps
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+
+static struct trace_ring *get_ring()
+{
+	if (trace_ring != NULL) {
+		return trace_ring;
+	}
+	struct trace_ring *ring = xmalloc(sizeof(struct trace_ring));
+	ring->tid = syscall(SYS_gettid);
+	ring->next = atomic_load(&trace_rings);
+	while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring)) {
+	}
+	trace_ring = ring;
+	return ring;
+}
+
+
+void trace_thread_name(const char *name)
+{
+	if (trace_enabled) {
+		get_ring()->name = name;
+	}
+}
+
+
+void trace_event(const char *name, char phase, uint64_t ts, int64_t arg)
+{
+	struct trace_ring *ring = get_ring();
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct trace_entry *entry = &ring->entries[head % TRACE_RING_SIZE];
+	entry->name = name;
+	entry->ts = ts;
+	entry->arg = arg;
+	entry->phase = phase;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+void trace_write()
+{
+	if (!trace_enabled) {
+		return;
+	}
+	FILE *f = fopen(trace_path, "w");
+	if (f == NULL) {
+		log_error("Failed to open trace file %s", trace_path);
+		return;
+	}
+	pid_t pid = getpid();
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (struct trace_ring *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+		if (ring->name != NULL) {
+			fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+					"\"args\":{\"name\":\"%s\"}}",
+					first ? "" : ",\n", pid, ring->tid, ring->name);
+			first = false;
+		}
+		// The owning thread may keep writing while we read, so the oldest
+		// few entries can be torn. Good enough for a debugging aid.
+		uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		for (uint64_t i = start; i < head; i++) {
+			struct trace_entry *entry = &ring->entries[i % TRACE_RING_SIZE];
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRIu64 ",\"pid\":%d,\"tid\":%d",
+					first ? "" : ",\n", entry->name, entry->phase,
+					entry->ts, pid, ring->tid);
+			if (entry->phase == 'i') {
+				fprintf(f, ",\"s\":\"t\",\"args\":{\"value\":%" PRId64 "}", entry->arg);
+			}
+			fputc('}', f);
+			first = false;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	log_info("Trace written to %s", trace_path);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Chrome trace event recording. Events go into a per-thread ring buffer
+// and are only written out on trace_write(), so the hot paths just pay for
+// a clock read and a few stores.
+
+extern bool trace_enabled;
+
+void trace_init(const char *path);
+void trace_thread_name(const char *name);
+void trace_event(const char *name, char phase, uint64_t ts, int64_t arg);
+void trace_write();
+
+uint64_t trace_now();
+
+
+static inline void trace_begin(const char *name)
+{
+	if (trace_enabled) {
+		trace_event(name, 'B', trace_now(), 0);
+	}
+}
+
+
+static inline void trace_end(const char *name)
+{
+	if (trace_enabled) {
+		trace_event(name, 'E', trace_now(), 0);
+	}
+}
+
+
+static inline void trace_instant(const char *name, int64_t arg)
+{
+	if (trace_enabled) {
+		trace_event(name, 'i', trace_now(), arg);
+	}
+}
+
+
+// For events that happened at some other time, e.g. compositor timestamps
+static inline void trace_instant_at(const char *name, uint64_t ts, int64_t arg)
+{
+	if (trace_enabled) {
+		trace_event(name, 'i', ts, arg);
+	}
+}
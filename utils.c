@@ -1,11 +1,16 @@
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "utils.h"
 
@@ -70,6 +75,14 @@ uint64_t time_monotonic()
 }
 
 
+uint64_t time_monotonic_ns()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &time);
+	return time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+
 int shm_create()
 {
 	const char *filename_format = "/wvnc-%d";
@@ -89,3 +102,62 @@ int shm_create()
 	}
 	return fd;
 }
+
+
+static void remove_stale_socket(const char *path, const struct sockaddr_un *addr)
+{
+	// Only a socket nobody listens on anymore, left behind by an instance
+	// that did not shut down cleanly
+	struct stat st;
+	if (lstat(path, &st) < 0) {
+		if (errno != ENOENT) {
+			fail("Failed to stat %s: %s", path, strerror(errno));
+		}
+		return;
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		fail("%s exists and is not a socket", path);
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fail("Failed to create unix socket");
+	}
+	int ret = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+	int error = errno;
+	close(fd);
+	if (ret == 0) {
+		fail("Address in use: %s", path);
+	}
+	if (error != ECONNREFUSED) {
+		fail("Failed to check %s: %s", path, strerror(error));
+	}
+	unlink(path);
+}
+
+
+int unix_listen(const char *path, unsigned int mode)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fail("Socket path %s is too long", path);
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fail("Failed to create unix socket");
+	}
+	remove_stale_socket(path, &addr);
+	// Bind with the final permissions already in place, so that there is no
+	// window where someone else could connect
+	mode_t old_umask = umask(~mode & 0777);
+	int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_umask);
+	if (ret < 0) {
+		fail("Failed to bind unix socket %s", path);
+	}
+	if (chmod(path, mode) < 0 || listen(fd, 8) < 0) {
+		fail("Failed to listen on unix socket %s", path);
+	}
+	return fd;
+}
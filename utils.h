@@ -13,9 +13,14 @@ void log_error(const char *format, ...);
 void *xmalloc(size_t size);
 
 uint64_t time_monotonic();
+// For timing things that take less than a microsecond
+uint64_t time_monotonic_ns();
 
 int shm_create();
 
+// Returns a non-blocking listening socket bound to path
+int unix_listen(const char *path, unsigned int mode);
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
 #define max(a,b) \
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -12,6 +13,7 @@
 
 struct wvnc;
 struct wvnc_output;
+struct zwlr_screencopy_frame_v1;
 
 struct rgba {
 	uint8_t r;
@@ -22,8 +24,25 @@ struct rgba {
 typedef struct rgba rgba_t;
 static_assert(sizeof(struct rgba) == 4, "Invalid size of struct rgba");
 
+struct wvnc_buffer;
+
+// Converts a rectangle of a screencopy buffer into the RFB framebuffer
+typedef void (*buffer_convert_fn)(rgba_t *fb, uint32_t width, uint32_t height,
+								  struct wvnc_buffer *buffer,
+								  uint32_t src_x, uint32_t src_y,
+								  uint32_t src_w, uint32_t src_h);
+
+enum wvnc_buffer_state {
+	WVNC_BUFFER_FREE,
+	WVNC_BUFFER_CAPTURING,
+	WVNC_BUFFER_READY,
+	WVNC_BUFFER_PUBLISHED,  // Handed over to the main thread
+	WVNC_BUFFER_HELD,  // Last processed frame, used as the diff reference
+};
+
 struct wvnc_buffer {
 	struct wvnc *wvnc;
+	struct zwlr_screencopy_frame_v1 *frame;
 
 	struct wl_buffer *wl;
 	void *data;
@@ -34,11 +53,21 @@ struct wvnc_buffer {
 	enum wl_shm_format format;
 	bool y_invert;
 
-	bool done;
+	// Conversion kernel and the configuration it was picked for
+	buffer_convert_fn convert;
+	enum wl_shm_format convert_format;
+	bool convert_y_invert;
+	enum wl_output_transform convert_transform;
+
+	// The main thread hands buffers back to the capture thread by setting
+	// this to WVNC_BUFFER_FREE
+	_Atomic enum wvnc_buffer_state state;
+	uint64_t seq;
 };
 
 
 struct wvnc_output {
+	struct wvnc *wvnc;
 	struct wl_output *wl;
 	struct zxdg_output_v1 *xdg;
 	struct wl_list link;
@@ -53,6 +82,21 @@ struct wvnc_output {
 };
 
 
+// The part of the selected output that we capture, in output local
+// logical coordinates, and the size of the RFB framebuffer it ends up in.
+// The two differ when the output is scaled.
+struct wvnc_capture {
+	int32_t x;
+	int32_t y;
+	uint32_t width;
+	uint32_t height;
+	enum wl_output_transform transform;
+
+	uint32_t fb_width;
+	uint32_t fb_height;
+};
+
+
 struct wvnc_seat {
 	struct wl_seat *wl;
 	const char *name;